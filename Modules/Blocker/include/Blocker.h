@@ -33,13 +33,15 @@
 
 #include "PomaDefault.h"
 
-class Blocker : public poma::Module<Blocker, PomaDataType> {
+class Blocker : public poma::AsyncModule<Blocker, PomaDataType> {
 public:
     Blocker(const std::string& mid);
-    void on_incoming_data(PomaPacketType& dta, const std::string& channel) override;
     void setup_cli(boost::program_options::options_description& desc) const override;
     void process_cli(boost::program_options::variables_map& vm) override;
 
+protected:
+    void on_incoming_async(const TaskPointer& task) override;
+
 private:
     int m_wait{0};
 
@@ -30,33 +30,38 @@
 
 #include "Blocker.h"
 #include <chrono>
-#include <thread>
 
 DEFAULT_EXPORT_ALL(Blocker, "Blocker module (delays packets for the specified amount of time)", "", false)
 
-Blocker::Blocker(const std::string& mid) : Module<Blocker, PomaDataType>(mid)
+Blocker::Blocker(const std::string& mid) : poma::AsyncModule<Blocker, PomaDataType>(mid)
 {
 }
 
-void Blocker::on_incoming_data(PomaPacketType& dta, const std::string& channel)
+/* The packet waits on the event loop, not on the calling thread */
+void Blocker::on_incoming_async(const TaskPointer& task)
 {
     if (m_wait < 0) {
-        for(;;) {};
-    } else if (m_wait > 0) {
-        std::this_thread::sleep_for(std::chrono::seconds(m_wait));
+        // Held forever: once inflight packets are held, senders block
+        return;
     }
-    submit_data(dta);
+    if (m_wait == 0) {
+        complete(task);
+        return;
+    }
+    poma::EventLoop::instance().after(std::chrono::seconds(m_wait), [this, task] { complete(task); });
 }
 
 void Blocker::setup_cli(boost::program_options::options_description& desc) const
 {
     boost::program_options::options_description buf("Blocker options");
     buf.add_options()
-    ("wait", boost::program_options::value<int>()->default_value(1), "wait time in seconds (-1 infinite)");
+    ("wait", boost::program_options::value<int>()->default_value(1), "wait time in seconds (-1 infinite)")
+    ("inflight", boost::program_options::value<unsigned int>()->default_value(1), "maximum number of packets waiting at the same time");
     desc.add(buf);
 }
 
 void Blocker::process_cli(boost::program_options::variables_map& vm)
 {
     m_wait = vm["wait"].as<int>();
+    set_max_in_flight(vm["inflight"].as<unsigned int>());
 }
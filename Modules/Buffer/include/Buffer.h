@@ -48,23 +48,40 @@ public:
     Buffer& operator=(const Buffer& o);
     void initialize() override;
     void on_incoming_data(PomaPacketType& dta, const std::string& channel) override;
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel) override;
+    void on_incoming_batch(PomaPacketBatch&& batch, const std::string& channel) override;
+    poma::SubmitStatus on_offer(PomaPacketType&& dta, const std::string& channel) override;
+    bool would_block(const PomaPacketType& dta, const std::string& channel) override;
     void setup_cli(boost::program_options::options_description& desc) const override;
     void process_cli(boost::program_options::variables_map& vm);
     void flush() override;
+    void shutdown() override;
 
 protected:
+    void enqueue(PomaPacketType&& dta);
+    void push(PomaPacketType&& dta);
+    bool full() const;
+    void wait_for_space(std::unique_lock<std::mutex>& lock);
+    void notify();
+    bool deliver();
     void collector_fn();
 
 private:
-    std::atomic_int buffer_size{0};
+    poma::InFlightCounter buffer_size;
     int incoming_dtu{0};
     std::vector<std::thread> m_thread_pool;
     std::condition_variable outgoing_data_available_cv;
+    std::condition_variable space_available_cv;
     std::mutex m_outgoing_queue_mutex;
     std::queue<PomaPacketType> m_outgoing_queue;
     unsigned int m_warn_size{1024};
     int m_packetskip{1};
-    bool m_dontcopy{false};
+    unsigned int m_max_size{0};
+    bool m_drop{false};
+    bool m_stopping{false};
+    bool m_shared{false};
+    poma::Scheduler::Group* m_group{nullptr};
+    std::atomic<bool> m_delivering{false};
 };
 
 #endif
@@ -37,15 +37,20 @@ Buffer::Buffer(const std::string& mid) : poma::Module<Buffer,PomaDataType>(mid)
 Buffer::~Buffer()
 {
     assert(m_outgoing_queue.size() == 0);
-    for (auto& t : m_thread_pool) {
-        t.detach();
-    }
+    shutdown();
 }
 
 Buffer::Buffer(const Buffer& o) : poma::Module<Buffer,PomaDataType>(o.m_module_id)
 {
     m_warn_size = o.m_warn_size;
     m_packetskip = o.m_packetskip;
+    m_max_size = o.m_max_size;
+    m_drop = o.m_drop;
+    m_shared = o.m_shared;
+    // Clones made by a parallel executor deliver their own packets
+    if (!o.m_thread_pool.empty() || o.m_group != nullptr) {
+        initialize();
+    }
 }
 
 Buffer& Buffer::operator=(const Buffer& o)
@@ -53,31 +58,154 @@ Buffer& Buffer::operator=(const Buffer& o)
     m_module_id = o.m_module_id;
     m_warn_size = o.m_warn_size;
     m_packetskip = o.m_packetskip;
+    m_max_size = o.m_max_size;
+    m_drop = o.m_drop;
+    m_shared = o.m_shared;
     return *this;
 }
 
 void Buffer::initialize()
 {
-    m_thread_pool.push_back(std::thread {&Buffer::collector_fn, this});
+    if (m_shared) {
+        // Packets are delivered by one thread at a time, in order
+        m_group = poma::Scheduler::instance().join(m_module_id, 1, [this] { return deliver(); });
+    } else {
+        m_thread_pool.push_back(std::thread {&Buffer::collector_fn, this});
+    }
 }
 
 void Buffer::on_incoming_data(PomaPacketType& dta, const std::string& channel)
+{
+    if (incoming_dtu % m_packetskip != 0) {
+        return;
+    }
+    // The packet still belongs to the caller: queue a copy
+    enqueue(PomaPacketType{dta});
+}
+
+void Buffer::on_incoming_data(PomaPacketType&& dta, const std::string& channel)
+{
+    if (incoming_dtu % m_packetskip != 0) {
+        return;
+    }
+    enqueue(std::move(dta));
+}
+
+void Buffer::on_incoming_batch(PomaPacketBatch&& batch, const std::string& channel)
 {
     if (incoming_dtu % m_packetskip != 0) {
         return;
     }
     {
         std::unique_lock<std::mutex> lock(m_outgoing_queue_mutex);
-        buffer_size++;
-        m_outgoing_queue.push(dta);
-        if (++incoming_dtu % 256 == 0) {
-            std::cerr << ">>>> Queue " << m_module_id << ", size: " << m_outgoing_queue.size() << std::endl;
+        if (!m_drop) {
+            // The bound is checked once for the whole batch
+            wait_for_space(lock);
+        }
+        for (auto& dta : batch) {
+            if (m_drop && full()) {
+                discard_data(std::move(dta));
+                continue;
+            }
+            push(std::move(dta));
         }
         if (m_outgoing_queue.size() > m_warn_size) {
             std::cerr << ">>>> Warning " << m_module_id << ": queue size is << " << m_outgoing_queue.size() << std::endl;
         }
     }
-    outgoing_data_available_cv.notify_one();
+    notify();
+}
+
+/* Queues are unbounded unless maxsize is set */
+bool Buffer::full() const
+{
+    return m_max_size != 0 && m_outgoing_queue.size() >= m_max_size;
+}
+
+/* Must be called with the queue mutex held. In shared mode the caller
+   (possibly a thread of the scheduler) delivers the queued packets itself */
+void Buffer::wait_for_space(std::unique_lock<std::mutex>& lock)
+{
+    if (!m_shared) {
+        space_available_cv.wait(lock, [&] { return !full(); });
+        return;
+    }
+    while (full()) {
+        lock.unlock();
+        if (!deliver()) {
+            std::this_thread::yield();
+        }
+        lock.lock();
+    }
+}
+
+void Buffer::notify()
+{
+    if (m_shared) {
+        poma::Scheduler::instance().wake(m_group);
+    } else {
+        outgoing_data_available_cv.notify_one();
+    }
+}
+
+poma::SubmitStatus Buffer::on_offer(PomaPacketType&& dta, const std::string& channel)
+{
+    if (incoming_dtu % m_packetskip != 0) {
+        return poma::SubmitStatus::ACCEPTED;
+    }
+    {
+        std::unique_lock<std::mutex> lock(m_outgoing_queue_mutex);
+        if (full()) {
+            if (m_drop) {
+                lock.unlock();
+                discard_data(std::move(dta));
+                return poma::SubmitStatus::DROPPED;
+            }
+            return poma::SubmitStatus::WOULD_BLOCK;
+        }
+        push(std::move(dta));
+    }
+    notify();
+    return poma::SubmitStatus::ACCEPTED;
+}
+
+bool Buffer::would_block(const PomaPacketType& dta, const std::string& channel)
+{
+    if (m_drop || incoming_dtu % m_packetskip != 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_outgoing_queue_mutex);
+    return full();
+}
+
+/* Must be called with the queue mutex held */
+void Buffer::push(PomaPacketType&& dta)
+{
+    buffer_size.add();
+    m_outgoing_queue.push(std::move(dta));
+    if (++incoming_dtu % 256 == 0) {
+        std::cerr << ">>>> Queue " << m_module_id << ", size: " << m_outgoing_queue.size() << std::endl;
+    }
+}
+
+void Buffer::enqueue(PomaPacketType&& dta)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_outgoing_queue_mutex);
+        if (full()) {
+            if (m_drop) {
+                lock.unlock();
+                discard_data(std::move(dta));
+                return;
+            }
+            wait_for_space(lock);
+        }
+        push(std::move(dta));
+        if (m_outgoing_queue.size() > m_warn_size) {
+            std::cerr << ">>>> Warning " << m_module_id << ": queue size is << " << m_outgoing_queue.size() << std::endl;
+        }
+    }
+    notify();
 }
 
 void Buffer::setup_cli(boost::program_options::options_description& desc) const
@@ -85,7 +213,10 @@ void Buffer::setup_cli(boost::program_options::options_description& desc) const
     boost::program_options::options_description buf("Buffer options");
     buf.add_options()
     ("warnsize", boost::program_options::value<int>()->default_value(1024), "buffer warn size")
-    ("packetskip", boost::program_options::value<int>()->default_value(1), "number of skip packets");
+    ("packetskip", boost::program_options::value<int>()->default_value(1), "number of skip packets")
+    ("maxsize", boost::program_options::value<unsigned int>()->default_value(0), "maximum number of queued packets (0: unbounded)")
+    ("overflow", boost::program_options::value<std::string>()->default_value("block"), "when the buffer is full: block or drop incoming packets")
+    ("shared", boost::program_options::value<bool>()->default_value(false), "deliver the packets from the process-wide scheduler instead of a dedicated thread");
     desc.add(buf);
 }
 
@@ -93,28 +224,88 @@ void Buffer::process_cli(boost::program_options::variables_map& vm)
 {
     m_warn_size = (unsigned int) vm["warnsize"].as<int>();
     m_packetskip = vm["packetskip"].as<int>();
+    m_max_size = vm["maxsize"].as<unsigned int>();
+    std::string overflow{vm["overflow"].as<std::string>()};
+    if (overflow == "block") {
+        m_drop = false;
+    } else if (overflow == "drop") {
+        m_drop = true;
+    } else {
+        std::cerr << "Invalid overflow policy " << overflow << std::endl;
+        exit(1);
+    }
+    m_shared = vm["shared"].as<bool>();
 }
 
 void Buffer::flush()
 {
-    while(buffer_size != 0) {
-        std::this_thread::yield();
-    };
+    buffer_size.wait_idle();
+}
+
+void Buffer::shutdown()
+{
+    if (m_group != nullptr) {
+        poma::Scheduler::instance().leave(m_group);
+        m_group = nullptr;
+    }
+    {
+        std::unique_lock<std::mutex> lock(m_outgoing_queue_mutex);
+        m_stopping = true;
+    }
+    outgoing_data_available_cv.notify_all();
+    for (auto& t : m_thread_pool) {
+        t.join();
+    }
+    m_thread_pool.clear();
 }
 
 void Buffer::collector_fn()
 {
-    while(true) {
-        PomaPacketType du;
+    poma::Placement::instance().pin(m_module_id + " collector");
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_outgoing_queue_mutex);
+            outgoing_data_available_cv.wait(lock, [&] { return !m_outgoing_queue.empty() || m_stopping; });
+            if (m_outgoing_queue.empty()) {
+                return;
+            }
+        }
+        deliver();
+    }
+}
+
+/* Everything queued so far leaves as a single batch. Packets are
+   delivered by one thread at a time: returns false when another one is
+   delivering or when the queue is empty */
+bool Buffer::deliver()
+{
+    bool delivered{false};
+    while (!m_delivering.exchange(true)) {
+        PomaPacketBatch batch;
         {
             std::unique_lock<std::mutex> lock(m_outgoing_queue_mutex);
-            while (m_outgoing_queue.empty()) {
-                outgoing_data_available_cv.wait(lock, [&] { return !m_outgoing_queue.empty(); });
+            batch.reserve(m_outgoing_queue.size());
+            while (!m_outgoing_queue.empty()) {
+                batch.push_back(std::move(m_outgoing_queue.front()));
+                m_outgoing_queue.pop();
+            }
+        }
+        if (!batch.empty()) {
+            space_available_cv.notify_all();
+            int n {(int) batch.size()};
+            if (n == 1) {
+                submit_data(std::move(batch[0]));
+            } else {
+                submit_batch(std::move(batch));
             }
-            du = m_outgoing_queue.front();
-            m_outgoing_queue.pop();
+            buffer_size.remove(n);
+            delivered = true;
+        }
+        m_delivering = false;
+        std::unique_lock<std::mutex> lock(m_outgoing_queue_mutex);
+        if (m_outgoing_queue.empty()) {
+            break;
         }
-        submit_data(du);
-        buffer_size--;
     }
+    return delivered;
 }
@@ -40,7 +40,7 @@ void Dummy::on_incoming_data(PomaPacketType& dta, const std::string& channel)
 {
     std::string serialized_data;
     serialize(dta, serialized_data);
-    PomaPacketType dta2;
+    PomaPacketType dta2{PomaPacketPool::acquire()};
     deserialize(dta2, serialized_data);
-    submit_data(dta2);
+    submit_data(std::move(dta2));
 }
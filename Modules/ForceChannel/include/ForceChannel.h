@@ -37,6 +37,7 @@ class ForceChannel : public poma::Module<ForceChannel, PomaDataType> {
 public:
     ForceChannel(const std::string& mid);
     void on_incoming_data(PomaPacketType& dta, const std::string& channel) override;
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel) override;
     void setup_cli(boost::program_options::options_description& desc) const override;
     void process_cli(boost::program_options::variables_map& vm) override;
 
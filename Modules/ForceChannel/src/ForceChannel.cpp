@@ -38,6 +38,11 @@ void ForceChannel::on_incoming_data(PomaPacketType& dta, const std::string& chan
     submit_data(dta, m_channel);
 }
 
+void ForceChannel::on_incoming_data(PomaPacketType&& dta, const std::string& channel)
+{
+    submit_data(std::move(dta), m_channel);
+}
+
 void ForceChannel::setup_cli(boost::program_options::options_description& desc) const
 {
     boost::program_options::options_description options("Force Channel Options");
@@ -38,9 +38,13 @@ public:
     GenericSplitter(const std::string& mid);
     void construct(std::vector<std::string> parameters) override;
     void on_incoming_data(PomaPacketType& dta, const std::string& channel) override;
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel) override;
+    void on_incoming_batch(PomaPacketBatch&& batch, const std::string& channel) override;
 
 private:
-    std::string m_property_name;
+    bool channel_for(const PomaPacketType& dta, poma::ChannelHandle& channel, std::string& dclass) const;
+
+    poma::PropertyKey m_property_name;
 
 };
 
@@ -43,12 +43,80 @@ void GenericSplitter::construct(std::vector<std::string> parameters)
     m_property_name = parameters.at(0);
 }
 
+/* Classes are looked up among the existing channels instead of being
+   registered: the property may take any number of values. A class that
+   names no channel is left in dclass and sent by name, which only reaches
+   a sink when the splitter has a single channel */
+bool GenericSplitter::channel_for(const PomaPacketType& dta, poma::ChannelHandle& channel, std::string& dclass) const
+{
+    const poma::PropertyValue* v{dta.m_properties.find(m_property_name.id())};
+    if (v == nullptr) {
+        channel = poma::ChannelHandle::default_channel();
+        return true;
+    }
+    if (v->type() == poma::PropertyValue::Type::STRING) {
+        const std::string& value{v->string_value()};
+        if (value.empty()) {
+            channel = poma::ChannelHandle::default_channel();
+            return true;
+        }
+        if (poma::ChannelHandle::find(value, channel)) {
+            return true;
+        }
+        dclass = value;
+        return false;
+    }
+    dclass = dta.m_properties.get(m_property_name, "");
+    if (dclass.empty()) {
+        channel = poma::ChannelHandle::default_channel();
+        return true;
+    }
+    return poma::ChannelHandle::find(dclass, channel);
+}
+
 void GenericSplitter::on_incoming_data(PomaPacketType& dta, const std::string& channel)
 {
-    std::string dclass = dta.m_properties.get(m_property_name, "");
-    if (dclass != "") {
+    poma::ChannelHandle handle;
+    std::string dclass;
+    if (channel_for(dta, handle, dclass)) {
+        submit_data(dta, handle);
+    } else {
         submit_data(dta, dclass);
+    }
+}
+
+void GenericSplitter::on_incoming_data(PomaPacketType&& dta, const std::string& channel)
+{
+    poma::ChannelHandle handle;
+    std::string dclass;
+    if (channel_for(dta, handle, dclass)) {
+        submit_data(std::move(dta), handle);
     } else {
-        submit_data(dta);
+        submit_data(std::move(dta), dclass);
+    }
+}
+
+void GenericSplitter::on_incoming_batch(PomaPacketBatch&& batch, const std::string& channel)
+{
+    // Packets are grouped by class, preserving their order within each class
+    std::vector<std::pair<poma::ChannelHandle, PomaPacketBatch> > groups;
+    std::string dclass;
+    for (auto& dta : batch) {
+        poma::ChannelHandle handle;
+        if (!channel_for(dta, handle, dclass)) {
+            submit_data(std::move(dta), dclass);
+            continue;
+        }
+        auto it = std::find_if(groups.begin(), groups.end(), [&](const std::pair<poma::ChannelHandle, PomaPacketBatch>& g) {
+            return g.first == handle;
+        });
+        if (it == groups.end()) {
+            groups.emplace_back(handle, PomaPacketBatch{});
+            it = groups.end() - 1;
+        }
+        it->second.push_back(std::move(dta));
+    }
+    for (auto& g : groups) {
+        submit_batch(std::move(g.second), g.first);
     }
 }
@@ -8,6 +8,13 @@ class LineSplitter : public poma::Module<LineSplitter, PomaDataType>
 public:
     LineSplitter(const std::string& mid);
     void on_incoming_data(PomaPacketType& dta, const std::string& channel) override;
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel) override;
+
+private:
+    void split(const PomaPacketType& dta);
+
+    poma::PropertyKey m_text_key{"text"};
+    poma::PropertyKey m_word_key{"word"};
 };
 #endif
 
@@ -10,11 +10,22 @@ LineSplitter::LineSplitter(const std::string& mid) : poma::Module<LineSplitter,
 /* Method for processing incoming data packets */
 void LineSplitter::on_incoming_data(PomaPacketType& dta, const std::string& channel)
 {
-	std::stringstream ss{dta.m_properties.get("text", "")};
+	split(dta);
+}
+
+void LineSplitter::on_incoming_data(PomaPacketType&& dta, const std::string& channel)
+{
+	split(dta);
+	discard_data(std::move(dta));
+}
+
+void LineSplitter::split(const PomaPacketType& dta)
+{
+	std::stringstream ss{dta.m_properties.get(m_text_key, "")};
 	std::string word;
 	while (ss >> word) {
-		PomaPacketType dta2;
-		dta2.m_properties.put("word", word);
-		submit_data(dta2);
+		PomaPacketType dta2{PomaPacketPool::acquire()};
+		dta2.m_properties.put(m_word_key, word);
+		submit_data(std::move(dta2));
 	}
 }
@@ -37,13 +37,17 @@ class LoadBalancer : public poma::Module<LoadBalancer, PomaDataType> {
 public:
     LoadBalancer(const std::string& mid);
     void on_incoming_data(PomaPacketType& dta, const std::string& channel) override;
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel) override;
     void setup_cli(boost::program_options::options_description& desc) const override;
     void process_cli(boost::program_options::variables_map& vm) override;
 
 private:
+    const poma::ChannelHandle& next_channel();
+
     bool m_random {false};
     int m_index {0};
     int m_sinks {0};
+    std::vector<poma::ChannelHandle> m_channels;
 };
 
 #endif
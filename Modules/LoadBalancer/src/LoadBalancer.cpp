@@ -35,22 +35,30 @@ DEFAULT_EXPORT_ALL(LoadBalancer, "Load balancer", "", false)
 
 LoadBalancer::LoadBalancer(const std::string& mid) : poma::Module<LoadBalancer, PomaDataType>(mid) {}
 
-void LoadBalancer::on_incoming_data(PomaPacketType& dta, const std::string& channel)
+const poma::ChannelHandle& LoadBalancer::next_channel()
 {
     if (m_sinks == 0) {
-        submit_data(dta);
+        return poma::ChannelHandle::default_channel();
     } else {
         if (m_random) {
             m_index = std::rand() % m_sinks;
         } else {
             m_index = (m_index + 1) % m_sinks;
         }
-        std::stringstream c;
-        c << m_index;
-        submit_data(dta, c.str());
+        return m_channels[m_index];
     }
 }
 
+void LoadBalancer::on_incoming_data(PomaPacketType& dta, const std::string& channel)
+{
+    submit_data(dta, next_channel());
+}
+
+void LoadBalancer::on_incoming_data(PomaPacketType&& dta, const std::string& channel)
+{
+    submit_data(std::move(dta), next_channel());
+}
+
 void LoadBalancer::setup_cli(boost::program_options::options_description& desc) const
 {
     boost::program_options::options_description buf("LoadBalancer options");
@@ -64,4 +72,9 @@ void LoadBalancer::process_cli(boost::program_options::variables_map& vm)
 {
     m_sinks = vm["sinks"].as<int>();
     m_random = vm["random"].as<bool>();
+    // Channels are named after the index of the sink
+    m_channels.clear();
+    for (int i{0}; i < m_sinks; i++) {
+        m_channels.emplace_back(std::to_string(i));
+    }
 }
@@ -40,9 +40,14 @@ public:
     void setup_cli(boost::program_options::options_description& desc) const override;
     void process_cli(boost::program_options::variables_map& vm) override;
     void on_incoming_data(PomaPacketType& dta, const std::string& channel) override;
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel) override;
+    void on_incoming_batch(PomaPacketBatch&& batch, const std::string& channel) override;
 
 private:
-    std::string m_field;
+    bool accept(const PomaPacketType& dta);
+
+    poma::PropertyKey m_field;
+    poma::ChannelHandle m_fail_channel {"fail"};
     std::string m_op;
     std::string m_value_string;
     double m_value_double;
@@ -127,21 +127,46 @@ void MetadataFilter::process_cli(boost::program_options::variables_map& vm)
     }
 }
 
-void MetadataFilter::on_incoming_data(PomaPacketType& dta, const std::string& channel)
+bool MetadataFilter::accept(const PomaPacketType& dta)
 {
     if (m_string_comparison) {
         std::string data = dta.m_properties.get(m_field, "");
-        if (!m_string_comparison_fn(data, m_value_string)) {
-            submit_data(dta, "fail");
-        } else {
-            submit_data(dta);
-        }
+        return m_string_comparison_fn(data, m_value_string);
     } else {
         double data = dta.m_properties.get(m_field, -1.0);
-        if (!m_double_comparison_fn(data, m_value_double)) {
-            submit_data(dta, "fail");
+        return m_double_comparison_fn(data, m_value_double);
+    }
+}
+
+void MetadataFilter::on_incoming_data(PomaPacketType& dta, const std::string& channel)
+{
+    if (!accept(dta)) {
+        submit_data(dta, m_fail_channel);
+    } else {
+        submit_data(dta);
+    }
+}
+
+void MetadataFilter::on_incoming_data(PomaPacketType&& dta, const std::string& channel)
+{
+    if (!accept(dta)) {
+        submit_data(std::move(dta), m_fail_channel);
+    } else {
+        submit_data(std::move(dta));
+    }
+}
+
+void MetadataFilter::on_incoming_batch(PomaPacketBatch&& batch, const std::string& channel)
+{
+    PomaPacketBatch accepted;
+    PomaPacketBatch rejected;
+    for (auto& dta : batch) {
+        if (!accept(dta)) {
+            rejected.push_back(std::move(dta));
         } else {
-            submit_data(dta);
+            accepted.push_back(std::move(dta));
         }
     }
+    submit_batch(std::move(rejected), m_fail_channel);
+    submit_batch(std::move(accepted));
 }
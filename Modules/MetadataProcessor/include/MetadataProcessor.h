@@ -44,6 +44,7 @@ public:
     void process_cli(boost::program_options::variables_map& vm) override;
     void initialize() override;
     void on_incoming_data(PomaPacketType& dta, const std::string& channel);
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel);
 
 private:
 
@@ -64,15 +65,23 @@ private:
 
     struct JPInstruction {
         JPInstruction(OpCode op, int value, std::string data, std::string instruction)
-            : m_op{op}, m_value{value}, m_data{data}, m_instruction{instruction} {}
+            : m_op{op}, m_value{value}, m_data{data}, m_instruction{instruction}
+        {
+            /* Metadata operands are resolved once, when the script is parsed */
+            if (op == OpCode::EXISTS || op == OpCode::LOAD || op == OpCode::STORE) {
+                m_key = poma::PropertyKey{data};
+            }
+        }
         OpCode m_op;
         int m_value;
         std::string m_data;
         std::string m_instruction;
+        poma::PropertyKey m_key;
     };
 
-    void execute(boost::property_tree::ptree& pt);
-    template<typename Z> bool process(boost::property_tree::ptree& pt);
+    void run(poma::Properties& pt);
+    void execute(poma::Properties& pt);
+    template<typename Z> bool process(poma::Properties& pt);
     void parse();
 
     std::unordered_map<std::string,int> m_jumptable;
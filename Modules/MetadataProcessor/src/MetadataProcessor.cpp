@@ -77,13 +77,24 @@ void MetadataProcessor::initialize()
 }
 
 void MetadataProcessor::on_incoming_data(PomaPacketType& dta, const std::string& channel)
+{
+    run(dta.m_properties);
+    submit_data(dta);
+}
+
+void MetadataProcessor::on_incoming_data(PomaPacketType&& dta, const std::string& channel)
+{
+    run(dta.m_properties);
+    submit_data(std::move(dta));
+}
+
+void MetadataProcessor::run(poma::Properties& pt)
 {
     try {
-        execute(dta.m_properties);
+        execute(pt);
     } catch (std::string e) {
         std::cerr << "Exception " << e << std::endl;
     }
-    submit_data(dta);
 }
 
 
@@ -192,7 +203,7 @@ void MetadataProcessor::parse()
 
 
 template<typename Z>
-bool MetadataProcessor::process(boost::property_tree::ptree& pt)
+bool MetadataProcessor::process(poma::Properties& pt)
 {
     for(;;) {
         if (m_pc+1 >= m_instructions.size()) {
@@ -204,11 +215,11 @@ bool MetadataProcessor::process(boost::property_tree::ptree& pt)
         try {
             switch(is.m_op) {
             case OpCode::EXISTS: {
-                m_flag = (pt.get(is.m_data, is.m_data) != is.m_data);
+                m_flag = (pt.get(is.m_key, is.m_data) != is.m_data);
                 break;
             }
             case OpCode::LOAD: {
-                m_stack.push_back(pt.get<Z>(is.m_data, [] { Z t[1] = {}; return t[0]; }()));
+                m_stack.push_back(pt.get<Z>(is.m_key, [] { Z t[1] = {}; return t[0]; }()));
                 break;
             }
             case OpCode::PUSH: {
@@ -267,7 +278,7 @@ bool MetadataProcessor::process(boost::property_tree::ptree& pt)
             case OpCode::STORE: {
                 Z val{boost::get<Z>(m_stack.back())};
                 m_stack.pop_back();
-                pt.put(is.m_data, val);
+                pt.put(is.m_key, val);
                 break;
             }
             case OpCode::IMODE:
@@ -393,7 +404,7 @@ bool MetadataProcessor::process(boost::property_tree::ptree& pt)
 
 
 template<>
-bool MetadataProcessor::process<std::string>(boost::property_tree::ptree& pt)
+bool MetadataProcessor::process<std::string>(poma::Properties& pt)
 {
     for(;;) {
         if (m_pc+1 >= m_instructions.size()) {
@@ -404,11 +415,11 @@ bool MetadataProcessor::process<std::string>(boost::property_tree::ptree& pt)
         try {
             switch(is.m_op) {
             case OpCode::EXISTS: {
-                m_flag = (pt.get(is.m_data, is.m_data) != is.m_data);
+                m_flag = (pt.get(is.m_key, is.m_data) != is.m_data);
                 break;
             }
             case OpCode::LOAD: {
-                m_stack.push_back(pt.get<std::string>(is.m_data, [] { std::string t; return t; }()));
+                m_stack.push_back(pt.get<std::string>(is.m_key, [] { std::string t; return t; }()));
                 break;
             }
             case OpCode::PUSH: {
@@ -431,7 +442,7 @@ bool MetadataProcessor::process<std::string>(boost::property_tree::ptree& pt)
             case OpCode::STORE: {
                 std::string val{boost::get<std::string>(m_stack.back())};
                 m_stack.pop_back();
-                pt.put(is.m_data, val);
+                pt.put(is.m_key, val);
                 break;
             }
             case OpCode::IMODE:
@@ -509,7 +520,7 @@ bool MetadataProcessor::process<std::string>(boost::property_tree::ptree& pt)
 
 
 template<>
-bool MetadataProcessor::process<bool>(boost::property_tree::ptree& pt)
+bool MetadataProcessor::process<bool>(poma::Properties& pt)
 {
     for(;;) {
         if (m_pc+1 >= m_instructions.size()) {
@@ -520,11 +531,11 @@ bool MetadataProcessor::process<bool>(boost::property_tree::ptree& pt)
         try {
             switch(is.m_op) {
             case OpCode::EXISTS: {
-                m_flag = (pt.get(is.m_data, is.m_data) != is.m_data);
+                m_flag = (pt.get(is.m_key, is.m_data) != is.m_data);
                 break;
             }
             case OpCode::LOAD: {
-                m_stack.push_back(pt.get<bool>(is.m_data, [] { bool t{false}; return t; }()));
+                m_stack.push_back(pt.get<bool>(is.m_key, [] { bool t{false}; return t; }()));
                 break;
             }
             case OpCode::PUSH: {
@@ -537,7 +548,7 @@ bool MetadataProcessor::process<bool>(boost::property_tree::ptree& pt)
             case OpCode::STORE: {
                 bool val{boost::get<bool>(m_stack.back())};
                 m_stack.pop_back();
-                pt.put(is.m_data, val);
+                pt.put(is.m_key, val);
                 break;
             }
             case OpCode::IMODE:
@@ -620,7 +631,7 @@ bool MetadataProcessor::process<bool>(boost::property_tree::ptree& pt)
     }
 }
 
-void MetadataProcessor::execute(boost::property_tree::ptree& pt)
+void MetadataProcessor::execute(poma::Properties& pt)
 {
     if (m_instructions.size() <= 0) return;
     m_pc = 0;
@@ -124,6 +124,8 @@ void PipeConfigurator::process_fifo()
                         ss << c;
                     }
                     result.put("result", ss.str());
+                } else if (cmd == "stats") {
+                    result.put_child("result", link_stats_all(pt.get("all", false)));
                 } else {
                     result.put("result", "invalid");
                 }
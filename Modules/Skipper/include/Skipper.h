@@ -36,10 +36,14 @@ class Skipper : public poma::Module<Skipper, PomaDataType> {
 public:
     Skipper(const std::string& mid);
     void on_incoming_data(PomaPacketType& dta, const std::string& channel) override;
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel) override;
+    void on_incoming_batch(PomaPacketBatch&& batch, const std::string& channel) override;
     void setup_cli(boost::program_options::options_description& desc) const override;
     void process_cli(boost::program_options::variables_map& vm) override;
 
 private:
+    bool pass();
+
     int m_skip_interval {1};
     long m_frames{0};
 };
@@ -33,13 +33,41 @@ DEFAULT_EXPORT_ALL(Skipper, "Skip some packets", "", false)
 
 Skipper::Skipper(const std::string& mid) : poma::Module<Skipper, PomaDataType>(mid) {}
 
-void  Skipper::on_incoming_data(PomaPacketType& dta, const std::string& channel)
+bool Skipper::pass()
 {
     m_frames++;
     if (m_frames % m_skip_interval == 0) {
-        submit_data(dta);
         m_frames = 0;
+        return true;
+    }
+    return false;
+}
+
+void  Skipper::on_incoming_data(PomaPacketType& dta, const std::string& channel)
+{
+    if (pass()) {
+        submit_data(dta);
+    }
+}
+
+void  Skipper::on_incoming_data(PomaPacketType&& dta, const std::string& channel)
+{
+    if (pass()) {
+        submit_data(std::move(dta));
+    }
+}
+
+void Skipper::on_incoming_batch(PomaPacketBatch&& batch, const std::string& channel)
+{
+    PomaPacketBatch selected;
+    for (auto& dta : batch) {
+        if (pass()) {
+            selected.push_back(std::move(dta));
+        } else {
+            discard_data(std::move(dta));
+        }
     }
+    submit_batch(std::move(selected));
 }
 
 void Skipper::setup_cli(boost::program_options::options_description& desc) const
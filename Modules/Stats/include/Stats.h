@@ -37,10 +37,13 @@ class Stats : public poma::Module<Stats, PomaDataType> {
 public:
     Stats(const std::string& mid);
     void on_incoming_data(PomaPacketType& dta, const std::string& channel);
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel);
     void setup_cli(boost::program_options::options_description& desc) const;
     void process_cli(boost::program_options::variables_map& vm);
 
 private:
+    void update(std::chrono::high_resolution_clock::time_point before);
+
     int m_stats_interval {256};
     long m_packets{0};
     double m_elapsed_total{0};
@@ -39,9 +39,21 @@ Stats::Stats(const std::string& mid) : poma::Module<Stats, PomaDataType>(mid) {}
 
 void Stats::on_incoming_data(PomaPacketType& dta, const std::string& channel)
 {
-    m_packets++;
     auto before = high_resolution_clock::now();
     submit_data(dta);
+    update(before);
+}
+
+void Stats::on_incoming_data(PomaPacketType&& dta, const std::string& channel)
+{
+    auto before = high_resolution_clock::now();
+    submit_data(std::move(dta));
+    update(before);
+}
+
+void Stats::update(high_resolution_clock::time_point before)
+{
+    m_packets++;
     auto now = high_resolution_clock::now();
     m_elapsed_total += duration_cast<milliseconds>(now - before).count();
     if (m_packets % m_stats_interval == 0) {
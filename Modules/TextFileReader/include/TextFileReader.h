@@ -15,6 +15,8 @@ public:
     
 private:
 	std::string m_file_path;
+	unsigned int m_batch_size{64};
+	poma::PropertyKey m_text_key{"text"};
 };
 #endif
 
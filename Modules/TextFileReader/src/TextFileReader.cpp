@@ -14,11 +14,21 @@ void TextFileReader::start_processing()
 	if (!ifile.is_open()) {
 		throw std::runtime_error{std::string{"cannot open input file "} + m_file_path};
 	}
+	PomaPacketBatch batch;
 	for (std::string line; std::getline(ifile, line);) {
-		PomaPacketType dta;
-		dta.m_properties.put("text", line);
-		submit_data(dta);
+		PomaPacketType dta{PomaPacketPool::acquire()};
+		dta.m_properties.put(m_text_key, line);
+		if (m_batch_size <= 1) {
+			submit_data(std::move(dta));
+			continue;
+		}
+		batch.push_back(std::move(dta));
+		if (batch.size() >= m_batch_size) {
+			submit_batch(std::move(batch));
+			batch = PomaPacketBatch{};
+		}
 	}
+	submit_batch(std::move(batch));
 	ifile.close();
 }
 
@@ -26,13 +36,15 @@ void TextFileReader::setup_cli(boost::program_options::options_description& desc
 {
 	boost::program_options::options_description TextFileReaderOptions("TextFileReader options");
     TextFileReaderOptions.add_options()
-	("path", boost::program_options::value<std::string>()->required(), "input file path");
+	("path", boost::program_options::value<std::string>()->required(), "input file path")
+	("batchsize", boost::program_options::value<unsigned int>()->default_value(64), "number of lines submitted together");
     desc.add(TextFileReaderOptions);
 }
 
 void TextFileReader::process_cli(boost::program_options::variables_map& vm)
 {
 	 m_file_path = vm["path"].as<std::string>();
+	 m_batch_size = vm["batchsize"].as<unsigned int>();
 }
 
 
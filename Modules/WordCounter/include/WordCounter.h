@@ -9,10 +9,13 @@ class WordCounter : public poma::Module<WordCounter, PomaDataType>
 public:
     WordCounter(const std::string& mid);
     void on_incoming_data(PomaPacketType& dta, const std::string& channel) override;
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel) override;
+    void merge_from(const WordCounter& o);
     void finalize() override;
     
 private:
 	std::map<std::string,unsigned long> m_word_counter;
+	poma::PropertyKey m_word_key{"word"};
 };
 #endif
 
@@ -9,10 +9,24 @@ WordCounter::WordCounter(const std::string& mid) : poma::Module<WordCounter, Pom
 /* Method for processing incoming data packets */
 void WordCounter::on_incoming_data(PomaPacketType& dta, const std::string& channel)
 {
-	m_word_counter[dta.m_properties.get("word", "")]++;
+	m_word_counter[dta.m_properties.get(m_word_key, "")]++;
     submit_data(dta);
 }
 
+void WordCounter::on_incoming_data(PomaPacketType&& dta, const std::string& channel)
+{
+	m_word_counter[dta.m_properties.get(m_word_key, "")]++;
+    submit_data(std::move(dta));
+}
+
+/* Adds the counts of a clone (e.g. of a ParExecutor worker) */
+void WordCounter::merge_from(const WordCounter& o)
+{
+	for( const auto& kv : o.m_word_counter )
+	{
+		m_word_counter[kv.first] += kv.second;
+	}
+}
 
 void WordCounter::finalize()
 {
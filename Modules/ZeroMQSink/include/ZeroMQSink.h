@@ -34,7 +34,7 @@
 #include "PomaDefault.h"
 #include "zhelpers.hpp"
 
-class ZeroMQSink : public poma::Module<ZeroMQSink, PomaDataType> {
+class ZeroMQSink : public poma::AsyncModule<ZeroMQSink, PomaDataType> {
 public:
     ZeroMQSink(const std::string& mid);
     ZeroMQSink(const ZeroMQSink& o);
@@ -44,11 +44,35 @@ public:
     void process_cli(boost::program_options::variables_map& vm) override;
     void initialize() override;
     void on_incoming_data(PomaPacketType& dta, const std::string& channel) override;
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel) override;
+
+protected:
+    void on_incoming_async(const TaskPointer& task) override;
 
 private:
+    /* A packet sent in pipelined mode, waiting for its reply */
+    struct Request {
+        TaskPointer m_task;
+        uint64_t m_session;
+        unsigned int m_backoff_ms;
+        uint64_t m_start;
+    };
+
+    void send(PomaPacketType& dta, const std::string& channel);
+    void send_segments(const std::string& channel, poma::Segments& segments);
+    void send_request(Request&& request);
+    void receive_replies();
+
     std::string m_sink_address { "tcp://localhost:7467" };
+    poma::Encoding m_encoding {poma::Encoding::BINARY};
+    poma::MetadataDictionary m_dictionary;
+    poma::PropertyKey m_channel_key {"zeromq.channel"};
+    std::string m_routing;
     zmq::context_t m_context {1};
     zmq::socket_t* m_socket {nullptr};
+    bool m_pipelined {false};
+    int m_socket_fd {-1};
+    std::deque<Request> m_requests;
 };
 
 #endif
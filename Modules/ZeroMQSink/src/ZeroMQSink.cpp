@@ -32,9 +32,9 @@
 
 DEFAULT_EXPORT_ALL(ZeroMQSink, "ZeroMQ Sink module", "", false)
 
-ZeroMQSink::ZeroMQSink(const std::string& mid) : poma::Module<ZeroMQSink, PomaDataType>(mid) {}
+ZeroMQSink::ZeroMQSink(const std::string& mid) : poma::AsyncModule<ZeroMQSink, PomaDataType>(mid) {}
 
-ZeroMQSink::ZeroMQSink(const ZeroMQSink& o) : poma::Module<ZeroMQSink, PomaDataType>(o.m_module_id), m_sink_address {o.m_sink_address}
+ZeroMQSink::ZeroMQSink(const ZeroMQSink& o) : poma::AsyncModule<ZeroMQSink, PomaDataType>(o), m_sink_address {o.m_sink_address}, m_encoding {o.m_encoding}, m_pipelined {o.m_pipelined}
 {
     if (o.m_socket != nullptr) {
         initialize();
@@ -43,16 +43,26 @@ ZeroMQSink::ZeroMQSink(const ZeroMQSink& o) : poma::Module<ZeroMQSink, PomaDataT
 
 ZeroMQSink& ZeroMQSink::operator=(const ZeroMQSink& o)
 {
+    if (m_socket_fd >= 0) {
+        poma::EventLoop::instance().unwatch(m_socket_fd);
+    }
     if (m_socket != nullptr) {
         delete m_socket;
     }
     m_sink_address = o.m_sink_address;
+    m_encoding = o.m_encoding;
+    m_pipelined = o.m_pipelined;
+    set_max_in_flight(o.max_in_flight());
+    m_dictionary.reset();
     initialize();
     return *this;
 }
 
 ZeroMQSink::~ZeroMQSink()
 {
+    if (m_socket_fd >= 0) {
+        poma::EventLoop::instance().unwatch(m_socket_fd);
+    }
     if (m_socket != nullptr) {
         delete m_socket;
     }
@@ -62,28 +72,219 @@ void ZeroMQSink::setup_cli(boost::program_options::options_description& desc) co
 {
     boost::program_options::options_description ZeroMQSink("0MQ sink options");
     ZeroMQSink.add_options()
-    ("sinkaddress", boost::program_options::value<std::string>()->default_value("tcp://localhost:7467"), "0MQ sink socket address");
+    ("sinkaddress", boost::program_options::value<std::string>()->default_value("tcp://localhost:7467"), "0MQ sink socket address")
+    ("encoding", boost::program_options::value<std::string>()->default_value("binary"), "packet encoding (binary or json)")
+    ("inflight", boost::program_options::value<unsigned int>()->default_value(1), "maximum number of packets sent without waiting for their reply (1: wait on the calling thread)");
     desc.add(ZeroMQSink);
 }
 
 void ZeroMQSink::process_cli(boost::program_options::variables_map& vm)
 {
     m_sink_address = vm["sinkaddress"].as<std::string>();
+    std::string encoding{vm["encoding"].as<std::string>()};
+    if (encoding == "binary") {
+        m_encoding = poma::Encoding::BINARY;
+    } else if (encoding == "json") {
+        m_encoding = poma::Encoding::JSON;
+    } else {
+        std::cerr << "Invalid encoding " << encoding << std::endl;
+        exit(1);
+    }
+    unsigned int in_flight{vm["inflight"].as<unsigned int>()};
+    set_max_in_flight(in_flight);
+    m_pipelined = in_flight > 1;
 }
 
 void ZeroMQSink::initialize()
 {
-    m_socket = new zmq::socket_t {m_context, ZMQ_REQ};
+    if (!m_pipelined) {
+        m_socket = new zmq::socket_t {m_context, ZMQ_REQ};
+        m_socket->connect(m_sink_address.c_str());
+        return;
+    }
+    // Requests are sent, and replies received, on the event loop: unlike
+    // REQ, a DEALER socket does not wait for a reply before the next request
+    m_socket = new zmq::socket_t {m_context, ZMQ_DEALER};
     m_socket->connect(m_sink_address.c_str());
+    size_t fd_size{sizeof(m_socket_fd)};
+    m_socket->getsockopt(ZMQ_FD, &m_socket_fd, &fd_size);
+    poma::EventLoop::instance().watch(m_socket_fd, [this] { receive_replies(); });
 }
 
 void ZeroMQSink::on_incoming_data(PomaPacketType& dta, const std::string& channel)
 {
-    dta.m_properties.put("zeromq.channel", channel);
-    std::string data;
-    serialize(dta, data);
-    s_send(*m_socket, data);
-    std::string ack{s_recv(*m_socket)};
-    assert(ack == "ACK");
+    if (m_pipelined) {
+        poma::AsyncModule<ZeroMQSink, PomaDataType>::on_incoming_data(dta, channel);
+        return;
+    }
+    send(dta, channel);
     submit_data(dta);
 }
+
+void ZeroMQSink::on_incoming_data(PomaPacketType&& dta, const std::string& channel)
+{
+    if (m_pipelined) {
+        poma::AsyncModule<ZeroMQSink, PomaDataType>::on_incoming_data(std::move(dta), channel);
+        return;
+    }
+    send(dta, channel);
+    submit_data(std::move(dta));
+}
+
+void ZeroMQSink::on_incoming_async(const TaskPointer& task)
+{
+    if (!m_pipelined) {
+        send(task->m_packet, task->m_channel);
+        complete(task);
+        return;
+    }
+    // Only the event loop uses the socket
+    poma::EventLoop::instance().post([this, task] {
+        send_request(Request{task, 0, 1, 0});
+        receive_replies();
+    });
+}
+
+static void free_owned_segment(void* data, void* hint)
+{
+    delete static_cast<std::string*>(hint);
+}
+
+static void keep_segment_view(void* data, void* hint)
+{
+}
+
+void ZeroMQSink::send(PomaPacketType& dta, const std::string& channel)
+{
+    uint64_t start{0};
+    if (poma::traced(dta)) {
+        // The hop to the receiving host is drawn as a flow
+        poma::Tracer::instance().event('s', dta.m_trace, "zeromq", "network");
+        start = poma::Tracer::now_ns();
+    }
+    dta.m_properties.put(m_channel_key, channel);
+    std::string ack;
+    unsigned int backoff_ms{1};
+    for (;;) {
+        // Owned segments are handed over to 0MQ: encode again on each attempt
+        poma::Segments segments;
+        if (m_encoding == poma::Encoding::BINARY) {
+            serialize(dta, segments, m_dictionary);
+        } else {
+            serialize(dta, segments, poma::Encoding::JSON);
+        }
+        send_segments(channel, segments);
+        ack = s_recv(*m_socket);
+        if (ack == "RESYNC") {
+            // The source lost our key dictionary (e.g. it was restarted)
+            m_dictionary.reset();
+        } else if (ack == "BUSY") {
+            // A nonblocking source refused the packet: retry with backoff
+            std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
+            backoff_ms = std::min(backoff_ms * 2, 100u);
+        } else {
+            break;
+        }
+    }
+    assert(ack == "ACK");
+    if (start != 0) {
+        poma::Tracer::instance().span(dta.m_trace, m_module_id + " send", "network", start, poma::Tracer::now_ns());
+    }
+}
+
+/* Segments are sent as frames of a multipart message without copies:
+   owned segments are handed over to 0MQ, views refer to the packet, which
+   outlives the transfer since we wait for the reply. The first frame is
+   the routing header, read by the source without decoding the packet */
+void ZeroMQSink::send_segments(const std::string& channel, poma::Segments& segments)
+{
+    m_routing.clear();
+    poma::encode_routing(channel, m_routing);
+    s_sendmore(*m_socket, m_routing);
+    for (size_t i{0}; i < segments.size(); ++i) {
+        int flags {i + 1 < segments.size() ? ZMQ_SNDMORE : 0};
+        if (segments.is_view(i)) {
+            zmq::message_t message{const_cast<char*>(segments.data(i)), segments.length(i), keep_segment_view, nullptr};
+            m_socket->send(message, flags);
+        } else {
+            std::string* owned {new std::string{segments.take(i)}};
+            zmq::message_t message{&(*owned)[0], owned->size(), free_owned_segment, owned};
+            m_socket->send(message, flags);
+        }
+    }
+}
+
+/* Pipelined mode, on the event loop: the packet is encoded again on each
+   attempt, with the current key dictionary */
+void ZeroMQSink::send_request(Request&& request)
+{
+    PomaPacketType& dta{request.m_task->m_packet};
+    if (request.m_start == 0 && poma::traced(dta)) {
+        poma::Tracer::instance().event('s', dta.m_trace, "zeromq", "network");
+        request.m_start = poma::Tracer::now_ns();
+    }
+    dta.m_properties.put(m_channel_key, request.m_task->m_channel);
+    poma::Segments segments;
+    if (m_encoding == poma::Encoding::BINARY) {
+        serialize(dta, segments, m_dictionary);
+    } else {
+        serialize(dta, segments, poma::Encoding::JSON);
+    }
+    request.m_session = m_dictionary.session();
+    // Empty delimiter frame, expected by the REP socket of the source
+    s_sendmore(*m_socket, "");
+    send_segments(request.m_task->m_channel, segments);
+    m_requests.push_back(std::move(request));
+}
+
+/* Pipelined mode, on the event loop: the source replies in the order of
+   the requests. The descriptor of a 0MQ socket only signals that its state
+   changed, so replies are read until none is left */
+void ZeroMQSink::receive_replies()
+{
+    for (;;) {
+        int events{0};
+        size_t events_size{sizeof(events)};
+        m_socket->getsockopt(ZMQ_EVENTS, &events, &events_size);
+        if ((events & ZMQ_POLLIN) == 0) {
+            return;
+        }
+        std::string ack;
+        int more{0};
+        do {
+            // The last frame (after the delimiter) is the reply
+            zmq::message_t message;
+            m_socket->recv(&message, ZMQ_DONTWAIT);
+            ack.assign(static_cast<char*>(message.data()), message.size());
+            size_t more_size{sizeof(more)};
+            m_socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+        } while (more);
+        if (m_requests.empty()) {
+            continue;
+        }
+        Request request{std::move(m_requests.front())};
+        m_requests.pop_front();
+        if (ack == "RESYNC") {
+            // Later requests of the same session are refused as well:
+            // the dictionary is only reset once
+            if (request.m_session == m_dictionary.session()) {
+                m_dictionary.reset();
+            }
+            send_request(std::move(request));
+        } else if (ack == "BUSY") {
+            unsigned int backoff_ms{request.m_backoff_ms};
+            request.m_backoff_ms = std::min(backoff_ms * 2, 100u);
+            poma::EventLoop::instance().after(std::chrono::milliseconds(backoff_ms), [this, request]() mutable {
+                send_request(std::move(request));
+                receive_replies();
+            });
+        } else {
+            assert(ack == "ACK");
+            PomaPacketType& dta{request.m_task->m_packet};
+            if (request.m_start != 0) {
+                poma::Tracer::instance().span(dta.m_trace, m_module_id + " send", "network", request.m_start, poma::Tracer::now_ns());
+            }
+            complete(request.m_task);
+        }
+    }
+}
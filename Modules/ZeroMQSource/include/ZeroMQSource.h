@@ -47,10 +47,16 @@ public:
 
 private:
     void serve_fn();
+    void recv_frames(std::vector<std::string>& frames);
     std::string m_source_address { "tcp://*:7467" };
+    unsigned int m_batch_size {1};
+    bool m_lazy {false};
+    bool m_nonblocking {false};
+    poma::PropertyKey m_channel_key {"zeromq.channel"};
     zmq::context_t m_context {1};
     zmq::socket_t* m_socket {nullptr};
     std::thread* m_thread {nullptr};
+    poma::MetadataDictionaries m_dictionaries;
 };
 
 #endif
@@ -34,7 +34,7 @@ DEFAULT_EXPORT_ALL(ZeroMQSource, "ZeroMQ Source module", "", false)
 
 ZeroMQSource::ZeroMQSource(const std::string& mid) : poma::Module<ZeroMQSource, PomaDataType>(mid) {}
 
-ZeroMQSource::ZeroMQSource(const ZeroMQSource& o) : poma::Module<ZeroMQSource, PomaDataType>(o.m_module_id), m_source_address {o.m_source_address}
+ZeroMQSource::ZeroMQSource(const ZeroMQSource& o) : poma::Module<ZeroMQSource, PomaDataType>(o.m_module_id), m_source_address {o.m_source_address}, m_batch_size {o.m_batch_size}, m_lazy {o.m_lazy}, m_nonblocking {o.m_nonblocking}
 {
     if (o.m_socket != nullptr) {
         initialize();
@@ -47,6 +47,9 @@ ZeroMQSource& ZeroMQSource::operator=(const ZeroMQSource& o)
         delete m_socket;
     }
     m_source_address = o.m_source_address;
+    m_batch_size = o.m_batch_size;
+    m_lazy = o.m_lazy;
+    m_nonblocking = o.m_nonblocking;
     initialize();
     return *this;
 }
@@ -56,7 +59,7 @@ ZeroMQSource::~ZeroMQSource()
     if (m_socket != nullptr) {
         delete m_socket;
     }
-    if (m_thread != nullptr) {
+    if (m_thread != nullptr && m_thread->joinable()) {
         m_thread->detach();
     }
 }
@@ -65,13 +68,19 @@ void ZeroMQSource::setup_cli(boost::program_options::options_description& desc)
 {
     boost::program_options::options_description ZeroMQSource("0MQ source options");
     ZeroMQSource.add_options()
-    ("sourceaddress", boost::program_options::value<std::string>()->default_value("tcp://*:7467"), "0MQ source socket address");
+    ("sourceaddress", boost::program_options::value<std::string>()->default_value("tcp://*:7467"), "0MQ source socket address")
+    ("batchsize", boost::program_options::value<unsigned int>()->default_value(1), "maximum number of packets submitted together (above 1 packets are acknowledged on receipt instead of after processing)")
+    ("lazy", boost::program_options::value<bool>()->default_value(false), "decode metadata and payload only when first accessed")
+    ("nonblocking", boost::program_options::value<bool>()->default_value(false), "with batchsize 1, reply BUSY instead of waiting when the sinks are full");
     desc.add(ZeroMQSource);
 }
 
 void ZeroMQSource::process_cli(boost::program_options::variables_map& vm)
 {
     m_source_address = vm["sourceaddress"].as<std::string>();
+    m_batch_size = vm["batchsize"].as<unsigned int>();
+    m_lazy = vm["lazy"].as<bool>();
+    m_nonblocking = vm["nonblocking"].as<bool>();
 }
 
 void ZeroMQSource::initialize()
@@ -81,21 +90,104 @@ void ZeroMQSource::initialize()
     m_thread = new std::thread {&ZeroMQSource::serve_fn, this};
 }
 
+/* Packets are served by serve_fn, which never returns: wait for it
+   without polling */
 void ZeroMQSource::start_processing()
 {
-    for (;;) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(5000));
-    }
+    m_thread->join();
 }
 
 void ZeroMQSource::serve_fn()
 {
+    // Packets received back to back are grouped by channel and submitted
+    // as batches once no more data is waiting (or batchsize is reached)
+    std::vector<std::pair<std::string, PomaPacketBatch> > batches;
+    std::vector<std::string> frames;
+    unsigned int pending{0};
     for (;;) {
-        std::string data_string{s_recv(*m_socket)};
-		PomaPacketType dta;
-		deserialize(dta, data_string);
-		std::string channel{dta.m_properties.get("zeromq.channel", "default")};
-		submit_data(dta, channel);
-        s_send(*m_socket, "ACK");
+        zmq::pollitem_t item{static_cast<void*>(*m_socket), 0, ZMQ_POLLIN, 0};
+        if (pending > 0 && (pending >= m_batch_size || zmq::poll(&item, 1, 0) == 0)) {
+            for (auto& b : batches) {
+                submit_batch(std::move(b.second), b.first);
+            }
+            batches.clear();
+            pending = 0;
+        }
+        recv_frames(frames);
+        uint64_t received{poma::Tracer::enabled() ? poma::Tracer::now_ns() : 0};
+		// Senders put the channel in a routing header, so that the packet
+		// does not need to be decoded to be routed
+		std::string channel;
+		bool routed{frames.size() > 1 && poma::is_routing(frames[0])};
+		if (routed) {
+			channel = poma::decode_routing(frames[0]);
+			frames.erase(frames.begin());
+		}
+		PomaPacketType dta{PomaPacketPool::acquire()};
+		try {
+			if (m_lazy) {
+				deserialize_lazy(dta, frames, m_dictionaries);
+			} else {
+				deserialize(dta, frames, m_dictionaries);
+			}
+		} catch (const poma::DictionaryMismatch&) {
+			s_send(*m_socket, "RESYNC");
+			continue;
+		} catch (const std::exception& e) {
+			// Malformed packet (including JSON metadata the ptree parser
+			// refuses): the session dictionary was dropped by the decoder,
+			// the sender resets its own and sends the packet again
+			std::cerr << "ZeroMQSource " << m_module_id << ": cannot decode packet (" << e.what() << ")" << std::endl;
+			s_send(*m_socket, "RESYNC");
+			continue;
+		}
+		if (!routed) {
+			channel = dta.m_properties.get(m_channel_key, "default");
+		}
+		if (poma::traced(dta)) {
+			poma::Tracer::instance().span(dta.m_trace, m_module_id + " receive", "network", received, poma::Tracer::now_ns());
+			poma::Tracer::instance().event('f', dta.m_trace, "zeromq", "network");
+		}
+		if (m_batch_size <= 1 && m_nonblocking) {
+			// The sender keeps the packet and sends it again later
+			if (try_submit(std::move(dta), channel) == poma::SubmitStatus::WOULD_BLOCK) {
+				discard_data(std::move(dta));
+				s_send(*m_socket, "BUSY");
+			} else {
+				s_send(*m_socket, "ACK");
+			}
+			continue;
+		}
+		if (m_batch_size <= 1) {
+			submit_data(std::move(dta), channel);
+			s_send(*m_socket, "ACK");
+			continue;
+		}
+		// The request/reply pattern requires a reply before the next
+		// packet can be received: batched packets are acknowledged on receipt
+		s_send(*m_socket, "ACK");
+		auto it = std::find_if(batches.begin(), batches.end(), [&](const std::pair<std::string, PomaPacketBatch>& b) {
+			return b.first == channel;
+		});
+		if (it == batches.end()) {
+			batches.emplace_back(channel, PomaPacketBatch{});
+			it = batches.end() - 1;
+		}
+		it->second.push_back(std::move(dta));
+		pending++;
     }
 }
+
+/* Receives all the frames of a (possibly multipart) message */
+void ZeroMQSource::recv_frames(std::vector<std::string>& frames)
+{
+    frames.clear();
+    int more{0};
+    do {
+        zmq::message_t message;
+        m_socket->recv(&message);
+        frames.emplace_back(static_cast<char*>(message.data()), message.size());
+        size_t more_size{sizeof(more)};
+        m_socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+    } while (more);
+}
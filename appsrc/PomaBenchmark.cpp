@@ -0,0 +1,588 @@
+/*
+ * Copyright (C)2015,2016,2017 Amos Brocco (amos.brocco@supsi.ch)
+ *                             Scuola Universitaria Professionale della
+ *                             Svizzera Italiana (SUPSI)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Scuola Universitaria Professionale della Svizzera
+ *       Italiana (SUPSI) nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include "PomaDefault.h"
+
+using namespace poma;
+
+/* Counts heap allocations made by the whole process. The whole set of
+   replaceable operators is replaced, so that every operator new is
+   matched by one of these operator delete; they share allocate and
+   release, which are kept out of line so that the compiler never pairs a
+   std::free with an operator new it inlined elsewhere */
+static std::atomic<unsigned long> allocations{0};
+
+__attribute__((noinline)) static void* allocate(std::size_t size) noexcept
+{
+    allocations++;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+__attribute__((noinline)) static void release(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void* operator new(std::size_t size)
+{
+    void* ptr{allocate(size)};
+    if (ptr == nullptr) {
+        throw std::bad_alloc{};
+    }
+    return ptr;
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    release(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    release(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    release(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+    release(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    release(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    release(ptr);
+}
+
+/* Compares the JSON and binary metadata encodings on a packet resembling
+ * what travels on ZeroMQSink -> ZeroMQSource bridges */
+
+static PomaPacketType make_packet(int fields)
+{
+    PomaPacketType dta;
+    dta.m_properties.put("zeromq.channel", "default");
+    dta.m_properties.put("sample.text", "Example");
+    dta.m_properties.put("sample.flag", true);
+    for (int i{0}; i < fields; i++) {
+        dta.m_properties.put("sample.value" + std::to_string(i), i * 1000);
+    }
+    return dta;
+}
+
+template<typename F>
+static double measure(unsigned long iterations, F fn)
+{
+    auto before = std::chrono::steady_clock::now();
+    for (unsigned long i{0}; i < iterations; i++) {
+        fn();
+    }
+    auto after = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count() / (double) iterations;
+}
+
+static void report(const std::string& name, double ns, size_t bytes)
+{
+    std::cout << std::left << std::setw(28) << name
+              << std::right << std::setw(12) << std::fixed << std::setprecision(1) << ns << " ns/packet"
+              << std::setw(10) << bytes << " bytes" << std::endl;
+}
+
+/* The same payload, with generated and with hand-written serializers */
+struct GeneratedPayload : public Serializable {
+    uint64_t m_id{0};
+    double m_score{0};
+    std::string m_name;
+    std::vector<float> m_samples;
+
+    DECLARE_SERIALIZABLE_FIELDS(GeneratedPayload, (m_id)(m_score)(m_name)(m_samples))
+};
+
+struct PackedPayload : public Serializable {
+    uint64_t m_id{0};
+    double m_score{0};
+    std::string m_name;
+    std::vector<float> m_samples;
+
+    void serialize(std::string& output) const override
+    {
+        pack(std::to_string(m_id), output);
+        pack(std::to_string(m_score), output);
+        pack(m_name, output);
+        pack(std::string{reinterpret_cast<const char*>(m_samples.data()), m_samples.size() * sizeof(float)}, output);
+    }
+
+    void deserialize(std::string::const_iterator& from) override
+    {
+        m_id = std::stoull(unpack(from));
+        m_score = std::stod(unpack(from));
+        m_name = unpack(from);
+        std::string samples{unpack(from)};
+        m_samples.resize(samples.size() / sizeof(float));
+        std::memcpy(m_samples.data(), samples.data(), samples.size());
+    }
+};
+
+template<typename P>
+static bool run_payload(unsigned long iterations, const std::string& name, size_t samples)
+{
+    P payload;
+    payload.m_id = 42;
+    payload.m_score = 0.5;
+    payload.m_name = "a name long enough to leave the small string buffer";
+    payload.m_samples.assign(samples, 1.5f);
+    std::string data;
+    payload.serialize(data);
+    report("serialize " + name, measure(iterations, [&] {
+        std::string out;
+        payload.serialize(out);
+    }), data.size());
+    report("deserialize " + name, measure(iterations, [&] {
+        P in;
+        std::string::const_iterator from{data.begin()};
+        in.deserialize(from);
+    }), data.size());
+    P check;
+    std::string::const_iterator from{data.begin()};
+    check.deserialize(from);
+    return from == data.end() && check.m_id == payload.m_id && check.m_score == payload.m_score
+           && check.m_name == payload.m_name && check.m_samples == payload.m_samples;
+}
+
+/* Every truncation of a generated payload, including an empty frame, must
+   be refused instead of read past the end */
+static bool check_truncated_payload()
+{
+    GeneratedPayload payload;
+    payload.m_name = "truncated";
+    payload.m_samples.assign(16, 1.5f);
+    std::string data;
+    payload.serialize(data);
+    for (size_t size{0}; size < data.size(); size++) {
+        std::string truncated{data, 0, size};
+        GeneratedPayload in;
+        std::string::const_iterator from{truncated.begin()};
+        try {
+            in.deserialize(from, truncated.end());
+            return false;
+        } catch (const std::runtime_error&) {
+        }
+    }
+    return true;
+}
+
+/* The same for the JSON metadata of a packet, and for a length larger than
+   the packet, which must not be allocated */
+static bool check_truncated_metadata()
+{
+    std::string data;
+    serialize(make_packet(4), data, Encoding::JSON);
+    std::string oversize(8, '\xFF');
+    for (size_t size{0}; size <= data.size(); size++) {
+        std::string truncated{size < data.size() ? std::string{data, 0, size} : oversize};
+        PomaPacketType in;
+        try {
+            deserialize(in, truncated);
+            return false;
+        } catch (const std::exception&) {
+        }
+    }
+    return true;
+}
+
+/* A splitter/counter chain, as TextFileReader -> LineSplitter -> WordCounter */
+class BenchSplitter : public Module<BenchSplitter, PomaDataType> {
+public:
+    BenchSplitter(const std::string& mid, bool pooled) : Module<BenchSplitter, PomaDataType>(mid), m_pooled{pooled} {}
+
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel) override
+    {
+        const PropertyValue* text{dta.m_properties.find(m_text_key.id())};
+        for (int i{0}; i < 4; i++) {
+            PomaPacketType word{m_pooled ? PomaPacketPool::acquire() : PomaPacketType{}};
+            word.m_properties.put(m_word_key, text->string_value());
+            word.m_properties.put(m_index_key, i);
+            submit_data(std::move(word));
+        }
+        discard_data(std::move(dta));
+    }
+
+private:
+    bool m_pooled;
+    PropertyKey m_text_key{"text"};
+    PropertyKey m_word_key{"word"};
+    PropertyKey m_index_key{"index"};
+};
+
+class BenchCounter : public Module<BenchCounter, PomaDataType> {
+public:
+    BenchCounter(const std::string& mid) : Module<BenchCounter, PomaDataType>(mid) {}
+
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel) override
+    {
+        m_total += dta.m_properties.get(m_index_key, 0);
+        submit_data(std::move(dta));
+    }
+
+    long total() const
+    {
+        return m_total;
+    }
+
+private:
+    long m_total{0};
+    PropertyKey m_index_key{"index"};
+};
+
+static void run_chain(unsigned long iterations, bool pooled)
+{
+    auto splitter = std::make_shared<BenchSplitter>("splitter", pooled);
+    auto counter = std::make_shared<BenchCounter>("counter");
+    splitter->connect_sink(counter);
+    std::string text{"a line of text long enough to leave the small string buffer"};
+    auto source = [&] {
+        PomaPacketType dta{pooled ? PomaPacketPool::acquire() : PomaPacketType{}};
+        dta.m_properties.put("text", text);
+        splitter->on_incoming_data(std::move(dta), "default");
+    };
+    // warm up the free lists
+    for (int i{0}; i < 64; i++) {
+        source();
+    }
+    unsigned long before{allocations};
+    double ns{measure(iterations, source)};
+    double per_packet{(double) (allocations - before) / iterations};
+    std::cout << std::left << std::setw(28) << (pooled ? "chain (pool)" : "chain (no pool)")
+              << std::right << std::setw(12) << std::fixed << std::setprecision(1) << ns << " ns/packet"
+              << std::setw(10) << std::setprecision(2) << per_packet << " allocations/packet" << std::endl;
+}
+
+/* The workers of a parallel executor run clones of the template, whose
+   links count into the stats of the template links */
+class BenchFork : public ForkBaseModule<PomaDataType> {
+public:
+    BenchFork(const std::string& mid, int threads) : ForkBaseModule<PomaDataType>(mid)
+    {
+        boost::program_options::options_description desc;
+        setup_cli(desc);
+        std::string option{"--threads=" + std::to_string(threads)};
+        const char* args[] {"bench", option.c_str()};
+        boost::program_options::variables_map vm;
+        boost::program_options::store(boost::program_options::parse_command_line(2, args, desc), vm);
+        process_cli(vm);
+    }
+};
+
+static bool check_parallel_stats(unsigned long packets)
+{
+    auto fork = std::make_shared<BenchFork>("fork", 4);
+    auto first = std::make_shared<BenchCounter>("t1");
+    auto second = std::make_shared<BenchCounter>("t2");
+    fork->connect_sink(first, "template");
+    first->connect_sink(second);
+    auto join = std::make_shared<JoinBaseModule<PomaDataType> >("join");
+    second->connect_sink(join);
+    join->connect_sink(fork, "_join");
+    fork->connect_sink(std::make_shared<BenchCounter>("sink"));
+    fork->initialize();
+    for (unsigned long i{0}; i < packets; i++) {
+        fork->on_incoming_data(PomaPacketType{}, "default");
+    }
+    fork->flush();
+    fork->shutdown();
+    bool ok{true};
+    for (const auto& link : BaseModule<PomaDataType>::link_stats_all(true)) {
+        std::string from{link.second.get("from", "")};
+        // the workers call the template directly
+        if ((from != "t1" && from != "t2" && from != "join" && from != "fork") || link.second.get("channel", "") == "template") {
+            continue;
+        }
+        if (link.second.get<unsigned long>("packets", 0) != packets) {
+            std::cerr << from << " -> " << link.second.get("to", "") << ": " << link.second.get("packets", "0") << " packets, expected " << packets << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/* try_submit delivers a packet to every sink of the channel or to none:
+   the packets refused and offered again must be counted once */
+/* Channels named after packet values (as GenericSplitter does) reach no
+   sink unless connected, and are never added to the channel registry */
+static bool check_unknown_channels(unsigned long packets)
+{
+    auto source = std::make_shared<BenchCounter>("classes");
+    auto even = std::make_shared<BenchCounter>("classes even");
+    auto odd = std::make_shared<BenchCounter>("classes odd");
+    source->connect_sink(even, "class0");
+    source->connect_sink(odd, "class1");
+    PropertyKey index_key{"index"};
+    for (unsigned long i{0}; i < packets; i++) {
+        PomaPacketType dta;
+        dta.m_properties.put(index_key, 1);
+        source->submit_data(std::move(dta), "class" + std::to_string(i));
+    }
+    uint32_t id;
+    return even->total() == 1 && odd->total() == 1 && ChannelRegistry::instance().find("class0", id)
+           && !ChannelRegistry::instance().find("class" + std::to_string(packets - 1), id);
+}
+
+static bool check_fanout_offer(unsigned long packets)
+{
+    auto source = std::make_shared<BenchCounter>("offer");
+    std::vector<std::shared_ptr<BenchCounter> > counters;
+    std::vector<std::shared_ptr<BenchFork> > forks;
+    for (int i{0}; i < 2; i++) {
+        std::string id{"offer" + std::to_string(i)};
+        // the second sink is full more often than the first one
+        auto fork = std::make_shared<BenchFork>(id, i == 0 ? 4 : 1);
+        auto work = std::make_shared<BenchCounter>(id + " work");
+        auto join = std::make_shared<JoinBaseModule<PomaDataType> >(id + " join");
+        auto counter = std::make_shared<BenchCounter>(id + " count");
+        fork->connect_sink(work, "template");
+        work->connect_sink(join);
+        join->connect_sink(fork, "_join");
+        fork->connect_sink(counter);
+        source->connect_sink(fork);
+        fork->initialize();
+        forks.push_back(fork);
+        counters.push_back(counter);
+    }
+    PropertyKey index_key{"index"};
+    unsigned long refused{0};
+    for (unsigned long i{0}; i < packets; i++) {
+        for (;;) {
+            PomaPacketType dta;
+            dta.m_properties.put(index_key, 1);
+            if (source->try_submit(std::move(dta)) != SubmitStatus::WOULD_BLOCK) {
+                break;
+            }
+            refused++;
+            std::this_thread::yield();
+        }
+    }
+    bool ok{true};
+    for (size_t i{0}; i < forks.size(); i++) {
+        forks[i]->flush();
+        forks[i]->shutdown();
+        if (counters[i]->total() != (long) packets) {
+            std::cerr << "offer fan-out: sink " << i << " counted " << counters[i]->total() << " packets, expected " << packets << " (" << refused << " refused)" << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned long iterations{argc > 1 ? std::stoul(argv[1]) : 100000};
+    int fields{argc > 2 ? std::stoi(argv[2]) : 8};
+    PomaPacketType dta{make_packet(fields)};
+
+    std::string json_data;
+    serialize(dta, json_data, Encoding::JSON);
+    std::string binary_data;
+    serialize(dta, binary_data, Encoding::BINARY);
+    MetadataDictionary dictionary;
+    std::string dictionary_data;
+    serialize(dta, dictionary_data, dictionary);
+    dictionary_data.clear();
+    serialize(dta, dictionary_data, dictionary);
+
+    std::cout << iterations << " iterations, " << fields + 3 << " metadata fields" << std::endl;
+    report("serialize json", measure(iterations, [&] {
+        std::string out;
+        serialize(dta, out, Encoding::JSON);
+    }), json_data.size());
+    report("serialize binary", measure(iterations, [&] {
+        std::string out;
+        serialize(dta, out, Encoding::BINARY);
+    }), binary_data.size());
+    report("serialize binary+dictionary", measure(iterations, [&] {
+        std::string out;
+        serialize(dta, out, dictionary);
+    }), dictionary_data.size());
+
+    report("deserialize json", measure(iterations, [&] {
+        PomaPacketType in;
+        deserialize(in, json_data);
+    }), json_data.size());
+    report("deserialize binary", measure(iterations, [&] {
+        PomaPacketType in;
+        deserialize(in, binary_data);
+    }), binary_data.size());
+
+    // The receiving side learns the keys from the first packet of the session
+    MetadataDictionaries dictionaries;
+    MetadataDictionary sender;
+    std::string first;
+    serialize(dta, first, sender);
+    std::string next;
+    serialize(dta, next, sender);
+    PomaPacketType warmup;
+    deserialize(warmup, first, dictionaries);
+    report("deserialize binary+dictionary", measure(iterations, [&] {
+        PomaPacketType in;
+        deserialize(in, next, dictionaries);
+    }), next.size());
+
+    PomaPacketType check;
+    deserialize(check, next, dictionaries);
+    if (check.m_properties != dta.m_properties) {
+        std::cerr << "binary round trip mismatch" << std::endl;
+        return 1;
+    }
+
+    // Multipart frames, as sent by ZeroMQSink
+    MetadataDictionary segment_sender;
+    MetadataDictionaries segment_dictionaries;
+    std::vector<std::string> frames;
+    for (int i{0}; i < 2; i++) {
+        Segments segments;
+        serialize(dta, segments, segment_sender);
+        frames.clear();
+        for (size_t j{0}; j < segments.size(); j++) {
+            frames.push_back(segments.take(j));
+        }
+        PomaPacketType in;
+        deserialize(in, frames, segment_dictionaries);
+        if (in.m_properties != dta.m_properties) {
+            std::cerr << "segments round trip mismatch" << std::endl;
+            return 1;
+        }
+    }
+    size_t frames_size{0};
+    for (auto& f : frames) {
+        frames_size += f.size();
+    }
+    report("serialize segments", measure(iterations, [&] {
+        Segments segments;
+        serialize(dta, segments, segment_sender);
+    }), frames_size);
+    report("deserialize segments", measure(iterations, [&] {
+        PomaPacketType in;
+        deserialize(in, frames, segment_dictionaries);
+    }), frames_size);
+    // A relay only reads the routing header, the first access decodes
+    // (pooled packets, as acquired by ZeroMQSource)
+    // frames are copied in every run, as they are received from the socket
+    PropertyKey flag_key{"sample.flag"};
+    report("deserialize lazy", measure(iterations, [&] {
+        std::vector<std::string> received{frames};
+        PomaPacketType in{PomaPacketPool::acquire()};
+        deserialize_lazy(in, received, segment_dictionaries);
+        PomaPacketPool::release(std::move(in));
+    }), frames_size);
+    report("deserialize lazy+access", measure(iterations, [&] {
+        std::vector<std::string> received{frames};
+        PomaPacketType in{PomaPacketPool::acquire()};
+        deserialize_lazy(in, received, segment_dictionaries);
+        in.m_properties.has(flag_key);
+        in.data();
+        PomaPacketPool::release(std::move(in));
+    }), frames_size);
+    report("deserialize (copy frames)", measure(iterations, [&] {
+        std::vector<std::string> received{frames};
+        PomaPacketType in{PomaPacketPool::acquire()};
+        deserialize(in, received, segment_dictionaries);
+        PomaPacketPool::release(std::move(in));
+    }), frames_size);
+    std::vector<std::string> lazy_frames{frames};
+    PomaPacketType lazy;
+    deserialize_lazy(lazy, lazy_frames, segment_dictionaries);
+    PomaPacketType lazy_copy{lazy};
+    if (!lazy.deferred() || lazy_copy.m_properties != dta.m_properties || lazy.m_properties != dta.m_properties) {
+        std::cerr << "lazy round trip mismatch" << std::endl;
+        return 1;
+    }
+
+    if (!run_payload<PackedPayload>(iterations, "payload pack", 256) ||
+            !run_payload<GeneratedPayload>(iterations, "payload generated", 256)) {
+        std::cerr << "payload round trip mismatch" << std::endl;
+        return 1;
+    }
+
+    if (!check_truncated_payload()) {
+        std::cerr << "truncated payload accepted" << std::endl;
+        return 1;
+    }
+    if (!check_truncated_metadata()) {
+        std::cerr << "truncated metadata accepted" << std::endl;
+        return 1;
+    }
+
+    // 1 input packet, 4 output packets
+    run_chain(iterations, false);
+    run_chain(iterations, true);
+
+    if (!check_parallel_stats(iterations)) {
+        std::cerr << "parallel link stats mismatch" << std::endl;
+        return 1;
+    }
+    if (!check_unknown_channels(iterations)) {
+        std::cerr << "unknown channels mismatch" << std::endl;
+        return 1;
+    }
+    if (!check_fanout_offer(iterations)) {
+        std::cerr << "offer fan-out mismatch" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,501 @@
+/*
+ * Copyright (C)2015,2016,2017 Amos Brocco (amos.brocco@supsi.ch)
+ *                             Scuola Universitaria Professionale della
+ *                             Svizzera Italiana (SUPSI)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Scuola Universitaria Professionale della Svizzera
+ *       Italiana (SUPSI) nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include "PomaDefault.h"
+
+using namespace poma;
+
+/* Packet path microbenchmarks: every benchmark is run over a sweep of
+ * metadata sizes, payload sizes and thread counts (each thread works on
+ * its own data), results are written as JSON to compare versions:
+ *
+ *   { "iterations": ..., "hardware_threads": ..., "results": [
+ *       { "benchmark": "serialize_binary", "metadata_fields": 8,
+ *         "payload_bytes": 4096, "threads": 2, "iterations": 10000,
+ *         "ns_per_op": 812.4, "ops_per_second": 2461840.0, ... }, ... ] }
+ *
+ * ns_per_op is the wall time of one operation as seen by each thread,
+ * ops_per_second the aggregate throughput of all threads */
+
+struct Options {
+    unsigned long m_iterations{10000};
+    double m_time_budget{0.1};
+    std::vector<unsigned int> m_fields{0, 8, 64};
+    std::vector<unsigned int> m_payloads{16, 4096, 65536};
+    std::vector<unsigned int> m_threads{1, 2, 4};
+    std::vector<unsigned int> m_sinks{1, 4};
+    std::string m_filter;
+};
+
+struct Result {
+    std::string m_benchmark;
+    unsigned int m_fields{0};
+    unsigned int m_payload{0};
+    unsigned int m_threads{1};
+    unsigned int m_sinks{0};
+    unsigned long m_iterations{0};
+    double m_ns_per_op{0};
+    double m_ops_per_second{0};
+    size_t m_bytes{0};
+};
+
+static PomaPacketType make_packet(unsigned int fields, unsigned int payload)
+{
+    PomaPacketType dta;
+    for (unsigned int i{0}; i < fields; i++) {
+        if (i % 2 == 0) {
+            dta.m_properties.put("bench.value" + std::to_string(i), i * 1000);
+        } else {
+            dta.m_properties.put("bench.text" + std::to_string(i), "metadata value " + std::to_string(i));
+        }
+    }
+    dta.m_data.m_sequence = payload;
+    dta.m_data.m_sample.assign(payload, 'x');
+    return dta;
+}
+
+/* Runs make(thread) in each thread to build the per-thread operation (not
+ * timed), then times iterations calls of the operation in all threads */
+template<typename Make>
+static Result run_case(const Options& options, const std::string& name, unsigned int fields, unsigned int payload, unsigned int threads, Make make)
+{
+    Result r;
+    r.m_benchmark = name;
+    r.m_fields = fields;
+    r.m_payload = payload;
+    r.m_threads = threads;
+
+    // Calibration: fit the run in the time budget
+    {
+        auto op = make(0);
+        auto before = std::chrono::steady_clock::now();
+        unsigned long n{0};
+        do {
+            op();
+            n++;
+        } while (n < 10 || std::chrono::steady_clock::now() - before < std::chrono::milliseconds(5));
+        double seconds{std::chrono::duration<double>(std::chrono::steady_clock::now() - before).count() / n};
+        r.m_iterations = std::max(10ul, std::min(options.m_iterations, (unsigned long) (options.m_time_budget / seconds)));
+    }
+
+    std::atomic<unsigned int> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int t{0}; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            auto op = make(t);
+            ready++;
+            while (!go) {
+                std::this_thread::yield();
+            }
+            for (unsigned long i{0}; i < r.m_iterations; i++) {
+                op();
+            }
+        });
+    }
+    while (ready < threads) {
+        std::this_thread::yield();
+    }
+    start = std::chrono::steady_clock::now();
+    go = true;
+    for (auto& w : workers) {
+        w.join();
+    }
+    double ns{(double) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()};
+    r.m_ns_per_op = ns / r.m_iterations;
+    r.m_ops_per_second = r.m_iterations * threads / (ns / 1e9);
+    return r;
+}
+
+// *********************************************************************
+// BENCHMARKS
+// *********************************************************************
+
+static void bench_pack(const Options& options, std::vector<Result>& results)
+{
+    for (auto payload : options.m_payloads) {
+        for (auto threads : options.m_threads) {
+            results.push_back(run_case(options, "pack", 0, payload, threads, [&](unsigned int) {
+                std::string data(payload, 'x');
+                std::string out;
+                return [data, out]() mutable {
+                    out.clear();
+                    pack(data, out);
+                };
+            }));
+            results.push_back(run_case(options, "unpack", 0, payload, threads, [&](unsigned int) {
+                std::string packed;
+                pack(std::string(payload, 'x'), packed);
+                return [packed]() {
+                    std::string::const_iterator from{packed.begin()};
+                    std::string data{unpack(from)};
+                };
+            }));
+        }
+    }
+}
+
+static void bench_serialize(const Options& options, std::vector<Result>& results)
+{
+    for (auto fields : options.m_fields) {
+        for (auto payload : options.m_payloads) {
+            PomaPacketType prototype{make_packet(fields, payload)};
+            for (auto threads : options.m_threads) {
+                results.push_back(run_case(options, "serialize_binary", fields, payload, threads, [&](unsigned int) {
+                    std::string out;
+                    return [&prototype, out]() mutable {
+                        out.clear();
+                        serialize(prototype, out, Encoding::BINARY);
+                    };
+                }));
+                results.back().m_bytes = [&] { std::string s; serialize(prototype, s, Encoding::BINARY); return s.size(); }();
+
+                results.push_back(run_case(options, "serialize_dictionary", fields, payload, threads, [&](unsigned int) {
+                    std::shared_ptr<MetadataDictionary> dictionary{new MetadataDictionary};
+                    std::string out;
+                    serialize(prototype, out, *dictionary);
+                    return [&prototype, dictionary, out]() mutable {
+                        out.clear();
+                        serialize(prototype, out, *dictionary);
+                    };
+                }));
+
+                results.push_back(run_case(options, "serialize_json", fields, payload, threads, [&](unsigned int) {
+                    std::string out;
+                    return [&prototype, out]() mutable {
+                        out.clear();
+                        serialize(prototype, out, Encoding::JSON);
+                    };
+                }));
+                results.back().m_bytes = [&] { std::string s; serialize(prototype, s, Encoding::JSON); return s.size(); }();
+
+                results.push_back(run_case(options, "deserialize_binary", fields, payload, threads, [&](unsigned int) {
+                    std::string data;
+                    serialize(prototype, data, Encoding::BINARY);
+                    std::shared_ptr<PomaPacketType> in{new PomaPacketType};
+                    return [data, in]() {
+                        deserialize(*in, data);
+                    };
+                }));
+
+                results.push_back(run_case(options, "deserialize_dictionary", fields, payload, threads, [&](unsigned int) {
+                    // steady state: the receiver already learned the keys
+                    MetadataDictionary sender;
+                    std::shared_ptr<MetadataDictionaries> dictionaries{new MetadataDictionaries};
+                    std::string first;
+                    serialize(prototype, first, sender);
+                    std::string data;
+                    serialize(prototype, data, sender);
+                    std::shared_ptr<PomaPacketType> in{new PomaPacketType};
+                    deserialize(*in, first, *dictionaries);
+                    return [data, in, dictionaries]() {
+                        deserialize(*in, data, *dictionaries);
+                    };
+                }));
+
+                results.push_back(run_case(options, "deserialize_json", fields, payload, threads, [&](unsigned int) {
+                    std::string data;
+                    serialize(prototype, data, Encoding::JSON);
+                    std::shared_ptr<PomaPacketType> in{new PomaPacketType};
+                    return [data, in]() {
+                        deserialize(*in, data);
+                    };
+                }));
+            }
+        }
+    }
+}
+
+static void bench_properties(const Options& options, std::vector<Result>& results)
+{
+    for (auto fields : options.m_fields) {
+        std::vector<std::string> names;
+        for (unsigned int i{0}; i < fields; i++) {
+            names.push_back("bench.value" + std::to_string(i));
+        }
+        for (auto threads : options.m_threads) {
+            results.push_back(run_case(options, "ptree_put_get", fields, 0, threads, [&](unsigned int) {
+                return [&names]() {
+                    boost::property_tree::ptree pt;
+                    for (size_t i{0}; i < names.size(); i++) {
+                        pt.put(names[i], i);
+                    }
+                    size_t total{0};
+                    for (size_t i{0}; i < names.size(); i++) {
+                        total += pt.get<size_t>(names[i]);
+                    }
+                    return total;
+                };
+            }));
+
+            results.push_back(run_case(options, "properties_put_get", fields, 0, threads, [&](unsigned int) {
+                std::vector<PropertyKey> keys{names.begin(), names.end()};
+                std::shared_ptr<Properties> properties{new Properties};
+                return [keys, properties]() {
+                    properties->clear();
+                    for (size_t i{0}; i < keys.size(); i++) {
+                        properties->put(keys[i], i);
+                    }
+                    size_t total{0};
+                    for (size_t i{0}; i < keys.size(); i++) {
+                        total += properties->get<size_t>(keys[i]);
+                    }
+                    return total;
+                };
+            }));
+        }
+    }
+}
+
+/* All threads share one bounded queue (BoundedBuffer or RingBuffer): each
+ * operation pushes a packet and pops one (possibly pushed by another thread) */
+template<typename Queue>
+static void bench_queue(const Options& options, std::vector<Result>& results, const std::string& name)
+{
+    for (auto fields : options.m_fields) {
+        for (auto payload : options.m_payloads) {
+            PomaPacketType prototype{make_packet(fields, payload)};
+            for (auto threads : options.m_threads) {
+                Queue buffer;
+                buffer.set_bound(1024);
+                results.push_back(run_case(options, name, fields, payload, threads, [&](unsigned int) {
+                    return [&]() {
+                        PomaPacketType dta{PacketPool<PomaDataType>::acquire()};
+                        dta = prototype;
+                        buffer.push(std::move(dta));
+                        PomaPacketType out{buffer.pop()};
+                        PacketPool<PomaDataType>::release(std::move(out));
+                    };
+                }));
+            }
+        }
+    }
+}
+
+static void bench_buffer(const Options& options, std::vector<Result>& results)
+{
+    bench_queue<BoundedBuffer<PomaPacketType> >(options, results, "buffer_push_pop");
+    bench_queue<RingBuffer<PomaPacketType> >(options, results, "ring_push_pop");
+}
+
+class FanOutSource : public Module<FanOutSource, PomaDataType> {
+public:
+    FanOutSource(const std::string& mid) : Module<FanOutSource, PomaDataType>(mid) {}
+
+    void send(const PomaPacketType& prototype)
+    {
+        PomaPacketType dta{PomaPacketPool::acquire()};
+        dta = prototype;
+        submit_data(std::move(dta));
+    }
+};
+
+class FanOutSink : public Module<FanOutSink, PomaDataType> {
+public:
+    FanOutSink(const std::string& mid) : Module<FanOutSink, PomaDataType>(mid) {}
+
+    void on_incoming_data(PomaPacketType&& dta, const std::string& channel) override
+    {
+        m_count++;
+        submit_data(std::move(dta));
+    }
+
+    unsigned long m_count{0};
+};
+
+/* One source connected to n sinks, one pipeline per thread: each
+ * operation copies a packet from the pool and submits it */
+static void bench_fanout(const Options& options, std::vector<Result>& results)
+{
+    for (auto fields : options.m_fields) {
+        for (auto payload : options.m_payloads) {
+            PomaPacketType prototype{make_packet(fields, payload)};
+            for (auto sinks : options.m_sinks) {
+                for (auto threads : options.m_threads) {
+                    // modules register themselves in a global list: they
+                    // are created before the threads start
+                    std::vector<std::shared_ptr<FanOutSource> > sources;
+                    for (unsigned int t{0}; t < threads; t++) {
+                        sources.emplace_back(new FanOutSource{"source" + std::to_string(t)});
+                        for (unsigned int i{0}; i < sinks; i++) {
+                            sources.back()->connect_sink(std::make_shared<FanOutSink>("sink" + std::to_string(i)));
+                        }
+                    }
+                    results.push_back(run_case(options, "submit_data_fanout", fields, payload, threads, [&](unsigned int t) {
+                        std::shared_ptr<FanOutSource> source{sources[t]};
+                        return [source, &prototype]() {
+                            source->send(prototype);
+                        };
+                    }));
+                    results.back().m_sinks = sinks;
+                }
+            }
+        }
+    }
+}
+
+/* A linear chain of pass-through modules, one pipeline per thread: each
+ * operation submits a packet that crosses every module of the chain, with
+ * the normal dispatch and with the fused one (Loader "compiled" mode) */
+static void bench_chain(const Options& options, std::vector<Result>& results)
+{
+    const unsigned int length{8};
+    for (auto fields : options.m_fields) {
+        for (auto payload : options.m_payloads) {
+            PomaPacketType prototype{make_packet(fields, payload)};
+            for (auto threads : options.m_threads) {
+                for (bool fused : {false, true}) {
+                    std::vector<std::shared_ptr<FanOutSource> > sources;
+                    for (unsigned int t{0}; t < threads; t++) {
+                        sources.emplace_back(new FanOutSource{"source" + std::to_string(t)});
+                        std::shared_ptr<BaseModule<PomaDataType> > last{sources.back()};
+                        for (unsigned int i{0}; i < length; i++) {
+                            last = last->connect_sink(std::make_shared<FanOutSink>("hop" + std::to_string(i)));
+                            if (fused) {
+                                last->fuse();
+                            }
+                        }
+                        if (fused) {
+                            sources.back()->fuse();
+                        }
+                    }
+                    results.push_back(run_case(options, fused ? "submit_data_chain_fused" : "submit_data_chain", fields, payload, threads, [&](unsigned int t) {
+                        std::shared_ptr<FanOutSource> source{sources[t]};
+                        return [source, &prototype]() {
+                            source->send(prototype);
+                        };
+                    }));
+                    results.back().m_sinks = length;
+                }
+            }
+        }
+    }
+}
+
+// *********************************************************************
+// OUTPUT
+// *********************************************************************
+
+static void write_json(std::ostream& out, const Options& options, const std::vector<Result>& results)
+{
+    out << "{\n  \"iterations\": " << options.m_iterations
+        << ",\n  \"hardware_threads\": " << std::thread::hardware_concurrency()
+        << ",\n  \"results\": [";
+    for (size_t i{0}; i < results.size(); i++) {
+        const Result& r = results[i];
+        out << (i == 0 ? "\n" : ",\n") << std::fixed << std::setprecision(1)
+            << "    {\"benchmark\": \"" << r.m_benchmark << "\""
+            << ", \"metadata_fields\": " << r.m_fields
+            << ", \"payload_bytes\": " << r.m_payload
+            << ", \"threads\": " << r.m_threads;
+        if (r.m_sinks > 0) {
+            out << ", \"sinks\": " << r.m_sinks;
+        }
+        out << ", \"iterations\": " << r.m_iterations
+            << ", \"ns_per_op\": " << r.m_ns_per_op
+            << ", \"ops_per_second\": " << r.m_ops_per_second;
+        if (r.m_bytes > 0) {
+            out << ", \"bytes\": " << r.m_bytes;
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    namespace po = boost::program_options;
+    Options options;
+    std::string output;
+    po::options_description desc("Poma microbenchmarks");
+    desc.add_options()
+    ("help", "this help message")
+    ("iterations", po::value<unsigned long>(&options.m_iterations)->default_value(options.m_iterations), "maximum number of operations per thread")
+    ("time", po::value<double>(&options.m_time_budget)->default_value(options.m_time_budget), "approximate duration of each case (seconds)")
+    ("fields", po::value<std::vector<unsigned int> >(&options.m_fields)->multitoken(), "metadata sizes (number of fields)")
+    ("payloads", po::value<std::vector<unsigned int> >(&options.m_payloads)->multitoken(), "payload sizes (bytes)")
+    ("threads", po::value<std::vector<unsigned int> >(&options.m_threads)->multitoken(), "thread counts")
+    ("sinks", po::value<std::vector<unsigned int> >(&options.m_sinks)->multitoken(), "fan-out sizes")
+    ("filter", po::value<std::string>(&options.m_filter), "only run benchmarks whose name contains this string")
+    ("output", po::value<std::string>(&output), "JSON output file (default: standard output)");
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
+    if (vm.count("help")) {
+        std::cerr << desc << std::endl;
+        return 0;
+    }
+
+    typedef void (*Benchmark)(const Options&, std::vector<Result>&);
+    std::vector<std::pair<std::string, Benchmark> > benchmarks {
+        {"pack unpack", bench_pack},
+        {"serialize deserialize", bench_serialize},
+        {"ptree_put_get properties_put_get", bench_properties},
+        {"buffer_push_pop ring_push_pop", bench_buffer},
+        {"submit_data_fanout", bench_fanout},
+        {"submit_data_chain submit_data_chain_fused", bench_chain}
+    };
+    std::vector<Result> results;
+    for (const auto& b : benchmarks) {
+        if (options.m_filter.empty() || b.first.find(options.m_filter) != std::string::npos) {
+            std::cerr << "Running " << b.first << std::endl;
+            size_t first{results.size()};
+            b.second(options, results);
+            // only keep the matching variants
+            if (!options.m_filter.empty()) {
+                results.erase(std::remove_if(results.begin() + first, results.end(), [&](const Result& r) {
+                    return r.m_benchmark.find(options.m_filter) == std::string::npos;
+                }), results.end());
+            }
+        }
+    }
+
+    if (output.empty()) {
+        write_json(std::cout, options, results);
+    } else {
+        std::ofstream out{output};
+        write_json(out, options, results);
+    }
+    return 0;
+}
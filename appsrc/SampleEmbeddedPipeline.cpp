@@ -47,7 +47,7 @@ public:
 void my_callback (PomaPacketType& dta, const std::string& channel)
 {
     std::stringstream swriter;
-    boost::property_tree::write_json(swriter, dta.m_properties);
+    boost::property_tree::write_json(swriter, dta.m_properties.to_ptree());
     std::cout << "Received data from channel " << channel << ": " << swriter.str() << std::endl;
 }
 
@@ -88,12 +88,12 @@ int main(int argc, char* argv[])
     /* 8. We initialize all modules */
     loader.initialize();
 
-    /* 9. We start pushing packets to the pipeline */
+    /* 9. We start pushing packets to the pipeline (ownership is transferred) */
     for (int i{0}; i<10000; i++) {
         PomaPacketType du;
         du.m_properties.put("sample.text", "Example");
         du.m_properties.put("sample.data", i);
-        pipeline_source->on_incoming_data(du, "default");
+        pipeline_source->on_incoming_data(std::move(du), "default");
     }
 
     /* 10. Before terminating, we flush the pipeline */
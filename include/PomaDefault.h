@@ -40,32 +40,12 @@
 
 struct MyData : public poma::Serializable {
 
-    MyData() = default;
+    // Add your fields here and list them in DECLARE_SERIALIZABLE_FIELDS:
+    // copy/move operations, serialize and deserialize are generated
+    uint64_t m_sequence{0};
+    std::string m_sample;
 
-    MyData(const MyData& o)
-    {
-        // copy constructor
-    }
-
-    MyData& operator=(const MyData& o)
-    {
-        // copy assign operator
-        return *this;
-    }
-
-    void serialize(std::string& output) const override
-    {
-        std::string sample1{"Hello"};
-        std::string sample2{"world"};
-        poma::pack(sample1, output);
-        poma::pack(sample2, output);
-    }
-
-    void deserialize(std::string::const_iterator& from) override
-    {
-        std::string sample1{poma::unpack(from)};
-        std::string sample2{poma::unpack(from)};
-    }
+    DECLARE_SERIALIZABLE_FIELDS(MyData, (m_sequence)(m_sample))
 
 };
 
@@ -40,6 +40,8 @@ namespace poma {
 
 class Loader {
 public:
+    ~Loader();
+
     void start_processing();
 
     PomaModuleType* get_source();
@@ -54,6 +56,8 @@ public:
     void configure(int argc, char* argv[]);
     void initialize();
     void flush();
+    void shutdown();
+    void print_link_stats(std::ostream& out);
 private:
     void parse_cli_config(boost::program_options::variables_map& vm, int argc, char* argv[]);
     void parse_json_config(boost::program_options::variables_map& vm, int argc, char* argv[]);
@@ -61,6 +65,9 @@ private:
     boost::property_tree::ptree parse_json(const char* file);
     boost::property_tree::ptree parse_json(std::istream& stream);
 
+    void compile_pipeline(const std::unordered_map<std::string, unsigned int>& incoming);
+    std::vector<std::string> drain_order();
+
     void die(const std::string& msg);
     std::shared_ptr<PomaModuleType> get_instance(const std::string& type, const std::string& name);
 
@@ -37,6 +37,8 @@
 #include <string>
 #include <sstream>
 #include <set>
+#include <map>
+#include <tuple>
 #include <exception>
 #include <stdexcept>
 #include <iostream>
@@ -46,9 +48,17 @@
 #include <atomic>
 #include <algorithm>
 #include <queue>
+#include <deque>
 #include <mutex>
 #include <condition_variable>
 #include <chrono>
+#include <functional>
+#include <future>
+#include <limits>
+#include <cerrno>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <boost/preprocessor/seq/for_each.hpp>
 #include <boost/preprocessor/seq/for_each_i.hpp>
 #include <boost/preprocessor/punctuation/comma_if.hpp>
@@ -66,6 +76,9 @@
 #include <boost/config.hpp>
 #include <boost/lockfree/queue.hpp>
 #include <type_traits>
+#include "PomaSerialization.h"
+#include "PomaTracing.h"
+#include "PomaPlacement.h"
 
 namespace poma {
     
@@ -73,636 +86,3121 @@ namespace poma {
 #define PROCESSING_MODULE false
 
 // *********************************************************************
-// BASE PACKET TEMPLATE
-// *********************************************************************
-template<typename X>
-struct Packet {
-    X m_data;
-    boost::property_tree::ptree m_properties;
-};
-
-// *********************************************************************
-// SERIALIZATION STUFF
+// SERIALIZABLE USER DATA
 // *********************************************************************
 struct Serializable {
     virtual void serialize(std::string& output) const = 0;
     virtual void deserialize(std::string::const_iterator& from) = 0;
-};
-
-#define ASSERT_IS_POMA_SERIALIZABLE(X) static_assert(std::is_base_of<poma::Serializable, decltype(X)>::value, "X must inherit from poma::Serializable");
-
-void pack(const std::string& source_data_string, std::string& packed_data_string)
-{
-    // Warning: assume a maximum length of 2^32 bytes
-    uint32_t data_payload_size{(uint32_t) source_data_string.size()};
-    // big endian
-    packed_data_string.push_back((data_payload_size >> 24) & 0xFF);
-    packed_data_string.push_back((data_payload_size >> 16) & 0xFF);
-    packed_data_string.push_back((data_payload_size >> 8) & 0xFF);
-    packed_data_string.push_back(data_payload_size & 0xFF);
-    packed_data_string.insert(packed_data_string.end(), source_data_string.begin(), source_data_string.end());
-}
 
-std::string unpack(std::string::const_iterator& from)
-{
-    unsigned char b0 = (unsigned char) *from++;
-    unsigned char b1 = (unsigned char) *from++;
-    unsigned char b2 = (unsigned char) *from++;
-    unsigned char b3 = (unsigned char) *from++;
-    uint32_t data_payload_size{(uint32_t) ((b0 << 24)+(b1 << 16)+(b2 << 8)+ b3)};
-    std::string result{std::string{from, from + data_payload_size}};
-    from = from + data_payload_size;
-    return result;
-}
+    /* Bounded variant, used when decoding received packets: types that do
+       not override it are trusted not to read past the end of their data */
+    virtual void deserialize(std::string::const_iterator& from, std::string::const_iterator end)
+    {
+        deserialize(from);
+    }
 
-template<typename T>
-void deserialize(Packet<T>& dta, const std::string& data_string)
-{
-    std::string::const_iterator str_iter{data_string.begin()};
-    std::string json_string{unpack(str_iter)};
-    std::istringstream iss{json_string};
-    boost::property_tree::json_parser::read_json(iss, dta.m_properties);
-    dta.m_data.deserialize(str_iter);
-}
+    /* Scatter-gather output: types with large fields should override this
+       method and add one segment per field (or a view of the field) so that
+       fields are never joined. The concatenation of the segments must be
+       what serialize(std::string&) produces */
+    virtual void serialize(Segments& output) const
+    {
+        serialize(output.add());
+    }
 
-template<typename T>
-void serialize(const Packet<T>& dta, std::string& data_string)
-{
-    ASSERT_IS_POMA_SERIALIZABLE(dta.m_data);
-    std::stringstream ss;
-    boost::property_tree::write_json(ss, dta.m_properties);
-    auto json_string{ss.str()};
-    pack(json_string, data_string);
-    dta.m_data.serialize(data_string);
-}
+    /* Payload received as separate frames, starting at index */
+    virtual void deserialize(const std::vector<std::string>& frames, size_t index)
+    {
+        if (index + 1 == frames.size()) {
+            std::string::const_iterator from{frames[index].begin()};
+            deserialize(from, frames[index].end());
+        } else {
+            std::string joined;
+            for (size_t i{index}; i < frames.size(); ++i) {
+                joined.append(frames[i]);
+            }
+            std::string::const_iterator from{joined.begin()};
+            deserialize(from, joined.end());
+        }
+    }
+};
 
 // *********************************************************************
-// BASE LINK TEMPLATE
+// BASE PACKET TEMPLATE
 // *********************************************************************
+template<typename X>
+struct Packet {
+    X m_data;
+    Properties m_properties;
+    // Payload frames not decoded yet (see deserialize_lazy)
+    std::vector<std::string> m_encoded_data;
+    // Tracer::UNDECIDED, Tracer::UNTRACED or the trace identifier
+    uint64_t m_trace{Tracer::UNDECIDED};
 
-/* Forward declaration */
-template<typename T>
-class BaseModule;
+    /* Payload access for lazily decoded packets: m_data is only valid
+       after the first call */
+    X& data()
+    {
+        if (!m_encoded_data.empty()) {
+            static_cast<Serializable&>(m_data).deserialize(m_encoded_data, 0);
+            m_encoded_data.clear();
+        }
+        return m_data;
+    }
 
-template<typename T>
-struct Link {
-    Link(std::shared_ptr<BaseModule<T>> module, bool do_debug)
-        : m_module{module}, m_debug{do_debug} {};
-    std::shared_ptr<BaseModule<T>> m_module;
-    bool m_debug {false};
+    bool deferred() const
+    {
+        return !m_encoded_data.empty() || m_properties.deferred();
+    }
 };
 
-#define FATAL(msg) std::cerr << msg << std::endl; assert(0);
-
 // *********************************************************************
-// PROPERTY MANAGEMENT HELPER MACROS AND FUNCTIONS
+// PACKET POOL
 // *********************************************************************
-template<typename M>
-bool set_field_value_from_string(M* field, std::string value)
-{
-    std::istringstream ss{value};
-    M tmp;
-    ss >> std::skipws >> std::boolalpha >> tmp;
-    if (!ss.fail()) {
-        *field = tmp;
-        return true;
-    } else {
-        return false;
-    }
-}
 
-template<>
-bool set_field_value_from_string(bool* field, std::string value)
-{
-    if (value == "true") {
-        *field = true;
-    } else if (value == "false") {
-        *field = false;
-    } else {
-        return false;
-    }
-    return true;
-}
+#ifndef POMA_PACKET_POOL_SIZE
+#define POMA_PACKET_POOL_SIZE 256
+#endif
 
-template<>
-bool set_field_value_from_string(std::string* field, std::string value)
-{
-    *field = value;
-    return true;
-}
+/* Recycles packets: sources acquire packets from the pool, packets that
+   reach the end of the pipeline (submitted with no sink) are released
+   into the free list of the releasing thread. Metadata entries of a
+   recycled packet keep their memory, so packets of the same shape are
+   built without allocations. Free lists are bounded: the excess is moved
+   to a shared depot, from which threads that only acquire (sources)
+   refill. Define POMA_PACKET_POOL_SIZE to 0 to disable pooling */
+template<typename X>
+class PacketPool {
+public:
+    struct Stats {
+        unsigned long m_acquired{0};
+        unsigned long m_recycled{0};
+        unsigned long m_released{0};
+    };
 
-#define return_readable_property(rname, prop) \
-if (rname == #prop) { std::stringstream tmp; tmp << std::boolalpha << prop; return tmp.str(); }
+    static Packet<X> acquire()
+    {
+        FreeList& local = free_list();
+        local.m_stats.m_acquired++;
+        if (local.m_packets.empty() && POMA_PACKET_POOL_SIZE > 0) {
+            refill(local);
+        }
+        if (local.m_packets.empty()) {
+            return Packet<X>{};
+        }
+        local.m_stats.m_recycled++;
+        Packet<X> dta{std::move(local.m_packets.back())};
+        local.m_packets.pop_back();
+        return dta;
+    }
 
-#define return_writable_property(rname, rvalue, prop) \
-if (rname == #prop) { \
-    if (poma::set_field_value_from_string(&(prop), rvalue)) set_reconfigure_module(); \
-    std::stringstream outss; \
-    outss << prop; \
-    return outss.str(); \
-}
+    static void release(Packet<X>&& dta)
+    {
+        if (POMA_PACKET_POOL_SIZE == 0) {
+            return;
+        }
+        FreeList& local = free_list();
+        local.m_stats.m_released++;
+        if (local.m_packets.size() >= POMA_PACKET_POOL_SIZE) {
+            spill(local);
+        }
+        dta.m_properties.clear();
+        dta.m_data = X{};
+        dta.m_encoded_data.clear();
+        dta.m_trace = Tracer::UNDECIDED;
+        local.m_packets.push_back(std::move(dta));
+    }
 
-#define RETURN_READABLE_PROPERTY(r, data, field) return_readable_property(name, field);
-#define RETURN_WRITABLE_PROPERTY(r, data, field) return_writable_property(name, value, field);
-#define GET_QUOTED_PROPERTY(field) #field
-#define ENUMERATE_PROPERTY(r, data, i, field) BOOST_PP_COMMA_IF(i) GET_QUOTED_PROPERTY(field)
+    /* Counters of the calling thread */
+    static Stats stats()
+    {
+        return free_list().m_stats;
+    }
 
+private:
+    struct FreeList {
+        std::vector<Packet<X> > m_packets;
+        Stats m_stats;
+    };
 
-#define DECLARE_READABLE_PROPERTIES(props) \
-    std::string on_read_property(const std::string& name) const override { \
-        BOOST_PP_SEQ_FOR_EACH(RETURN_READABLE_PROPERTY,, props) \
-        throw std::runtime_error{std::string{"invalid readable property "} + name}; \
+    struct Depot {
+        std::mutex m_mutex;
+        std::vector<Packet<X> > m_packets;
+    };
+
+    static FreeList& free_list()
+    {
+        static thread_local FreeList list;
+        return list;
     }
 
-#define DECLARE_WRITABLE_PROPERTIES(props) \
-    std::string on_write_property(const std::string& name, const std::string& value) override { \
-        synchronized_scope(); \
-        BOOST_PP_SEQ_FOR_EACH(RETURN_WRITABLE_PROPERTY,, props) \
-        throw std::runtime_error{std::string{"invalid writable property "} + name}; \
+    static Depot& depot()
+    {
+        // never destroyed: detached threads may still release packets at exit
+        static Depot* d = new Depot;
+        return *d;
     }
 
-#define DECLARE_ENUMERATABLE_PROPERTIES(props) \
-    std::string on_enumerate_properties() const override { \
-        std::vector<std::string> properties { BOOST_PP_SEQ_FOR_EACH_I(ENUMERATE_PROPERTY, , props) }; \
-        return boost::algorithm::join(properties, ","); \
+    static void spill(FreeList& local)
+    {
+        Depot& d = depot();
+        std::unique_lock<std::mutex> lock(d.m_mutex);
+        while (local.m_packets.size() > POMA_PACKET_POOL_SIZE / 2) {
+            if (d.m_packets.size() < 8 * POMA_PACKET_POOL_SIZE) {
+                d.m_packets.push_back(std::move(local.m_packets.back()));
+            }
+            local.m_packets.pop_back();
+        }
     }
 
-#define DECLARE_PROPERTIES(props) \
-    DECLARE_READABLE_PROPERTIES(props) \
-    DECLARE_WRITABLE_PROPERTIES(props) \
-    DECLARE_ENUMERATABLE_PROPERTIES(props)
+    static void refill(FreeList& local)
+    {
+        Depot& d = depot();
+        std::unique_lock<std::mutex> lock(d.m_mutex);
+        while (!d.m_packets.empty() && local.m_packets.size() < POMA_PACKET_POOL_SIZE / 2) {
+            local.m_packets.push_back(std::move(d.m_packets.back()));
+            d.m_packets.pop_back();
+        }
+    }
+};
 
 // *********************************************************************
-// BASE MODULE TEMPLATE (Cloneable when subclassed)
+// PACKET BATCH
 // *********************************************************************
-template<typename T>
-class BaseModule {
+
+/* Packets travelling together: a batch costs one virtual call, one sink
+   lookup and one queue handoff per hop (see submit_batch) */
+template<typename X>
+class PacketBatch {
 public:
-    BaseModule(const std::string& mid)
-        : m_module_mutex{new std::mutex},
-    m_module_id {mid}
-    {
-        sm_instances.push_back(this);
-    }
+    typedef typename std::vector<Packet<X> >::iterator iterator;
+    typedef typename std::vector<Packet<X> >::const_iterator const_iterator;
 
-    BaseModule(const BaseModule& o)
-        : m_module_mutex{new std::mutex},
-    m_module_id{o.m_module_id},
-    m_sinks{o.m_sinks} {}
+    PacketBatch() = default;
 
-    BaseModule& operator=(const BaseModule& o)
+    explicit PacketBatch(std::vector<Packet<X> >&& packets) : m_packets(std::move(packets)) {}
+
+    void push_back(Packet<X>&& dta)
     {
-        if (m_module_mutex == nullptr) {
-            delete m_module_mutex;
-        }
-        m_module_mutex = new std::mutex;
-        m_sinks = o.m_sinks;
-        m_module_id = o.m_module_id;
+        m_packets.push_back(std::move(dta));
     }
 
-    virtual ~BaseModule()
+    void reserve(size_t n)
     {
-        sm_instances.erase(std::remove(sm_instances.begin(), sm_instances.end(), this), sm_instances.end());
+        m_packets.reserve(n);
     }
 
-    /* Module locking methods */
-    void lock_module()
+    size_t size() const
     {
-        m_module_mutex->lock();
+        return m_packets.size();
     }
 
-    void unlock_module()
+    bool empty() const
     {
-        m_module_mutex->unlock();
+        return m_packets.empty();
     }
 
-    bool check_reconfigure_module()
+    void clear()
     {
-        if (m_do_reconfigure_module) {
-            m_do_reconfigure_module = false;
-            return true;
-        } else {
-            return false;
-        }
+        m_packets.clear();
     }
 
-    void set_reconfigure_module()
+    Packet<X>& operator[](size_t i)
     {
-        m_do_reconfigure_module = true;
+        return m_packets[i];
     }
 
-    void clear_reconfigure_module()
+    iterator begin()
     {
-        m_do_reconfigure_module = false;
+        return m_packets.begin();
     }
 
-#define synchronized_scope() std::unique_lock<std::mutex> ___lock(*m_module_mutex);
+    iterator end()
+    {
+        return m_packets.end();
+    }
 
-    /* Global module functions */
-    static void initialize_all()
+    const_iterator begin() const
     {
-        for (auto i : sm_instances) {
-            try {
-                i->initialize();
-            } catch (const boost::exception& e) {
-                std::cerr << "DEBUG: Failed to initialize module " << typeid(*i).name() << ":" << boost::diagnostic_information(e) << std::endl;
-                throw;
-            } catch (std::exception e) {
-                std::cerr << "DEBUG: Failed to initialize module " << typeid(*i).name() << ":" << e.what() << std::endl;
-                throw;
-            } catch (...) {
-                std::cerr << "DEBUG: Failed to initialize module: " << typeid(*i).name() << std::endl;
-                throw;
-            }
-        }
+        return m_packets.begin();
     }
 
-    static void display_help_all()
+    const_iterator end() const
     {
-        // Only the help of not yet initialized modules will be "shown"
-        boost::program_options::options_description desc;
-        for (auto i : sm_instances) {
-            std::string cname {i->getType()};
-            if (sm_instances_classes.count(cname) == 0) {
-                sm_instances_classes.insert(cname);
-                i->setup_cli(desc);
-            }
-        }
-        std::cerr << desc << std::endl;
+        return m_packets.end();
     }
 
-    static boost::program_options::variables_map setup_cli_all(int argc, char* argv[])
+    std::vector<Packet<X> >& packets()
     {
-        boost::program_options::options_description desc;
-        for (auto i : sm_instances) {
-            std::string cname {i->getType()};
-            if (sm_instances_classes.count(cname) == 0) {
-                sm_instances_classes.insert(cname);
-                i->setup_cli(desc);
+        return m_packets;
+    }
+
+private:
+    std::vector<Packet<X> > m_packets;
+};
+
+// *********************************************************************
+// PACKET TRACING
+// *********************************************************************
+
+/* Metadata property holding the trace identifier of traced packets */
+inline const PropertyKey& trace_key()
+{
+    static const PropertyKey key{"poma.trace"};
+    return key;
+}
+
+/* Trace of a packet, decided when it is first submitted: packets derived
+   from a traced packet (same metadata) keep its identifier, others are
+   sampled */
+template<typename X>
+uint64_t trace_of(Packet<X>& dta)
+{
+    if (dta.m_trace == Tracer::UNDECIDED) {
+        const PropertyValue* v{dta.m_properties.find(trace_key().id())};
+        if (v != nullptr && v->type() == PropertyValue::Type::INT) {
+            dta.m_trace = v->int_value();
+        } else {
+            dta.m_trace = Tracer::instance().sample();
+            if (dta.m_trace != Tracer::UNTRACED) {
+                dta.m_properties.put(trace_key(), static_cast<int64_t>(dta.m_trace));
             }
         }
-        boost::program_options::variables_map vm;
-        try {
-            boost::program_options::store(boost::program_options::command_line_parser(argc, argv).options(desc).allow_unregistered().run(), vm);
-            boost::program_options::notify(vm);
-        } catch (const boost::exception& e) {
-            std::cerr << "DEBUG: Failed to setup command line arguments: " << boost::diagnostic_information(e) << std::endl;
-            throw;
-        } catch (std::exception &e) {
-            std::cerr << "DEBUG: Failed to setup command line arguments: " << e.what() << std::endl;
-            throw;
-        }
-        for (auto i : sm_instances) {
-            i->process_cli(vm);
-        }
-        return vm;
+    }
+    return dta.m_trace;
+}
+
+template<typename X>
+bool traced(const Packet<X>& dta)
+{
+    return dta.m_trace > Tracer::UNTRACED;
+}
+
+/* Called on received packets: the decision of the sender is kept, lazily
+   decoded metadata is only decoded for traced packets */
+template<typename X>
+void restore_trace(Packet<X>& dta)
+{
+    if (!Tracer::enabled()) {
+        return;
+    }
+    if (dta.m_properties.deferred()) {
+        const auto& keys = dta.m_properties.deferred_keys();
+        if (std::find(keys.begin(), keys.end(), trace_key().id()) == keys.end()) {
+            dta.m_trace = Tracer::UNTRACED;
+            return;
+        }
+    }
+    const PropertyValue* v{dta.m_properties.find(trace_key().id())};
+    dta.m_trace = (v != nullptr && v->type() == PropertyValue::Type::INT) ? v->int_value() : Tracer::UNTRACED;
+}
+
+// *********************************************************************
+// SERIALIZATION STUFF
+// *********************************************************************
+
+#define ASSERT_IS_POMA_SERIALIZABLE(X) static_assert(std::is_base_of<poma::Serializable, decltype(X)>::value, "X must inherit from poma::Serializable");
+
+void pack(const std::string& source_data_string, std::string& packed_data_string)
+{
+    uint64_t data_payload_size{(uint64_t) source_data_string.size()};
+    // 64 bit length, big endian
+    char header[8];
+    for (int i{0}; i < 8; ++i) {
+        header[i] = (char) ((data_payload_size >> (56 - 8 * i)) & 0xFF);
+    }
+    packed_data_string.reserve(packed_data_string.size() + 8 + source_data_string.size());
+    packed_data_string.append(header, 8);
+    packed_data_string.append(source_data_string);
+}
+
+std::string unpack(std::string::const_iterator& from)
+{
+    uint64_t data_payload_size{0};
+    for (int i{0}; i < 8; ++i) {
+        data_payload_size = (data_payload_size << 8) | (unsigned char) *from++;
+    }
+    std::string result{std::string{from, from + data_payload_size}};
+    from = from + data_payload_size;
+    return result;
+}
+
+/* Bounded variant, for data received from another process: a length
+   larger than the data left is refused before anything is allocated */
+std::string unpack(std::string::const_iterator& from, std::string::const_iterator end)
+{
+    if (end - from < 8) {
+        throw std::runtime_error{"truncated length in packed data"};
+    }
+    uint64_t data_payload_size{0};
+    for (int i{0}; i < 8; ++i) {
+        data_payload_size = (data_payload_size << 8) | (unsigned char) *from++;
+    }
+    if (data_payload_size > static_cast<uint64_t>(end - from)) {
+        throw std::runtime_error{"truncated packed data"};
+    }
+    std::string result{std::string{from, from + data_payload_size}};
+    from = from + data_payload_size;
+    return result;
+}
+
+// *********************************************************************
+// GENERATED FIELD SERIALIZERS
+// *********************************************************************
+
+/* Fields of payload types declared with DECLARE_SERIALIZABLE_FIELDS are
+   laid out as:
+     <fixed fields>        trivially copyable fields, memcpy'd at offsets
+                           known at compile time
+     <lengths>             one 64 bit length per variable field
+     <variable fields>     strings and vectors of trivially copyable values
+   Values are written in host byte order: both ends of a connection must
+   share it. Lengths are checked against the received data before copying */
+
+#ifndef POMA_SEGMENT_VIEW_SIZE
+#define POMA_SEGMENT_VIEW_SIZE 4096
+#endif
+
+template<typename T, typename Enable = void>
+struct FieldCodec {
+    static_assert(sizeof(T) == 0, "field type must be trivially copyable, a std::string or a std::vector of trivially copyable values");
+};
+
+template<typename T>
+struct FieldCodec<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+    static constexpr bool is_fixed = true;
+    static constexpr size_t fixed_size = sizeof(T);
+
+    static void write(const T& field, char* to)
+    {
+        std::memcpy(to, &field, sizeof(T));
+    }
+
+    static void read(T& field, const char* from)
+    {
+        std::memcpy(&field, from, sizeof(T));
+    }
+};
+
+template<>
+struct FieldCodec<std::string> {
+    static constexpr bool is_fixed = false;
+    static constexpr size_t fixed_size = 0;
+    static constexpr size_t element_size = 1;
+
+    static size_t size(const std::string& field)
+    {
+        return field.size();
+    }
+
+    static const char* data(const std::string& field)
+    {
+        return field.data();
+    }
+
+    static void read(std::string& field, const char* from, size_t size)
+    {
+        field.assign(from, size);
+    }
+};
+
+template<typename T>
+struct FieldCodec<std::vector<T>, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+    static constexpr bool is_fixed = false;
+    static constexpr size_t fixed_size = 0;
+    static constexpr size_t element_size = sizeof(T);
+
+    static size_t size(const std::vector<T>& field)
+    {
+        return field.size() * sizeof(T);
+    }
+
+    static const char* data(const std::vector<T>& field)
+    {
+        return reinterpret_cast<const char*>(field.data());
+    }
+
+    static void read(std::vector<T>& field, const char* from, size_t size)
+    {
+        field.resize(size / sizeof(T));
+        if (size > 0) {
+            std::memcpy(field.data(), from, size);
+        }
+    }
+};
+
+/* Cursors over the three sections of the layout */
+struct FieldWriter {
+    char* m_fixed;
+    char* m_lengths;
+    char* m_variable;
+};
+
+struct FieldReader {
+    const char* m_fixed;
+    const char* m_lengths;
+    const char* m_variable;
+    size_t m_remaining;     // bytes left in the variable section
+};
+
+template<typename T>
+constexpr size_t field_fixed_size()
+{
+    return FieldCodec<T>::is_fixed ? FieldCodec<T>::fixed_size : sizeof(uint64_t);
+}
+
+template<typename T>
+constexpr size_t field_is_variable()
+{
+    return FieldCodec<T>::is_fixed ? 0 : 1;
+}
+
+template<typename T>
+size_t field_variable_size(const T& field, std::true_type)
+{
+    return 0;
+}
+
+template<typename T>
+size_t field_variable_size(const T& field, std::false_type)
+{
+    return FieldCodec<T>::size(field);
+}
+
+template<typename T>
+size_t field_variable_size(const T& field)
+{
+    return field_variable_size(field, std::integral_constant<bool, FieldCodec<T>::is_fixed> {});
+}
+
+template<typename T>
+void write_field(const T& field, FieldWriter& w, std::true_type)
+{
+    FieldCodec<T>::write(field, w.m_fixed);
+    w.m_fixed += FieldCodec<T>::fixed_size;
+}
+
+template<typename T>
+void write_field(const T& field, FieldWriter& w, std::false_type)
+{
+    uint64_t size{FieldCodec<T>::size(field)};
+    std::memcpy(w.m_lengths, &size, sizeof(size));
+    w.m_lengths += sizeof(size);
+    // without a variable section only the lengths are written
+    if (w.m_variable != nullptr) {
+        if (size > 0) {
+            std::memcpy(w.m_variable, FieldCodec<T>::data(field), size);
+        }
+        w.m_variable += size;
+    }
+}
+
+template<typename T>
+void write_field(const T& field, FieldWriter& w)
+{
+    write_field(field, w, std::integral_constant<bool, FieldCodec<T>::is_fixed> {});
+}
+
+template<typename T>
+void read_field(T& field, FieldReader& r, std::true_type)
+{
+    FieldCodec<T>::read(field, r.m_fixed);
+    r.m_fixed += FieldCodec<T>::fixed_size;
+}
+
+template<typename T>
+void read_field(T& field, FieldReader& r, std::false_type)
+{
+    uint64_t size;
+    std::memcpy(&size, r.m_lengths, sizeof(size));
+    r.m_lengths += sizeof(size);
+    if (size > r.m_remaining) {
+        throw std::runtime_error{"truncated field in binary packet"};
+    }
+    if (size % FieldCodec<T>::element_size != 0) {
+        throw std::runtime_error{"invalid field length in binary packet"};
+    }
+    r.m_remaining -= size;
+    FieldCodec<T>::read(field, r.m_variable, size);
+    r.m_variable += size;
+}
+
+template<typename T>
+void read_field(T& field, FieldReader& r)
+{
+    read_field(field, r, std::integral_constant<bool, FieldCodec<T>::is_fixed> {});
+}
+
+/* Large variable fields become views, small ones are appended to the
+   current owned segment */
+template<typename T>
+void add_field_segment(const T& field, Segments& output, std::string*& tail, std::true_type)
+{
+}
+
+template<typename T>
+void add_field_segment(const T& field, Segments& output, std::string*& tail, std::false_type)
+{
+    size_t size{FieldCodec<T>::size(field)};
+    if (size >= POMA_SEGMENT_VIEW_SIZE) {
+        output.add_view(FieldCodec<T>::data(field), size);
+        tail = nullptr;
+    } else {
+        if (tail == nullptr) {
+            tail = &output.add();
+        }
+        tail->append(FieldCodec<T>::data(field), size);
+    }
+}
+
+template<typename T>
+void add_field_segment(const T& field, Segments& output, std::string*& tail)
+{
+    add_field_segment(field, output, tail, std::integral_constant<bool, FieldCodec<T>::is_fixed> {});
+}
+
+#define POMA_FIELD_FIXED_SIZE(r, data, field) + poma::field_fixed_size<decltype(field)>()
+#define POMA_VARIABLE_FIELD_COUNT(r, data, field) + poma::field_is_variable<decltype(field)>()
+#define POMA_FIELD_VARIABLE_SIZE(r, data, field) + poma::field_variable_size(field)
+#define POMA_WRITE_FIELD(r, writer, field) poma::write_field(field, writer);
+#define POMA_READ_FIELD(r, reader, field) poma::read_field(field, reader);
+#define POMA_ADD_FIELD_SEGMENT(r, tail, field) poma::add_field_segment(field, output, tail);
+
+/* Generates copy/move operations, serialize and deserialize for a payload
+   type from the sequence of its fields, e.g.
+       DECLARE_SERIALIZABLE_FIELDS(MyData, (m_id)(m_name)(m_samples))
+   Fields must be trivially copyable, std::string or std::vector of
+   trivially copyable values */
+#define DECLARE_SERIALIZABLE_FIELDS(type, fields) \
+    type() = default; \
+    type(const type&) = default; \
+    type(type&&) = default; \
+    type& operator=(const type&) = default; \
+    type& operator=(type&&) = default; \
+    static constexpr size_t fixed_section_size() { \
+        return 0 BOOST_PP_SEQ_FOR_EACH(POMA_FIELD_FIXED_SIZE,, fields); \
+    } \
+    static constexpr size_t lengths_offset() { \
+        return fixed_section_size() - sizeof(uint64_t) * (0 BOOST_PP_SEQ_FOR_EACH(POMA_VARIABLE_FIELD_COUNT,, fields)); \
+    } \
+    size_t serialized_size() const { \
+        return fixed_section_size() BOOST_PP_SEQ_FOR_EACH(POMA_FIELD_VARIABLE_SIZE,, fields); \
+    } \
+    void serialize(std::string& output) const override { \
+        size_t base{output.size()}; \
+        output.resize(base + serialized_size()); \
+        char* start{&output[base]}; \
+        poma::FieldWriter writer{start, start + lengths_offset(), start + fixed_section_size()}; \
+        BOOST_PP_SEQ_FOR_EACH(POMA_WRITE_FIELD, writer, fields) \
+    } \
+    void serialize(poma::Segments& output) const override { \
+        std::string* tail{&output.add()}; \
+        tail->resize(fixed_section_size()); \
+        char* start{&(*tail)[0]}; \
+        poma::FieldWriter writer{start, start + lengths_offset(), nullptr}; \
+        BOOST_PP_SEQ_FOR_EACH(POMA_WRITE_FIELD, writer, fields) \
+        BOOST_PP_SEQ_FOR_EACH(POMA_ADD_FIELD_SEGMENT, tail, fields) \
+    } \
+    void deserialize(std::string::const_iterator& from) override { \
+        deserialize_fields(from, std::numeric_limits<size_t>::max()); \
+    } \
+    void deserialize(std::string::const_iterator& from, std::string::const_iterator end) override { \
+        size_t available{static_cast<size_t>(end - from)}; \
+        if (available < fixed_section_size()) { \
+            throw std::runtime_error{"truncated payload in binary packet"}; \
+        } \
+        deserialize_fields(from, available); \
+    } \
+    void deserialize_fields(std::string::const_iterator& from, size_t available) { \
+        const char* start{available == 0 ? nullptr : &*from}; \
+        poma::FieldReader reader{start, start + lengths_offset(), start + fixed_section_size(), available - fixed_section_size()}; \
+        BOOST_PP_SEQ_FOR_EACH(POMA_READ_FIELD, reader, fields) \
+        from += reader.m_variable - start; \
+    }
+
+/* Deserialization detects the encoding (binary or JSON) of the packet.
+   Packets encoded with a key dictionary can only be decoded by passing
+   the dictionaries of the receiving end of the connection */
+template<typename T>
+void deserialize(Packet<T>& dta, const std::string& data_string, MetadataDictionaries* dictionaries)
+{
+    std::string::const_iterator str_iter{data_string.begin()};
+    if (codec::is_binary(data_string)) {
+        decode_properties(str_iter, data_string.end(), dta.m_properties, dictionaries);
+    } else {
+        std::string json_string{unpack(str_iter, data_string.end())};
+        std::istringstream iss{json_string};
+        boost::property_tree::ptree pt;
+        boost::property_tree::json_parser::read_json(iss, pt);
+        dta.m_properties.from_ptree(pt);
+    }
+    static_cast<Serializable&>(dta.m_data).deserialize(str_iter, data_string.end());
+    restore_trace(dta);
+}
+
+/* Packets received as multipart frames (see serialize with Segments):
+   header and metadata are joined, payload fields are left as they are */
+template<typename T>
+void deserialize(Packet<T>& dta, const std::vector<std::string>& frames, MetadataDictionaries* dictionaries)
+{
+    if (frames.size() == 1) {
+        deserialize(dta, frames[0], dictionaries);
+        return;
+    }
+    size_t payload_index{1};
+    if (codec::is_binary(frames[0])) {
+        std::string metadata{frames[0]};
+        metadata.append(frames[1]);
+        std::string::const_iterator str_iter{metadata.begin()};
+        decode_properties(str_iter, metadata.end(), dta.m_properties, dictionaries);
+        payload_index = 2;
+    } else {
+        std::string::const_iterator str_iter{frames[0].begin()};
+        std::string json_string{unpack(str_iter, frames[0].end())};
+        std::istringstream iss{json_string};
+        boost::property_tree::ptree pt;
+        boost::property_tree::json_parser::read_json(iss, pt);
+        dta.m_properties.from_ptree(pt);
+    }
+    static_cast<Serializable&>(dta.m_data).deserialize(frames, payload_index);
+    restore_trace(dta);
+}
+
+template<typename T>
+void deserialize(Packet<T>& dta, const std::vector<std::string>& frames, MetadataDictionaries& dictionaries)
+{
+    deserialize(dta, frames, &dictionaries);
+}
+
+/* Lazy variant for binary multipart packets: metadata and payload are
+   taken over from frames and decoded on first access (metadata through
+   any Properties accessor, payload through data()). Payload frames that
+   were never decoded are sent again as they are by serialize. Other
+   encodings are decoded immediately */
+template<typename T>
+void deserialize_lazy(Packet<T>& dta, std::vector<std::string>& frames, MetadataDictionaries* dictionaries)
+{
+    if (frames.size() < 2 || !codec::is_binary(frames[0])) {
+        deserialize(dta, frames, dictionaries);
+        return;
+    }
+    defer_properties(frames[0], std::move(frames[1]), dta.m_properties, dictionaries);
+    dta.m_encoded_data.clear();
+    for (size_t i{2}; i < frames.size(); ++i) {
+        dta.m_encoded_data.push_back(std::move(frames[i]));
+    }
+    restore_trace(dta);
+}
+
+template<typename T>
+void deserialize_lazy(Packet<T>& dta, std::vector<std::string>& frames, MetadataDictionaries& dictionaries)
+{
+    deserialize_lazy(dta, frames, &dictionaries);
+}
+
+template<typename T>
+void deserialize(Packet<T>& dta, const std::string& data_string)
+{
+    deserialize(dta, data_string, nullptr);
+}
+
+template<typename T>
+void deserialize(Packet<T>& dta, const std::string& data_string, MetadataDictionaries& dictionaries)
+{
+    deserialize(dta, data_string, &dictionaries);
+}
+
+/* Payload of a packet, frames that were never decoded are copied as they are */
+template<typename T>
+void serialize_data(const Packet<T>& dta, std::string& data_string)
+{
+    if (dta.m_encoded_data.empty()) {
+        dta.m_data.serialize(data_string);
+    } else {
+        for (const auto& frame : dta.m_encoded_data) {
+            data_string.append(frame);
+        }
+    }
+}
+
+template<typename T>
+void serialize(const Packet<T>& dta, std::string& data_string, Encoding encoding = Encoding::BINARY)
+{
+    ASSERT_IS_POMA_SERIALIZABLE(dta.m_data);
+    if (encoding == Encoding::BINARY) {
+        encode_properties(dta.m_properties, data_string);
+    } else {
+        std::stringstream ss;
+        boost::property_tree::write_json(ss, dta.m_properties.to_ptree());
+        auto json_string{ss.str()};
+        pack(json_string, data_string);
+    }
+    serialize_data(dta, data_string);
+}
+
+/* Scatter-gather serialization: header, metadata and payload fields are
+   written to separate segments (binary), or the packed JSON metadata and
+   payload fields (JSON) */
+template<typename T>
+void serialize(const Packet<T>& dta, Segments& segments, MetadataDictionary* dictionary, Encoding encoding)
+{
+    ASSERT_IS_POMA_SERIALIZABLE(dta.m_data);
+    if (encoding == Encoding::BINARY) {
+        std::string& header = segments.add();
+        std::string& metadata = segments.add();
+        encode_properties(dta.m_properties, header, metadata, dictionary);
+    } else {
+        std::stringstream ss;
+        boost::property_tree::write_json(ss, dta.m_properties.to_ptree());
+        pack(ss.str(), segments.add());
+    }
+    if (dta.m_encoded_data.empty()) {
+        static_cast<const Serializable&>(dta.m_data).serialize(segments);
+    } else {
+        for (const auto& frame : dta.m_encoded_data) {
+            segments.add_view(frame.data(), frame.size());
+        }
+    }
+}
+
+template<typename T>
+void serialize(const Packet<T>& dta, Segments& segments, Encoding encoding = Encoding::BINARY)
+{
+    serialize(dta, segments, nullptr, encoding);
+}
+
+template<typename T>
+void serialize(const Packet<T>& dta, Segments& segments, MetadataDictionary& dictionary)
+{
+    serialize(dta, segments, &dictionary, Encoding::BINARY);
+}
+
+/* Binary encoding, keys already sent on this connection are replaced by
+   their identifier in the dictionary */
+template<typename T>
+void serialize(const Packet<T>& dta, std::string& data_string, MetadataDictionary& dictionary)
+{
+    ASSERT_IS_POMA_SERIALIZABLE(dta.m_data);
+    encode_properties(dta.m_properties, data_string, &dictionary);
+    serialize_data(dta, data_string);
+}
+
+// *********************************************************************
+// CHANNELS
+// *********************************************************************
+
+struct Channels {
+    static const char* description()
+    {
+        return "channel";
+    }
+};
+
+typedef NameRegistry<Channels> ChannelRegistry;
+
+/* Handle to a channel, resolved once (typically as a member or in
+   process_cli): modules index their sinks by channel identifier, so
+   submitting on a handle involves no string comparison or hashing.
+   Default constructed handles refer to the "default" channel */
+class ChannelHandle {
+public:
+    ChannelHandle() : ChannelHandle(default_channel()) {}
+
+    explicit ChannelHandle(const std::string& name)
+        : m_id{ChannelRegistry::instance().intern(name)},
+          m_name{&ChannelRegistry::instance().name(m_id)} {}
+
+    explicit ChannelHandle(const char* name) : ChannelHandle(std::string{name}) {}
+
+    /* Handle of a channel that already exists: unlike the constructor,
+       never adds name to the registry (for names taken from packets) */
+    static bool find(const std::string& name, ChannelHandle& handle)
+    {
+        uint32_t id;
+        if (!ChannelRegistry::instance().find(name, id)) {
+            return false;
+        }
+        handle.m_id = id;
+        handle.m_name = &ChannelRegistry::instance().name(id);
+        return true;
+    }
+
+    uint32_t id() const
+    {
+        return m_id;
+    }
+
+    const std::string& name() const
+    {
+        return *m_name;
+    }
+
+    bool operator==(const ChannelHandle& o) const
+    {
+        return m_id == o.m_id;
+    }
+
+    static const ChannelHandle& default_channel()
+    {
+        static const ChannelHandle channel{std::string{"default"}};
+        return channel;
+    }
+
+private:
+    uint32_t m_id;
+    const std::string* m_name;
+};
+
+// *********************************************************************
+// LINK STATISTICS
+// *********************************************************************
+
+#ifndef POMA_LINK_STATS_SHARDS
+#define POMA_LINK_STATS_SHARDS 16
+#endif
+
+// One delivery out of POMA_LINK_LATENCY_SAMPLING is timed (power of two)
+#ifndef POMA_LINK_LATENCY_SAMPLING
+#define POMA_LINK_LATENCY_SAMPLING 16
+#endif
+
+/* Always-on counters of a link. Each thread updates its own shard with
+   relaxed atomics (no contention up to POMA_LINK_STATS_SHARDS threads),
+   readers sum the shards. The latency is the time spent in the sink,
+   including its own sinks, in power of two buckets of nanoseconds:
+   bucket i counts the latencies below 2^i ns */
+class LinkStats {
+public:
+    static const unsigned int BUCKETS = 32;
+
+    struct Snapshot {
+        uint64_t m_packets{0};
+        uint64_t m_batches{0};
+        uint64_t m_bytes{0};
+        uint64_t m_samples{0};
+        uint64_t m_total_ns{0};
+        uint64_t m_histogram[BUCKETS] {};
+
+        void add(const Snapshot& o)
+        {
+            m_packets += o.m_packets;
+            m_batches += o.m_batches;
+            m_bytes += o.m_bytes;
+            m_samples += o.m_samples;
+            m_total_ns += o.m_total_ns;
+            for (unsigned int i{0}; i < BUCKETS; i++) {
+                m_histogram[i] += o.m_histogram[i];
+            }
+        }
+
+        uint64_t mean_ns() const
+        {
+            return m_samples == 0 ? 0 : m_total_ns / m_samples;
+        }
+
+        /* Upper bound of the bucket of the p-th percentile (0 < p <= 1) */
+        uint64_t percentile_ns(double p) const
+        {
+            uint64_t rank{static_cast<uint64_t>(p * m_samples + 0.5)};
+            uint64_t seen{0};
+            for (unsigned int i{0}; i < BUCKETS; i++) {
+                seen += m_histogram[i];
+                if (seen >= rank && seen > 0) {
+                    return uint64_t{1} << i;
+                }
+            }
+            return 0;
+        }
+    };
+
+    /* Whether the delivery about to start should be timed */
+    static bool sample()
+    {
+        return (++local().m_tick & (POMA_LINK_LATENCY_SAMPLING - 1)) == 0;
+    }
+
+    void count(uint64_t packets, uint64_t bytes, bool batch)
+    {
+        Shard& s = m_shards[local().m_shard];
+        s.m_packets.fetch_add(packets, std::memory_order_relaxed);
+        if (bytes > 0) {
+            s.m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+        if (batch) {
+            s.m_batches.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void latency(uint64_t ns)
+    {
+        Shard& s = m_shards[local().m_shard];
+        s.m_samples.fetch_add(1, std::memory_order_relaxed);
+        s.m_total_ns.fetch_add(ns, std::memory_order_relaxed);
+        unsigned int bucket{ns == 0 ? 0u : 64u - static_cast<unsigned int>(__builtin_clzll(ns))};
+        s.m_histogram[bucket < BUCKETS ? bucket : BUCKETS - 1].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Snapshot snapshot() const
+    {
+        Snapshot r;
+        for (const auto& s : m_shards) {
+            r.m_packets += s.m_packets.load(std::memory_order_relaxed);
+            r.m_batches += s.m_batches.load(std::memory_order_relaxed);
+            r.m_bytes += s.m_bytes.load(std::memory_order_relaxed);
+            r.m_samples += s.m_samples.load(std::memory_order_relaxed);
+            r.m_total_ns += s.m_total_ns.load(std::memory_order_relaxed);
+            for (unsigned int i{0}; i < BUCKETS; i++) {
+                r.m_histogram[i] += s.m_histogram[i].load(std::memory_order_relaxed);
+            }
+        }
+        return r;
+    }
+
+private:
+    struct Shard {
+        std::atomic<uint64_t> m_packets{0};
+        std::atomic<uint64_t> m_batches{0};
+        std::atomic<uint64_t> m_bytes{0};
+        std::atomic<uint64_t> m_samples{0};
+        std::atomic<uint64_t> m_total_ns{0};
+        std::atomic<uint64_t> m_histogram[BUCKETS] {};
+        // keeps the counters of two threads off the same cache line
+        char m_padding[64];
+    };
+
+    struct ThreadState {
+        unsigned int m_shard;
+        unsigned int m_tick;
+    };
+
+    static ThreadState& local()
+    {
+        static std::atomic<unsigned int> next{0};
+        static thread_local ThreadState state{next++ % POMA_LINK_STATS_SHARDS, 0};
+        return state;
+    }
+
+    Shard m_shards[POMA_LINK_STATS_SHARDS];
+};
+
+/* Payload bytes of a packet, when known without encoding it: the size of
+   the undecoded frames, or the size computed by types declared with
+   DECLARE_SERIALIZABLE_FIELDS */
+template<typename X>
+auto payload_size(const X& data, int) -> decltype(size_t{data.serialized_size()})
+{
+    return data.serialized_size();
+}
+
+template<typename X>
+size_t payload_size(const X&, long)
+{
+    return 0;
+}
+
+template<typename X>
+size_t packet_bytes(const Packet<X>& dta)
+{
+    if (!dta.m_encoded_data.empty()) {
+        size_t bytes{0};
+        for (const auto& f : dta.m_encoded_data) {
+            bytes += f.size();
+        }
+        return bytes;
+    }
+    return payload_size(dta.m_data, 0);
+}
+
+template<typename X>
+size_t packet_bytes(const PacketBatch<X>& batch)
+{
+    size_t bytes{0};
+    for (const auto& dta : batch) {
+        bytes += packet_bytes(dta);
+    }
+    return bytes;
+}
+
+// *********************************************************************
+// SUBMIT STATUS
+// *********************************************************************
+
+/* Result of a non-blocking submission (see BaseModule::try_submit) */
+enum class SubmitStatus {
+    ACCEPTED,     // the packet was taken (processed or queued)
+    WOULD_BLOCK,  // the sink is full, the packet is left to the caller
+    DROPPED       // the sink is full and sheds load, the packet was discarded
+};
+
+// *********************************************************************
+// BASE LINK TEMPLATE
+// *********************************************************************
+
+/* Forward declaration */
+template<typename T>
+class BaseModule;
+
+template<typename T>
+struct Link {
+    Link(std::shared_ptr<BaseModule<T>> module, bool do_debug)
+        : m_module{module}, m_debug{do_debug}, m_stats{std::make_shared<LinkStats>()} {};
+    std::shared_ptr<BaseModule<T>> m_module;
+    // debug links are not fused and are always reported
+    bool m_debug {false};
+    std::shared_ptr<LinkStats> m_stats;
+};
+
+#define FATAL(msg) std::cerr << msg << std::endl; assert(0);
+
+// *********************************************************************
+// PROPERTY MANAGEMENT HELPER MACROS AND FUNCTIONS
+// *********************************************************************
+template<typename M>
+bool set_field_value_from_string(M* field, std::string value)
+{
+    std::istringstream ss{value};
+    M tmp;
+    ss >> std::skipws >> std::boolalpha >> tmp;
+    if (!ss.fail()) {
+        *field = tmp;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+template<>
+bool set_field_value_from_string(bool* field, std::string value)
+{
+    if (value == "true") {
+        *field = true;
+    } else if (value == "false") {
+        *field = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+template<>
+bool set_field_value_from_string(std::string* field, std::string value)
+{
+    *field = value;
+    return true;
+}
+
+#define return_readable_property(rname, prop) \
+if (rname == #prop) { std::stringstream tmp; tmp << std::boolalpha << prop; return tmp.str(); }
+
+#define return_writable_property(rname, rvalue, prop) \
+if (rname == #prop) { \
+    if (poma::set_field_value_from_string(&(prop), rvalue)) set_reconfigure_module(); \
+    std::stringstream outss; \
+    outss << prop; \
+    return outss.str(); \
+}
+
+#define RETURN_READABLE_PROPERTY(r, data, field) return_readable_property(name, field);
+#define RETURN_WRITABLE_PROPERTY(r, data, field) return_writable_property(name, value, field);
+#define GET_QUOTED_PROPERTY(field) #field
+#define ENUMERATE_PROPERTY(r, data, i, field) BOOST_PP_COMMA_IF(i) GET_QUOTED_PROPERTY(field)
+
+
+#define DECLARE_READABLE_PROPERTIES(props) \
+    std::string on_read_property(const std::string& name) const override { \
+        BOOST_PP_SEQ_FOR_EACH(RETURN_READABLE_PROPERTY,, props) \
+        throw std::runtime_error{std::string{"invalid readable property "} + name}; \
+    }
+
+#define DECLARE_WRITABLE_PROPERTIES(props) \
+    std::string on_write_property(const std::string& name, const std::string& value) override { \
+        synchronized_scope(); \
+        BOOST_PP_SEQ_FOR_EACH(RETURN_WRITABLE_PROPERTY,, props) \
+        throw std::runtime_error{std::string{"invalid writable property "} + name}; \
+    }
+
+#define DECLARE_ENUMERATABLE_PROPERTIES(props) \
+    std::string on_enumerate_properties() const override { \
+        std::vector<std::string> properties { BOOST_PP_SEQ_FOR_EACH_I(ENUMERATE_PROPERTY, , props) }; \
+        return boost::algorithm::join(properties, ","); \
+    }
+
+#define DECLARE_PROPERTIES(props) \
+    DECLARE_READABLE_PROPERTIES(props) \
+    DECLARE_WRITABLE_PROPERTIES(props) \
+    DECLARE_ENUMERATABLE_PROPERTIES(props)
+
+// *********************************************************************
+// BASE MODULE TEMPLATE (Cloneable when subclassed)
+// *********************************************************************
+template<typename T>
+class BaseModule {
+public:
+    BaseModule(const std::string& mid)
+        : m_module_mutex{new std::mutex},
+    m_module_id {mid}
+    {
+        sm_instances.push_back(this);
+    }
+
+    BaseModule(const BaseModule& o)
+        : m_module_mutex{new std::mutex},
+    m_module_id{o.m_module_id},
+    m_sinks{o.m_sinks},
+    m_channels{o.m_channels} {}
+
+    BaseModule& operator=(const BaseModule& o)
+    {
+        if (m_module_mutex == nullptr) {
+            delete m_module_mutex;
+        }
+        m_module_mutex = new std::mutex;
+        m_sinks = o.m_sinks;
+        m_channels = o.m_channels;
+        m_fused_link = nullptr;
+        m_module_id = o.m_module_id;
+    }
+
+    virtual ~BaseModule()
+    {
+        sm_instances.erase(std::remove(sm_instances.begin(), sm_instances.end(), this), sm_instances.end());
+    }
+
+    /* Module locking methods */
+    void lock_module()
+    {
+        m_module_mutex->lock();
+    }
+
+    void unlock_module()
+    {
+        m_module_mutex->unlock();
+    }
+
+    bool check_reconfigure_module()
+    {
+        if (m_do_reconfigure_module) {
+            m_do_reconfigure_module = false;
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    void set_reconfigure_module()
+    {
+        m_do_reconfigure_module = true;
+    }
+
+    void clear_reconfigure_module()
+    {
+        m_do_reconfigure_module = false;
+    }
+
+#define synchronized_scope() std::unique_lock<std::mutex> ___lock(*m_module_mutex);
+
+    /* Global module functions */
+    static void initialize_all()
+    {
+        for (auto i : sm_instances) {
+            try {
+                i->initialize();
+            } catch (const boost::exception& e) {
+                std::cerr << "DEBUG: Failed to initialize module " << typeid(*i).name() << ":" << boost::diagnostic_information(e) << std::endl;
+                throw;
+            } catch (std::exception e) {
+                std::cerr << "DEBUG: Failed to initialize module " << typeid(*i).name() << ":" << e.what() << std::endl;
+                throw;
+            } catch (...) {
+                std::cerr << "DEBUG: Failed to initialize module: " << typeid(*i).name() << std::endl;
+                throw;
+            }
+        }
+    }
+
+    static void display_help_all()
+    {
+        // Only the help of not yet initialized modules will be "shown"
+        boost::program_options::options_description desc;
+        for (auto i : sm_instances) {
+            std::string cname {i->getType()};
+            if (sm_instances_classes.count(cname) == 0) {
+                sm_instances_classes.insert(cname);
+                i->setup_cli(desc);
+            }
+        }
+        std::cerr << desc << std::endl;
+    }
+
+    static boost::program_options::variables_map setup_cli_all(int argc, char* argv[])
+    {
+        boost::program_options::options_description desc;
+        for (auto i : sm_instances) {
+            std::string cname {i->getType()};
+            if (sm_instances_classes.count(cname) == 0) {
+                sm_instances_classes.insert(cname);
+                i->setup_cli(desc);
+            }
+        }
+        boost::program_options::variables_map vm;
+        try {
+            boost::program_options::store(boost::program_options::command_line_parser(argc, argv).options(desc).allow_unregistered().run(), vm);
+            boost::program_options::notify(vm);
+        } catch (const boost::exception& e) {
+            std::cerr << "DEBUG: Failed to setup command line arguments: " << boost::diagnostic_information(e) << std::endl;
+            throw;
+        } catch (std::exception &e) {
+            std::cerr << "DEBUG: Failed to setup command line arguments: " << e.what() << std::endl;
+            throw;
+        }
+        for (auto i : sm_instances) {
+            i->process_cli(vm);
+        }
+        return vm;
+    }
+
+    /* Data processing methods */
+
+    /* Channels are given as a ChannelHandle (resolved once) or by name.
+       A module with a single channel sends everything to it */
+
+    /* The packet is shared by all the sinks of the channel */
+    void submit_data(Packet<T>& dta, const ChannelHandle& channel = ChannelHandle::default_channel())
+    {
+        if (Tracer::enabled()) {
+            decide_trace(dta);
+        }
+        if (m_fused_link != nullptr) {
+            deliver_fused(*m_fused_link, dta, channel.name());
+            return;
+        }
+        share_with(route(channel.id()), dta, channel.name());
+    }
+
+    void submit_data(Packet<T>& dta, const std::string& channel)
+    {
+        if (Tracer::enabled()) {
+            decide_trace(dta);
+        }
+        if (m_fused_link != nullptr) {
+            deliver_fused(*m_fused_link, dta, channel);
+            return;
+        }
+        share_with(route(channel), dta, channel);
+    }
+
+    /* Ownership of the packet is transferred: it is copied only when the
+       channel fans out, the last sink takes it by move */
+    void submit_data(Packet<T>&& dta, const ChannelHandle& channel = ChannelHandle::default_channel())
+    {
+        if (Tracer::enabled()) {
+            decide_trace(dta);
+        }
+        if (m_fused_link != nullptr) {
+            deliver_fused(*m_fused_link, std::move(dta), channel.name());
+            return;
+        }
+        hand_over(route(channel.id()), std::move(dta), channel.name());
+    }
+
+    void submit_data(Packet<T>&& dta, const std::string& channel)
+    {
+        if (Tracer::enabled()) {
+            decide_trace(dta);
+        }
+        if (m_fused_link != nullptr) {
+            deliver_fused(*m_fused_link, std::move(dta), channel);
+            return;
+        }
+        hand_over(route(channel), std::move(dta), channel);
+    }
+
+    /* Ownership of the whole batch is transferred, sinks are looked up once */
+    void submit_batch(PacketBatch<T>&& batch, const ChannelHandle& channel = ChannelHandle::default_channel())
+    {
+        if (Tracer::enabled()) {
+            decide_trace(batch);
+        }
+        if (m_fused_link != nullptr) {
+            if (!batch.empty()) {
+                deliver_fused_batch(*m_fused_link, std::move(batch), channel.name());
+            }
+            return;
+        }
+        hand_over_batch(route(channel.id()), std::move(batch), channel.name());
+    }
+
+    void submit_batch(PacketBatch<T>&& batch, const std::string& channel)
+    {
+        if (Tracer::enabled()) {
+            decide_trace(batch);
+        }
+        if (m_fused_link != nullptr) {
+            if (!batch.empty()) {
+                deliver_fused_batch(*m_fused_link, std::move(batch), channel);
+            }
+            return;
+        }
+        hand_over_batch(route(channel), std::move(batch), channel);
+    }
+
+    /* Non-blocking submission: sinks that own a queue (ForkBaseModule,
+       Buffer) refuse the packet instead of waiting when their queue is
+       full, other sinks process it as submit_data does. The packet is
+       left to the caller on WOULD_BLOCK, so that it can be retried later,
+       discarded or submitted on another channel. On a channel with
+       several sinks the packet is delivered to all of them or to none:
+       WOULD_BLOCK is returned when a sink is full before any copy is
+       delivered, a sink that fills up once the copies have started to go
+       out is waited for */
+    SubmitStatus try_submit(Packet<T>&& dta, const ChannelHandle& channel = ChannelHandle::default_channel())
+    {
+        if (Tracer::enabled()) {
+            decide_trace(dta);
+        }
+        if (m_fused_link != nullptr) {
+            return offer_to(*m_fused_link, dta, channel.name());
+        }
+        return offer(route(channel.id()), dta, channel.name());
+    }
+
+    SubmitStatus try_submit(Packet<T>&& dta, const std::string& channel)
+    {
+        if (Tracer::enabled()) {
+            decide_trace(dta);
+        }
+        if (m_fused_link != nullptr) {
+            return offer_to(*m_fused_link, dta, channel);
+        }
+        return offer(route(channel), dta, channel);
+    }
+
+    /* Gives back a packet that is not forwarded */
+    void discard_data(Packet<T>&& dta)
+    {
+        PacketPool<T>::release(std::move(dta));
+    }
+
+    /* Dynamic property management methods */
+    std::string read_property(const std::string& name, const std::string& channel = "default") const
+    {
+        std::stringstream ss;
+        auto it{find_sinks(channel)};
+        if (it != nullptr) {
+            bool first{true};
+            for(auto s : *it) {
+                try {
+                    if (!first) ss << ",";
+                    std::string val{s.m_module->on_read_property(name)};
+                    if (val != "") {
+                        first = false;
+                        ss << val;
+                    }
+                } catch (const boost::exception& e) {
+                    std::cerr << "DEBUG: Exception " << boost::diagnostic_information(e) << std::endl;
+                    throw;
+                } catch(const std::exception& e) {
+                    std::cerr << "DEBUG: Exception " << e.what() << " while reading property " << name << " on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
+                    throw;
+                } catch(...) {
+                    std::cerr << "DEBUG: Unknown exception while reading property " << name << " on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
+                    throw;
+                }
+            }
+        }
+        return ss.str();
+    }
+
+    std::string write_property(const std::string& name, const std::string& value, const std::string& channel = "default")
+    {
+        std::stringstream ss;
+        bool first{true};
+        auto it{find_sinks(channel)};
+        if (it != nullptr) {
+            for(auto s : *it) {
+                try {
+                    if (!first) ss << ",";
+                    std::string val{s.m_module->on_write_property(name, value)};
+                    if (val != "") {
+                        first = false;
+                        ss << val;
+                    }
+                } catch (const boost::exception& e) {
+                    std::cerr << "DEBUG: Exception " << boost::diagnostic_information(e) << " while writing value " << value << " to property " << name << " on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
+                    throw;
+                } catch(const std::exception& e) {
+                    std::cerr << "DEBUG: Exception " << e.what() << " while writing value " << value << " to property " << name << " on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
+                    throw;
+                } catch(...) {
+                    std::cerr << "DEBUG: Unknown exception while writing value " << value << " to property " << name << " on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
+                    throw;
+                }
+            }
+        }
+        return ss.str();
+    }
+
+    std::string enumerate_properties(const std::string& channel = "default") const
+    {
+        std::stringstream ss;
+        bool first{true};
+        auto it{find_sinks(channel)};
+        if (it != nullptr) {
+            for(auto s : *it) {
+                try {
+                    if (!first) ss << ",";
+                    std::string data{s.m_module->on_enumerate_properties()};
+                    if (data != "") {
+                        ss << data;
+                        first = false;
+                    }
+                } catch (const boost::exception& e) {
+                    std::cerr << "DEBUG: Exception " << boost::diagnostic_information(e) << " while enumerating properties on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
+                    throw;
+                } catch(const std::exception& e) {
+                    std::cerr << "DEBUG: Exception " << e.what() << " while enumerating properties on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
+                    throw;
+                } catch(...) {
+                    std::cerr << "DEBUG: Unknown exception while enumerating properties on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
+                    throw;
+                }
+            }
+        }
+        return ss.str();
+    }
+
+    virtual void flush() {}
+    virtual void finalize() {}
+    /* Stops the threads of the module, once the pipeline has been flushed:
+       no packet is submitted to the module afterwards */
+    virtual void shutdown() {}
+
+    /* Called once when the pipeline has been flushed, before finalize:
+       modules that clone a template (ParExecutor) reduce the state of the
+       clones into the modules of the template */
+    virtual void combine() {}
+
+    /* Adds the state of a clone of this module, returns false when the
+       module cannot merge (see Module::merge_clone) */
+    virtual bool merge_clone(const BaseModule<T>& clone)
+    {
+        return false;
+    }
+
+    /* Merges, module by module, a pipeline cloned from this one */
+    void merge_pipeline(const BaseModule<T>& clone)
+    {
+        merge_clone(clone);
+        for (const auto& c : get_channels()) {
+            if ((c.length() >= 1) && (c.at(0) == '_')) {
+                // not cloned (see Module::clone)
+                continue;
+            }
+            const std::vector<Link<T> >* mine{find_sinks(c)};
+            const std::vector<Link<T> >* theirs{clone.find_sinks(c)};
+            if (theirs == nullptr || theirs->size() != mine->size()) {
+                continue;
+            }
+            for (size_t i{0}; i < mine->size(); ++i) {
+                (*mine)[i].m_module->merge_pipeline(*(*theirs)[i].m_module);
+            }
+        }
+    }
+
+    /* Pipeline construction methods */
+    std::vector<std::string> get_channels() const
+    {
+        std::vector<std::string> keys;
+        for(auto id : m_channels) {
+            keys.push_back(ChannelRegistry::instance().name(id));
+        }
+        std::sort(keys.begin(), keys.end());
+        return keys;
+    }
+
+    void clear_channels()
+    {
+        m_sinks.clear();
+        m_channels.clear();
+        m_fused_link = nullptr;
+    }
+
+    /* Sinks of a channel (the channel is created if needed) */
+    std::vector<Link<T> >& sinks(const ChannelHandle& channel)
+    {
+        // The links may be changed by the caller
+        if (m_fused_link != nullptr) {
+            m_fused_link = nullptr;
+        }
+        if (m_sinks.size() <= channel.id()) {
+            m_sinks.resize(channel.id() + 1);
+        }
+        if (std::find(m_channels.begin(), m_channels.end(), channel.id()) == m_channels.end()) {
+            m_channels.push_back(channel.id());
+        }
+        return m_sinks[channel.id()];
+    }
+
+    std::vector<Link<T> >& sinks(const std::string& channel)
+    {
+        return sinks(ChannelHandle{channel});
+    }
+
+    BaseModule<T>& operator >> (std::shared_ptr<BaseModule<T> > sink)
+    {
+        return connect_sink(sink);
+    }
+
+    std::shared_ptr<BaseModule<T> > connect_sink(std::shared_ptr<BaseModule<T> > m, const std::string& channel = "default", bool do_debug = false)
+    {
+        Link<T> link{m, do_debug};
+        std::cerr << "Connecting " << m_module_id << " to " << m->m_module_id << " on channel " << channel << std::endl;
+        sinks(channel).push_back(link);
+        return m;
+    }
+
+    /* Pipeline fusion: a module whose only channel has a single link
+       (without debug) calls its sink directly, skipping the channel
+       lookup and the exception report of each hop. Changing the links
+       of the module reverts to normal dispatch */
+    bool fuse()
+    {
+        m_fused_link = nullptr;
+        if (m_channels.size() == 1) {
+            auto& only = m_sinks[m_channels[0]];
+            if (only.size() == 1 && !only[0].m_debug) {
+                m_fused_link = &only[0];
+            }
+        }
+        return m_fused_link != nullptr;
+    }
+
+    void unfuse()
+    {
+        m_fused_link = nullptr;
+    }
+
+    BaseModule<T>* fused_sink() const
+    {
+        return m_fused_link == nullptr ? nullptr : m_fused_link->m_module.get();
     }
 
-    /* Data processing method */
-    void submit_data(Packet<T>& dta, const std::string& channel = "default")
+    /* Modules connected to a channel, without changing the links */
+    std::vector<BaseModule<T>*> sinks_of(const std::string& channel) const
+    {
+        std::vector<BaseModule<T>*> result;
+        const std::vector<Link<T> >* links{find_sinks(channel)};
+        if (links != nullptr) {
+            for (const auto& l : *links) {
+                result.push_back(l.m_module.get());
+            }
+        }
+        return result;
+    }
+
+    /* Flushes this module and the modules after it, each one once the
+       modules before it are idle. The links back to a parallel executor
+       (channels starting with _) are not followed, modules left on a
+       cycle come last */
+    void flush_pipeline()
+    {
+        std::vector<BaseModule<T>*> modules{this};
+        std::set<BaseModule<T>*> seen{this};
+        std::map<BaseModule<T>*, unsigned int> incoming;
+        for (size_t i{0}; i < modules.size(); ++i) {
+            for (const auto& c : modules[i]->get_channels()) {
+                if (c.empty() || c.at(0) == '_') continue;
+                for (auto s : modules[i]->sinks_of(c)) {
+                    incoming[s]++;
+                    if (seen.insert(s).second) {
+                        modules.push_back(s);
+                    }
+                }
+            }
+        }
+        std::deque<BaseModule<T>*> ready{this};
+        std::set<BaseModule<T>*> done;
+        while (!ready.empty()) {
+            BaseModule<T>* m{ready.front()};
+            ready.pop_front();
+            m->flush();
+            done.insert(m);
+            for (const auto& c : m->get_channels()) {
+                if (c.empty() || c.at(0) == '_') continue;
+                for (auto s : m->sinks_of(c)) {
+                    if (--incoming[s] == 0 && done.count(s) == 0) {
+                        ready.push_back(s);
+                    }
+                }
+            }
+        }
+        for (auto m : modules) {
+            if (done.count(m) == 0) {
+                m->flush();
+            }
+        }
+    }
+
+    /* Counters of the links of all the modules, by source, destination
+       and channel: the links of clones (for example the workers of a
+       parallel executor) share the counters of the template links (see
+       Module::clone). Idle links are only reported if all is set or if
+       they are debug links */
+    static boost::property_tree::ptree link_stats_all(bool all = false)
+    {
+        std::map<std::tuple<std::string, std::string, std::string>, LinkStats::Snapshot> links;
+        for (auto i : sm_instances) {
+            for (auto id : i->m_channels) {
+                for (const auto& s : i->m_sinks[id]) {
+                    LinkStats::Snapshot snapshot{s.m_stats->snapshot()};
+                    if (snapshot.m_packets == 0 && !s.m_debug && !all) {
+                        continue;
+                    }
+                    links[std::make_tuple(i->m_module_id, s.m_module->m_module_id, ChannelRegistry::instance().name(id))].add(snapshot);
+                }
+            }
+        }
+        boost::property_tree::ptree report;
+        for (const auto& l : links) {
+            const LinkStats::Snapshot& snapshot = l.second;
+            boost::property_tree::ptree link;
+            link.put("from", std::get<0>(l.first));
+            link.put("to", std::get<1>(l.first));
+            link.put("channel", std::get<2>(l.first));
+            link.put("packets", snapshot.m_packets);
+            link.put("batches", snapshot.m_batches);
+            link.put("bytes", snapshot.m_bytes);
+            link.put("samples", snapshot.m_samples);
+            link.put("mean_ns", snapshot.mean_ns());
+            link.put("p50_ns", snapshot.percentile_ns(0.5));
+            link.put("p99_ns", snapshot.percentile_ns(0.99));
+            boost::property_tree::ptree histogram;
+            for (unsigned int b{0}; b < LinkStats::BUCKETS; b++) {
+                if (snapshot.m_histogram[b] > 0) {
+                    histogram.put(std::to_string(uint64_t{1} << b), snapshot.m_histogram[b]);
+                }
+            }
+            link.put_child("histogram", histogram);
+            report.push_back(std::make_pair("", link));
+        }
+        return report;
+    }
+
+    /* Pipeline duplication methods */
+
+    /* Create a clone of this object */
+    virtual std::shared_ptr<BaseModule<T> > clone() const
+    {
+        throw std::runtime_error (std::string{"Clone not correctly implemented for this module: "} + m_module_id);
+        return nullptr;
+    };
+
+    std::string get_module_id() const
+    {
+        return m_module_id;
+    }
+
+    /* Methods to be overridden */
+    virtual void construct(std::vector<std::string> parameters) {};
+    virtual void setup_cli(boost::program_options::options_description& desc) const {};
+    virtual void process_cli(boost::program_options::variables_map& vm) {};
+    virtual void initialize() {};
+    virtual void start_processing()
+    {
+        throw std::runtime_error("Processing method must be overridden");
+    };
+    virtual void on_incoming_data(Packet<T>& dta, const std::string& channel)
+    {
+        submit_data(dta, channel);
+    };
+    /* Called when the module receives ownership of the packet: modules that
+       forward or queue packets should override it and move the packet along */
+    virtual void on_incoming_data(Packet<T>&& dta, const std::string& channel)
+    {
+        on_incoming_data(dta, channel);
+    };
+    /* Called by try_submit: modules that queue packets should override it
+       and return WOULD_BLOCK, leaving the packet untouched, when they
+       cannot take it without waiting. By default the packet is processed */
+    virtual SubmitStatus on_offer(Packet<T>&& dta, const std::string& channel)
+    {
+        on_incoming_data(std::move(dta), channel);
+        return SubmitStatus::ACCEPTED;
+    }
+    /* Whether on_offer would currently refuse the packet: modules that
+       override on_offer should override it as well (see offer) */
+    virtual bool would_block(const Packet<T>& dta, const std::string& channel)
+    {
+        return false;
+    }
+    /* Modules that can process a batch at once should override this method,
+       by default packets are handed one by one to on_incoming_data */
+    virtual void on_incoming_batch(PacketBatch<T>&& batch, const std::string& channel)
+    {
+        for (auto& dta : batch) {
+            on_incoming_data(std::move(dta), channel);
+        }
+        batch.clear();
+    };
+    virtual std::string on_read_property(const std::string& name) const
+    {
+        return "";
+    };
+    // Note: each module is responsible for making the following call thread safe
+    virtual std::string on_write_property(const std::string& name, const std::string& value)
+    {
+        return "";
+    };
+    virtual std::string on_enumerate_properties() const
+    {
+        return "";
+    };
+
+    virtual std::string getType() const
+    {
+        return "Generic BaseModule";
+    };
+
+protected:
+    /* Sinks a packet submitted on channel goes to (nullptr if none) */
+    std::vector<Link<T> >* route(uint32_t channel)
+    {
+        if (m_channels.size() == 1) {
+            return &m_sinks[m_channels[0]];
+        }
+        if (channel < m_sinks.size() && !m_sinks[channel].empty()) {
+            return &m_sinks[channel];
+        }
+        return nullptr;
+    }
+
+    std::vector<Link<T> >* route(const std::string& channel)
+    {
+        if (m_channels.size() == 1) {
+            return &m_sinks[m_channels[0]];
+        }
+        // names of channels that were never connected have no sinks
+        uint32_t id;
+        if (!ChannelRegistry::instance().find(channel, id)) {
+            return nullptr;
+        }
+        return route(id);
+    }
+
+    const std::vector<Link<T> >* find_sinks(const std::string& channel) const
+    {
+        uint32_t id;
+        if (!ChannelRegistry::instance().find(channel, id)) {
+            return nullptr;
+        }
+        if (std::find(m_channels.begin(), m_channels.end(), id) == m_channels.end()) {
+            return nullptr;
+        }
+        return &m_sinks[id];
+    }
+
+    void share_with(std::vector<Link<T> >* sinks, Packet<T>& dta, const std::string& channel)
+    {
+        if (sinks != nullptr) {
+            for(auto& s : *sinks) {
+                deliver(s, dta, channel);
+            }
+        }
+    }
+
+    void hand_over(std::vector<Link<T> >* sinks, Packet<T>&& dta, const std::string& channel)
+    {
+        if (sinks != nullptr && !sinks->empty()) {
+            for (size_t i{0}; i + 1 < sinks->size(); ++i) {
+                Packet<T> copy{PacketPool<T>::acquire()};
+                copy = dta;
+                deliver((*sinks)[i], std::move(copy), channel);
+            }
+            deliver(sinks->back(), std::move(dta), channel);
+        } else {
+            // End of the pipeline
+            discard_data(std::move(dta));
+        }
+    }
+
+    void hand_over_batch(std::vector<Link<T> >* sinks, PacketBatch<T>&& batch, const std::string& channel)
+    {
+        if (batch.empty()) {
+            return;
+        }
+        if (sinks != nullptr && !sinks->empty()) {
+            for (size_t i{0}; i + 1 < sinks->size(); ++i) {
+                PacketBatch<T> copy{batch};
+                deliver_batch((*sinks)[i], std::move(copy), channel);
+            }
+            deliver_batch(sinks->back(), std::move(batch), channel);
+        } else {
+            for (auto& dta : batch) {
+                discard_data(std::move(dta));
+            }
+            batch.clear();
+        }
+    }
+
+    SubmitStatus offer(std::vector<Link<T> >* sinks, Packet<T>& dta, const std::string& channel)
+    {
+        if (sinks == nullptr || sinks->empty()) {
+            // End of the pipeline
+            discard_data(std::move(dta));
+            return SubmitStatus::ACCEPTED;
+        }
+        if (sinks->size() == 1) {
+            return offer_to(sinks->back(), dta, channel);
+        }
+        // All or nothing: a caller that retries must not duplicate the
+        // copies already delivered
+        for (auto& s : *sinks) {
+            if (s.m_module->would_block(dta, channel)) {
+                return SubmitStatus::WOULD_BLOCK;
+            }
+        }
+        SubmitStatus result{SubmitStatus::ACCEPTED};
+        for (size_t i{0}; i + 1 < sinks->size(); ++i) {
+            Packet<T> copy{PacketPool<T>::acquire()};
+            copy = dta;
+            if (offer_or_deliver((*sinks)[i], copy, channel) == SubmitStatus::DROPPED) {
+                result = SubmitStatus::DROPPED;
+            }
+        }
+        if (offer_or_deliver(sinks->back(), dta, channel) == SubmitStatus::DROPPED) {
+            result = SubmitStatus::DROPPED;
+        }
+        return result;
+    }
+
+    /* A sink that filled up since it was checked is waited for */
+    SubmitStatus offer_or_deliver(Link<T>& s, Packet<T>& dta, const std::string& channel)
+    {
+        SubmitStatus status{offer_to(s, dta, channel)};
+        if (status == SubmitStatus::WOULD_BLOCK) {
+            deliver(s, std::move(dta), channel);
+            return SubmitStatus::ACCEPTED;
+        }
+        return status;
+    }
+
+    SubmitStatus offer_to(Link<T>& s, Packet<T>& dta, const std::string& channel)
+    {
+        size_t bytes{packet_bytes(dta)};
+        Traces traces{dta};
+        SubmitStatus status{SubmitStatus::ACCEPTED};
+        deliver_to(s, [&] {
+            timed_call(s, traces, [&] { status = s.m_module->on_offer(std::move(dta), channel); });
+        });
+        if (status != SubmitStatus::WOULD_BLOCK) {
+            s.m_stats->count(1, bytes, false);
+        }
+        return status;
+    }
+
+    template<typename P>
+    void deliver(Link<T>& s, P&& dta, const std::string& channel)
+    {
+        s.m_stats->count(1, packet_bytes(dta), false);
+        Traces traces{dta};
+        deliver_to(s, [&] {
+            timed_call(s, traces, [&] { s.m_module->on_incoming_data(std::forward<P>(dta), channel); });
+        });
+    }
+
+    void deliver_batch(Link<T>& s, PacketBatch<T>&& batch, const std::string& channel)
+    {
+        s.m_stats->count(batch.size(), packet_bytes(batch), true);
+        Traces traces{batch};
+        deliver_to(s, [&] {
+            timed_call(s, traces, [&] { s.m_module->on_incoming_batch(std::move(batch), channel); });
+        });
+    }
+
+    /* Fused links skip the exception report */
+    template<typename P>
+    void deliver_fused(Link<T>& s, P&& dta, const std::string& channel)
+    {
+        s.m_stats->count(1, packet_bytes(dta), false);
+        Traces traces{dta};
+        timed_call(s, traces, [&] { s.m_module->on_incoming_data(std::forward<P>(dta), channel); });
+    }
+
+    void deliver_fused_batch(Link<T>& s, PacketBatch<T>&& batch, const std::string& channel)
+    {
+        s.m_stats->count(batch.size(), packet_bytes(batch), true);
+        Traces traces{batch};
+        timed_call(s, traces, [&] { s.m_module->on_incoming_batch(std::move(batch), channel); });
+    }
+
+    template<typename F>
+    void deliver_to(Link<T>& s, F call)
+    {
+        try {
+            call();
+        } catch (const boost::exception& e) {
+            std::cerr << "DEBUG: Exception " << boost::diagnostic_information(e) << std::endl;
+            throw;
+        } catch(const std::exception& e) {
+            std::cerr << "DEBUG: Exception " << e.what() << " while processing data in module " << s.m_module->m_module_id << std::endl;
+            throw;
+        } catch(...) {
+            std::cerr << "DEBUG: Exception ??? while processing data in module " << s.m_module->m_module_id << std::endl;
+            throw;
+        }
+    }
+
+    /* Traced packets of a delivery, taken before the packets are moved */
+    struct Traces {
+        Traces(const Packet<T>& dta) : m_first{traced(dta) ? dta.m_trace : 0} {}
+
+        Traces(const PacketBatch<T>& batch)
+        {
+            for (const auto& dta : batch) {
+                if (traced(dta)) {
+                    if (m_first == 0) {
+                        m_first = dta.m_trace;
+                    } else {
+                        m_others.push_back(dta.m_trace);
+                    }
+                }
+            }
+        }
+
+        uint64_t m_first{0};
+        std::vector<uint64_t> m_others;
+    };
+
+    /* Deliveries of traced packets are recorded as spans of the sink;
+       only a sample of the other calls is timed, to keep the clock off
+       the path of most packets */
+    template<typename F>
+    void timed_call(Link<T>& s, const Traces& traces, F&& call)
+    {
+        if (traces.m_first != 0) {
+            uint64_t start{Tracer::now_ns()};
+            call();
+            uint64_t end{Tracer::now_ns()};
+            s.m_stats->latency(end - start);
+            Tracer::instance().span(traces.m_first, s.m_module->m_module_id, "module", start, end);
+            for (auto trace : traces.m_others) {
+                Tracer::instance().span(trace, s.m_module->m_module_id, "module", start, end);
+            }
+        } else if (LinkStats::sample()) {
+            auto before = std::chrono::steady_clock::now();
+            call();
+            auto after = std::chrono::steady_clock::now();
+            s.m_stats->latency(std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count());
+        } else {
+            call();
+        }
+    }
+
+    void decide_trace(Packet<T>& dta)
+    {
+        trace_of(dta);
+    }
+
+    void decide_trace(PacketBatch<T>& batch)
+    {
+        for (auto& dta : batch) {
+            trace_of(dta);
+        }
+    }
+
+    static std::vector<BaseModule<T>*> sm_instances;
+    static std::set<std::string> sm_instances_classes;
+
+    std::mutex* m_module_mutex{nullptr};
+    std::string m_module_id;
+
+    // sinks indexed by channel identifier, m_channels lists the channels in use
+    std::vector<std::vector<Link<T> > > m_sinks;
+    std::vector<uint32_t> m_channels;
+    // only link of the module when it is fused
+    Link<T>* m_fused_link{nullptr};
+
+    bool m_do_reconfigure_module{true};
+};
+
+/* Static fields initialization */
+template<typename T>
+std::vector<BaseModule<T>*> BaseModule<T>::sm_instances;
+
+template<typename T>
+std::set<std::string> BaseModule<T>::sm_instances_classes;
+
+/* Cloneable module */
+template <typename D, typename T>
+class Module : public BaseModule<T> {
+public:
+    Module(const std::string& mid) : BaseModule<T>(mid) {}
+    
+    std::shared_ptr<BaseModule<T> > clone() const override
+    {
+        auto ptr = new D {static_cast<D const&>(*this)};
+        if (ptr == nullptr) {
+            throw std::runtime_error (std::string{"Failed to allocate memory for cloned object in module "} + this->get_module_id());
+            return nullptr;
+        } else {
+            auto head = std::shared_ptr<BaseModule<T> > {ptr};
+            head->clear_channels();
+            for (const auto& c : BaseModule<T>::get_channels()) {
+                if ((c.length() >= 1) && (c.at(0) == '_')) { // channel starting with _
+                    for (const auto& s : *BaseModule<T>::find_sinks(c)) {
+                        head->connect_sink(s.m_module, c, s.m_debug);
+                        head->sinks(c).back().m_stats = s.m_stats;
+                    }
+                    continue;
+                }
+                for (const auto& s : *BaseModule<T>::find_sinks(c)) {
+                    head->connect_sink(s.m_module->clone(), c, s.m_debug);
+                    // the clones count into the stats of the template link
+                    head->sinks(c).back().m_stats = s.m_stats;
+                }
+            }
+            if (BaseModule<T>::fused_sink() != nullptr) {
+                head->fuse();
+            }
+            return head;
+        }
+    }
+
+    std::string getType() const override
+    {
+        return typeid(D).name();
+    }
+
+    /* Modules that keep partial results (counters, histograms, sketches)
+       can define void merge_from(const D& o), which adds the state of o
+       to their own: the clones of a parallel template are then reduced
+       into a single result before finalize */
+    bool merge_clone(const BaseModule<T>& clone) override
+    {
+        const D* other{dynamic_cast<const D*>(&clone)};
+        return other != nullptr && merge_if_supported(*other, 0);
+    }
+
+private:
+    template<typename X = D>
+    auto merge_if_supported(const X& other, int) -> decltype(std::declval<X&>().merge_from(other), bool())
+    {
+        static_cast<X*>(this)->merge_from(other);
+        return true;
+    }
+
+    bool merge_if_supported(const D&, long)
+    {
+        return false;
+    }
+};
+
+// *********************************************************************
+// PARALLEL PROCESSOR MODULE TEMPLATE
+// *********************************************************************
+template<typename J>
+class ParallelProcessorBaseModule : public BaseModule<J> {
+public:
+    ParallelProcessorBaseModule(const std::string& mid) : BaseModule<J>(mid) {}
+
+    ~ParallelProcessorBaseModule()
     {
-		auto it{m_sinks.begin()};
-		if (m_sinks.size() != 1) {
-			it = m_sinks.find(channel);
-		}
-        if (it != m_sinks.end()) {
-            for(auto& s : it->second) {
-                try {
-                    if (s.m_debug) {
-                        auto before = std::chrono::high_resolution_clock::now();
-                        std::cerr << "DEBUG: submit (CALL) from " << m_module_id << " : " << typeid(*this).name()
-                                  << " to " << s.m_module->m_module_id << " : " << typeid(*(s.m_module)).name()
-                                  << " on " << channel << std::endl;
-                        s.m_module->on_incoming_data(dta, channel);
-                        auto after = std::chrono::high_resolution_clock::now();
-                        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(after - before).count();
-                        std::cerr << "DEBUG: submit (RETURN) from " << m_module_id << " : " << typeid(*this).name()
-                                  << " to " << s.m_module->m_module_id << " : " << typeid(*(s.m_module)).name()
-                                  << " on " << channel
-                                  << " duration " << elapsed << " ms" << std::endl;
-                    } else {
-                        s.m_module->on_incoming_data(dta, channel);
-                    }
-                } catch (const boost::exception& e) {
-                    std::cerr << "DEBUG: Exception " << boost::diagnostic_information(e) << std::endl;
-                    throw;
-                } catch(const std::exception& e) {
-                    std::cerr << "DEBUG: Exception " << e.what() << " while processing data in module " << s.m_module->m_module_id << std::endl;
-                    throw;
-                } catch(...) {
-                    std::cerr << "DEBUG: Exception ??? while processing data in module " << s.m_module->m_module_id << std::endl;
-                    throw;
-                }
+        for (auto& t : m_thread_pool) {
+            if (t.joinable()) {
+                t.join();
             }
         }
     }
 
+    std::shared_ptr<BaseModule<J> > clone() const
+    {
+        throw std::runtime_error ("Cannot clone Parallel Processor object");
+        return nullptr;
+    }
 
-    /* Dynamic property management methods */
-    std::string read_property(const std::string& name, const std::string& channel = "default") const
+    /* Returns once every source has returned from its start_processing:
+       an exception thrown by a source is rethrown when the others are done */
+    void start_processing()
     {
-        std::stringstream ss;
-        auto it{m_sinks.find(channel)};
-        if (it != m_sinks.end()) {
-            bool first{true};
-            for(auto s : it->second) {
-                try {
-                    if (!first) ss << ",";
-                    std::string val{s.m_module->on_read_property(name)};
-                    if (val != "") {
-                        first = false;
-                        ss << val;
-                    }
-                } catch (const boost::exception& e) {
-                    std::cerr << "DEBUG: Exception " << boost::diagnostic_information(e) << std::endl;
-                    throw;
-                } catch(const std::exception& e) {
-                    std::cerr << "DEBUG: Exception " << e.what() << " while reading property " << name << " on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
-                    throw;
-                } catch(...) {
-                    std::cerr << "DEBUG: Unknown exception while reading property " << name << " on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
-                    throw;
-                }
+        std::vector<Link<J> > sources{this->sinks("default")};
+        std::vector<std::exception_ptr> errors(sources.size());
+        m_finished = 0;
+        for (size_t i {0}; i < sources.size(); i++) {
+            m_thread_pool.push_back(std::thread([this, &sources, &errors, i] {processor_fn(sources[i].m_module, errors[i], sources.size());}));
+        }
+        for (auto& t : m_thread_pool) {
+            t.join();
+        }
+        m_thread_pool.clear();
+        for (const auto& e : errors) {
+            if (e) {
+                std::rethrow_exception(e);
             }
         }
-        return ss.str();
     }
 
-    std::string write_property(const std::string& name, const std::string& value, const std::string& channel = "default")
+    std::string getType()
     {
-        std::stringstream ss;
-        bool first{true};
-        auto it{m_sinks.find(channel)};
-        if (it != m_sinks.end()) {
-            for(auto s : it->second) {
-                try {
-                    if (!first) ss << ",";
-                    std::string val{s.m_module->on_write_property(name, value)};
-                    if (val != "") {
-                        first = false;
-                        ss << val;
-                    }
-                } catch (const boost::exception& e) {
-                    std::cerr << "DEBUG: Exception " << boost::diagnostic_information(e) << " while writing value " << value << " to property " << name << " on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
-                    throw;
-                } catch(const std::exception& e) {
-                    std::cerr << "DEBUG: Exception " << e.what() << " while writing value " << value << " to property " << name << " on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
-                    throw;
-                } catch(...) {
-                    std::cerr << "DEBUG: Unknown exception while writing value " << value << " to property " << name << " on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
-                    throw;
-                }
-            }
+        return typeid(ParallelProcessorBaseModule).name();
+    }
+
+protected:
+    void processor_fn(std::shared_ptr<BaseModule<J>> mod, std::exception_ptr& error, size_t sources)
+    {
+        Placement::instance().pin("source " + mod->get_module_id());
+        try {
+            mod->start_processing();
+        } catch (...) {
+            error = std::current_exception();
         }
-        return ss.str();
+        std::lock_guard<std::mutex> lock(m_finished_mutex);
+        m_finished++;
+        std::cerr << "Source " << mod->get_module_id() << (error ? " failed" : " finished") << " (" << m_finished << " of " << sources << ")" << std::endl;
     }
 
-    std::string enumerate_properties(const std::string& channel = "default") const
+private:
+    std::vector<std::thread> m_thread_pool;
+    std::mutex m_finished_mutex;
+    size_t m_finished {0};
+};
+
+// *********************************************************************
+// IN-FLIGHT COUNTER
+// *********************************************************************
+
+/* Number of packets held by a module (queued or being processed), for
+   flush to wait until it drops to zero. The thread which releases the
+   last packet only takes the mutex when somebody waits */
+class InFlightCounter {
+public:
+    void add(long n = 1)
     {
-        std::stringstream ss;
-        bool first{true};
-        auto it{m_sinks.find(channel)};
-        if (it != m_sinks.end()) {
-            for(auto s : it->second) {
-                try {
-                    if (!first) ss << ",";
-                    std::string data{s.m_module->on_enumerate_properties()};
-                    if (data != "") {
-                        ss << data;
-                        first = false;
-                    }
-                } catch (const boost::exception& e) {
-                    std::cerr << "DEBUG: Exception " << boost::diagnostic_information(e) << " while enumerating properties on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
-                    throw;
-                } catch(const std::exception& e) {
-                    std::cerr << "DEBUG: Exception " << e.what() << " while enumerating properties on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
-                    throw;
-                } catch(...) {
-                    std::cerr << "DEBUG: Unknown exception while enumerating properties on channel " << channel << " in module " << s.m_module->m_module_id << " (sent from " << m_module_id << ")" << std::endl;
-                    throw;
+        m_count.fetch_add(n);
+    }
+
+    void remove(long n = 1)
+    {
+        if (m_count.fetch_sub(n) == n && m_waiters.load() != 0) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_idle.notify_all();
+        }
+    }
+
+    long count() const
+    {
+        return m_count.load();
+    }
+
+    void wait_idle()
+    {
+        m_waiters++;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_idle.wait(lock, [&] { return m_count.load() == 0; });
+        }
+        m_waiters--;
+    }
+
+private:
+    std::atomic<long> m_count {0};
+    std::atomic<int> m_waiters {0};
+    std::mutex m_mutex;
+    std::condition_variable m_idle;
+};
+
+// *********************************************************************
+// BOUNDED BUFFER
+// *********************************************************************
+template<typename T, int size = 0>
+class BoundedBuffer {
+public:
+	void set_bound(unsigned int s) {
+		m_buffer_size = s;
+	}
+
+	/* Items are moved in and out: callers that keep their item must push a copy */
+	void push(T&& item) {
+		std::unique_lock<std::mutex> lock(m_queue_lock);
+		m_space_available.wait(lock, [&] { return m_buffer_size == 0 || m_queue.size() < m_buffer_size; });
+		m_queue.push(std::move(item));
+		m_data_available.notify_one();
+	}
+	
+	/* Returns false, leaving the item untouched, when the buffer is full */
+	bool try_push(T&& item) {
+		std::unique_lock<std::mutex> lock(m_queue_lock);
+		if (m_buffer_size != 0 && m_queue.size() >= m_buffer_size) {
+			return false;
+		}
+		m_queue.push(std::move(item));
+		m_data_available.notify_one();
+		return true;
+	}
+
+	/* The bound is checked once for the whole batch */
+	void push_batch(std::vector<T>&& items) {
+		std::unique_lock<std::mutex> lock(m_queue_lock);
+		m_space_available.wait(lock, [&] { return m_buffer_size == 0 || m_queue.size() < m_buffer_size; });
+		for (auto& item : items) {
+			m_queue.push(std::move(item));
+		}
+		items.clear();
+		m_data_available.notify_all();
+	}
+
+	/* Waits for data, then takes a 1/shares part of the queued items (at least one) */
+	void pop_batch(std::vector<T>& items, unsigned int shares = 1) {
+		std::unique_lock<std::mutex> lock(m_queue_lock);
+		m_data_available.wait(lock, [&]  { return m_queue.size() > 0; });
+		size_t n{(m_queue.size() + shares - 1) / shares};
+		for (size_t i{0}; i < n; ++i) {
+			items.push_back(std::move(m_queue.front()));
+			m_queue.pop();
+		}
+		m_space_available.notify_all();
+	}
+
+	T pop() {
+		std::unique_lock<std::mutex> lock(m_queue_lock);
+		m_data_available.wait(lock, [&]  { return m_queue.size() > 0; });
+		T item{std::move(m_queue.front())};
+		m_queue.pop();
+		m_space_available.notify_one();
+		return item;
+	}
+	
+	unsigned int count() {
+		std::unique_lock<std::mutex> lock(m_queue_lock);
+		return m_queue.size();
+	}
+
+
+private:
+	std::mutex m_queue_lock;
+	std::condition_variable m_data_available;
+	std::condition_variable m_space_available;
+	std::queue<T> m_queue;
+	unsigned int m_buffer_size{size};
+};
+
+// *********************************************************************
+// RING BUFFER
+// *********************************************************************
+
+// Minimum capacity of a RingBuffer (rounded up to a power of two)
+#ifndef POMA_RING_SIZE
+#define POMA_RING_SIZE 1024
+#endif
+
+// Attempts (each followed by a yield) before a RingBuffer operation blocks
+#ifndef POMA_RING_SPIN
+#define POMA_RING_SPIN 64
+#endif
+
+/* Blocking for lock-free structures: a waiter announces itself with
+   prepare_wait, checks its condition once more, then waits for the epoch
+   to change. notify only takes the mutex when somebody waits. The low 32
+   bits of the state count the waiters, the high 32 bits are the epoch */
+class EventCount {
+public:
+    uint64_t prepare_wait()
+    {
+        uint64_t state{m_state.fetch_add(1, std::memory_order_seq_cst)};
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return state >> 32;
+    }
+
+    void cancel_wait()
+    {
+        m_state.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void wait(uint64_t epoch)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while ((m_state.load(std::memory_order_seq_cst) >> 32) == epoch) {
+            m_cv.wait(lock);
+        }
+        m_state.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if ((m_state.load(std::memory_order_relaxed) & 0xffffffff) == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_state.fetch_add(uint64_t{1} << 32, std::memory_order_seq_cst);
+        m_cv.notify_all();
+    }
+
+private:
+    std::atomic<uint64_t> m_state{0};
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+};
+
+/* Lock-free bounded multi-producer multi-consumer queue with the same
+   interface as BoundedBuffer. Each slot carries a sequence number which
+   tells producers and consumers whose turn it is, so that they only
+   contend on the position they claim with a compare and swap. Operations
+   that cannot proceed retry POMA_RING_SPIN times, then block on an
+   EventCount: a push or a pop costs no system call while nobody waits.
+   The bound set with set_bound (0: none) is checked against the number of
+   queued items, the ring itself holds at least POMA_RING_SIZE items */
+template<typename T>
+class RingBuffer {
+public:
+    RingBuffer()
+    {
+        allocate(POMA_RING_SIZE);
+    }
+
+    ~RingBuffer()
+    {
+        while (try_take([](T&&, size_t) {})) {
+        }
+    }
+
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator=(const RingBuffer&) = delete;
+
+    /* Must be called before the buffer is used */
+    void set_bound(unsigned int s)
+    {
+        m_bound = s;
+        if (s > m_mask + 1) {
+            allocate(s);
+        }
+    }
+
+    void push(T&& item)
+    {
+        wait_until(m_space_available, [&] { return below_bound() && try_put(item); });
+        m_data_available.notify();
+    }
+
+    /* Returns false, leaving the item untouched, when the buffer is full */
+    bool try_push(T&& item)
+    {
+        if (!below_bound() || !try_put(item)) {
+            return false;
+        }
+        m_data_available.notify();
+        return true;
+    }
+
+    /* The bound is checked once for the whole batch */
+    void push_batch(std::vector<T>&& items)
+    {
+        wait_until(m_space_available, [&] { return below_bound(); });
+        for (auto& item : items) {
+            wait_until(m_space_available, [&] { return try_put(item); });
+        }
+        items.clear();
+        m_data_available.notify();
+    }
+
+    /* Waits for data, then takes a 1/shares part of the queued items (at
+       least one). Returns false once the buffer is closed and empty */
+    bool pop_batch(std::vector<T>& items, unsigned int shares = 1)
+    {
+        return take_batch([&](T&& item, size_t) { items.push_back(std::move(item)); }, shares);
+    }
+
+    /* Same, also returns the position of each item in the sequence of
+       pushed items (0 for the first one): positions have no gaps, and are
+       increasing within a batch */
+    bool pop_batch(std::vector<T>& items, std::vector<size_t>& positions, unsigned int shares = 1)
+    {
+        return take_batch([&](T&& item, size_t pos) {
+            items.push_back(std::move(item));
+            positions.push_back(pos);
+        }, shares);
+    }
+
+    /* Wakes the consumers waiting in pop_batch, which return false once
+       the buffer is empty */
+    void close()
+    {
+        m_closed = true;
+        m_data_available.notify();
+    }
+
+    /* Takes a 1/shares part of the queued items without waiting, returns
+       false when the buffer is empty */
+    bool try_pop_batch(std::vector<T>& items, unsigned int shares = 1)
+    {
+        auto append = [&](T&& item, size_t) { items.push_back(std::move(item)); };
+        if (!try_take(append)) {
+            return false;
+        }
+        take_more(append, shares);
+        return true;
+    }
+
+    T pop()
+    {
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        T* item{nullptr};
+        wait_until(m_data_available, [&] {
+            return try_take([&](T&& taken, size_t) { item = new (&storage) T(std::move(taken)); });
+        });
+        m_space_available.notify();
+        T result{std::move(*item)};
+        item->~T();
+        return result;
+    }
+
+    /* Whether a push would wait (approximate, like count) */
+    bool full()
+    {
+        return !below_bound();
+    }
+
+    /* Approximate while producers or consumers are running */
+    unsigned int count()
+    {
+        size_t head{m_dequeue_pos.load(std::memory_order_relaxed)};
+        return m_enqueue_pos.load(std::memory_order_relaxed) - head;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> m_sequence;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type m_storage;
+    };
+
+    void allocate(size_t s)
+    {
+        size_t capacity{1};
+        while (capacity < s || capacity < POMA_RING_SIZE) {
+            capacity <<= 1;
+        }
+        m_cells.reset(new Cell[capacity]);
+        for (size_t i{0}; i < capacity; ++i) {
+            m_cells[i].m_sequence.store(i, std::memory_order_relaxed);
+        }
+        m_mask = capacity - 1;
+        m_enqueue_pos.store(0, std::memory_order_relaxed);
+        m_dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    bool below_bound()
+    {
+        return m_bound == 0 || count() < m_bound;
+    }
+
+    /* A slot is free for position pos when its sequence is pos, and holds
+       the item of position pos when its sequence is pos + 1 */
+    bool try_put(T& item)
+    {
+        size_t pos{m_enqueue_pos.load(std::memory_order_relaxed)};
+        Cell* cell;
+        for (;;) {
+            cell = &m_cells[pos & m_mask];
+            size_t seq{cell->m_sequence.load(std::memory_order_acquire)};
+            intptr_t dif{(intptr_t) seq - (intptr_t) pos};
+            if (dif == 0) {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
                 }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
             }
         }
-        return ss.str();
+        new (&cell->m_storage) T(std::move(item));
+        cell->m_sequence.store(pos + 1, std::memory_order_release);
+        return true;
     }
 
-    virtual void flush() {}
-    virtual void finalize() {}
+    template<typename F>
+    bool try_take(F&& consume)
+    {
+        size_t pos{m_dequeue_pos.load(std::memory_order_relaxed)};
+        Cell* cell;
+        for (;;) {
+            cell = &m_cells[pos & m_mask];
+            size_t seq{cell->m_sequence.load(std::memory_order_acquire)};
+            intptr_t dif{(intptr_t) seq - (intptr_t) (pos + 1)};
+            if (dif == 0) {
+                if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        T* item{reinterpret_cast<T*>(&cell->m_storage)};
+        consume(std::move(*item), pos);
+        item->~T();
+        cell->m_sequence.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
 
-    /* Pipeline construction methods */
-    std::vector<std::string> get_channels() const
+    template<typename F>
+    bool take_batch(F&& consume, unsigned int shares)
     {
-        std::vector<std::string> keys;
-        for(auto kv : m_sinks) {
-            keys.push_back(kv.first);
+        bool taken{false};
+        wait_until(m_data_available, [&] {
+            taken = try_take(consume);
+            return taken || m_closed;
+        });
+        if (taken) {
+            take_more(consume, shares);
         }
-        return keys;
+        return taken;
     }
 
-    void clear_channels()
+    /* After taking one item: takes the rest of the 1/shares part */
+    template<typename F>
+    void take_more(F& consume, unsigned int shares)
     {
-        m_sinks.clear();
+        size_t n{(count() + shares) / shares};
+        for (size_t i{1}; i < n && try_take(consume); ++i) {
+        }
+        m_space_available.notify();
     }
 
-    BaseModule<T>& operator >> (std::shared_ptr<BaseModule<T> > sink)
+    template<typename F>
+    static void wait_until(EventCount& event, F&& attempt)
     {
-        return connect_sink(sink);
+        for (int i{0}; i < POMA_RING_SPIN; ++i) {
+            if (attempt()) {
+                return;
+            }
+            std::this_thread::yield();
+        }
+        for (;;) {
+            uint64_t epoch{event.prepare_wait()};
+            if (attempt()) {
+                event.cancel_wait();
+                return;
+            }
+            event.wait(epoch);
+        }
     }
 
-    std::shared_ptr<BaseModule<T> > connect_sink(std::shared_ptr<BaseModule<T> > m, const std::string& channel = "default", bool do_debug = false)
+    // Producers and consumers update different cache lines
+    char m_pad0[64];
+    std::atomic<size_t> m_enqueue_pos{0};
+    char m_pad1[64];
+    std::atomic<size_t> m_dequeue_pos{0};
+    char m_pad2[64];
+    std::unique_ptr<Cell[]> m_cells;
+    size_t m_mask{0};
+    unsigned int m_bound{0};
+    std::atomic<bool> m_closed{false};
+    EventCount m_data_available;
+    EventCount m_space_available;
+};
+
+// *********************************************************************
+// SHARED SCHEDULER
+// *********************************************************************
+
+// Threads of the shared scheduler (0: one per hardware thread)
+#ifndef POMA_SCHEDULER_THREADS
+#define POMA_SCHEDULER_THREADS 0
+#endif
+
+/* Process-wide pool of threads, used by the modules configured to run in
+   shared mode instead of owning their threads. A module joins with a step
+   function, which does a bounded amount of work and returns false when it
+   found nothing to do, and with a cap on the number of threads running its
+   steps at the same time. The module calls wake when it has work. Modules
+   are served round-robin, one step at a time, so that a busy module cannot
+   starve the others; a step which made progress is scheduled again, on up
+   to two threads, until the cap is reached. Steps must never wait for
+   other steps: a module which cannot queue more work does it itself */
+class Scheduler {
+public:
+    struct Group {
+        Group(const std::string& name, unsigned int cap, std::function<bool()> step) : m_name{name}, m_cap{cap}, m_step{std::move(step)} {}
+
+        std::string m_name;
+        unsigned int m_cap;
+        std::function<bool()> m_step;
+        unsigned int m_running {0};  // threads running a step
+        unsigned int m_queued {0};   // entries in the ready list
+        bool m_woken {false};        // woken since a step was last started
+        uint64_t m_steps {0};
+    };
+
+    static Scheduler& instance()
     {
-        Link<T> link{m, do_debug};
-        std::cerr << "Connecting " << m_module_id << " to " << m->m_module_id << " on channel " << channel << std::endl;
-        m_sinks[channel].push_back(link);
-        return m;
+        // Never destroyed: the threads may still be waiting at exit
+        static Scheduler* scheduler {new Scheduler};
+        return *scheduler;
     }
 
-    /* Pipeline duplication methods */
+    /* The pool is started by the first module that joins */
+    Group* join(const std::string& name, unsigned int cap, std::function<bool()> step)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_threads.empty()) {
+            unsigned int n {POMA_SCHEDULER_THREADS > 0 ? POMA_SCHEDULER_THREADS : std::thread::hardware_concurrency()};
+            n = std::max(n, 1u);
+            std::cerr << "Shared scheduler: using " << n << " threads" << std::endl;
+            for (unsigned int i {0}; i < n; i++) {
+                m_threads.push_back(std::thread {&Scheduler::worker_fn, this, i});
+                m_threads.back().detach();
+            }
+        }
+        m_groups.emplace_back(new Group{name, std::max(cap, 1u), std::move(step)});
+        return m_groups.back().get();
+    }
 
-    /* Create a clone of this object */
-    virtual std::shared_ptr<BaseModule<T> > clone() const
+    void wake(Group* group)
     {
-        throw std::runtime_error (std::string{"Clone not correctly implemented for this module: "} + m_module_id);
-        return nullptr;
-    };
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            group->m_woken = true;
+            if (!schedule(group)) {
+                return;
+            }
+        }
+        m_ready.notify_one();
+    }
 
-    std::string get_module_id() const
+    /* No step of the module runs once leave returns */
+    void leave(Group* group)
     {
-        return m_module_id;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        group->m_cap = 0;
+        m_ready_groups.erase(std::remove(m_ready_groups.begin(), m_ready_groups.end(), group), m_ready_groups.end());
+        group->m_queued = 0;
+        m_left.wait(lock, [&] { return group->m_running == 0; });
     }
 
-    /* Methods to be overridden */
-    virtual void construct(std::vector<std::string> parameters) {};
-    virtual void setup_cli(boost::program_options::options_description& desc) const {};
-    virtual void process_cli(boost::program_options::variables_map& vm) {};
-    virtual void initialize() {};
-    virtual void start_processing()
+    unsigned int threads()
     {
-        throw std::runtime_error("Processing method must be overridden");
-    };
-    virtual void on_incoming_data(Packet<T>& dta, const std::string& channel)
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_threads.size();
+    }
+
+    /* Steps run so far by each module */
+    std::vector<std::pair<std::string, uint64_t> > steps()
     {
-        submit_data(dta, channel);
-    };
-    virtual std::string on_read_property(const std::string& name) const
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<std::pair<std::string, uint64_t> > result;
+        for (const auto& g : m_groups) {
+            result.emplace_back(g->m_name, g->m_steps);
+        }
+        return result;
+    }
+
+private:
+    Scheduler() {}
+
+    /* Must be called with the mutex held */
+    bool schedule(Group* group)
     {
-        return "";
-    };
-    // Note: each module is responsible for making the following call thread safe
-    virtual std::string on_write_property(const std::string& name, const std::string& value)
+        if (group->m_running + group->m_queued >= group->m_cap) {
+            return false;
+        }
+        group->m_queued++;
+        m_ready_groups.push_back(group);
+        return true;
+    }
+
+    void worker_fn(unsigned int index)
     {
-        return "";
-    };
-    virtual std::string on_enumerate_properties() const
+        Placement::instance().pin("shared scheduler thread " + std::to_string(index));
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for(;;) {
+            m_ready.wait(lock, [&] { return !m_ready_groups.empty(); });
+            Group* group {m_ready_groups.front()};
+            m_ready_groups.pop_front();
+            group->m_queued--;
+            group->m_running++;
+            group->m_woken = false;
+            group->m_steps++;
+            lock.unlock();
+            bool progress {group->m_step()};
+            lock.lock();
+            group->m_running--;
+            if (group->m_cap == 0) {
+                m_left.notify_all();
+                continue;
+            }
+            int scheduled {0};
+            if (progress) {
+                scheduled += schedule(group);
+                scheduled += schedule(group);
+            } else if (group->m_woken) {
+                scheduled += schedule(group);
+            }
+            if (scheduled > 1) {
+                // this thread takes one of them
+                m_ready.notify_one();
+            }
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::condition_variable m_left;
+    std::deque<Group*> m_ready_groups;
+    std::vector<std::unique_ptr<Group> > m_groups;
+    std::vector<std::thread> m_threads;
+};
+
+// *********************************************************************
+// EVENT LOOP
+// *********************************************************************
+
+/* Process-wide event loop on which asynchronous modules resume their
+   packets. Callbacks run one at a time on a single thread, started by the
+   first module that uses the loop: as soon as possible (post), once a
+   delay has elapsed (after) or whenever a watched file descriptor is
+   readable (watch). Callbacks must never block the loop */
+class EventLoop {
+public:
+    typedef std::function<void()> Callback;
+
+    static EventLoop& instance()
     {
-        return "";
-    };
+        // Never destroyed: the thread may still be waiting at exit
+        static EventLoop* loop {new EventLoop};
+        return *loop;
+    }
 
-    virtual std::string getType() const
+    void post(Callback callback)
     {
-        return "Generic BaseModule";
-    };
+        after(std::chrono::milliseconds{0}, std::move(callback));
+    }
 
-protected:
-    static std::vector<BaseModule<T>*> sm_instances;
-    static std::set<std::string> sm_instances_classes;
+    template<typename R, typename P>
+    void after(std::chrono::duration<R, P> delay, Callback callback)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_timers.emplace(std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay), std::move(callback));
+        }
+        wakeup();
+    }
 
-    std::mutex* m_module_mutex{nullptr};
-    std::string m_module_id;
+    void watch(int fd, Callback callback)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_watches[fd] = std::move(callback);
+        }
+        wakeup();
+    }
 
-    std::map<std::string,std::vector<Link<T> > > m_sinks;
+    /* Once unwatch returns the callback is not running (unless unwatch
+       was called by the callback itself) and will not run again */
+    void unwatch(int fd)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_watches.erase(fd);
+            if (!in_loop()) {
+                m_watch_done.wait(lock, [&] { return m_running_watch != fd; });
+            }
+        }
+        wakeup();
+    }
 
-    bool m_do_reconfigure_module{true};
-};
+    /* True when called from a callback */
+    bool in_loop() const
+    {
+        return std::this_thread::get_id() == m_thread_id.load();
+    }
 
-/* Static fields initialization */
-template<typename T>
-std::vector<BaseModule<T>*> BaseModule<T>::sm_instances;
+private:
+    EventLoop()
+    {
+        if (pipe2(m_wakeup, O_NONBLOCK | O_CLOEXEC) != 0) {
+            throw std::runtime_error {"Failed to create the event loop wakeup pipe"};
+        }
+        std::thread {&EventLoop::loop_fn, this}.detach();
+    }
 
-template<typename T>
-std::set<std::string> BaseModule<T>::sm_instances_classes;
+    void wakeup()
+    {
+        if (!in_loop() && !m_notified.exchange(true)) {
+            char c {0};
+            while (write(m_wakeup[1], &c, 1) < 0 && errno == EINTR) {}
+        }
+    }
 
-/* Cloneable module */
-template <typename D, typename T>
-class Module : public BaseModule<T> {
-public:
-    Module(const std::string& mid) : BaseModule<T>(mid) {}
-    
-    std::shared_ptr<BaseModule<T> > clone() const override
+    void loop_fn()
     {
-        auto ptr = new D {static_cast<D const&>(*this)};
-        if (ptr == nullptr) {
-            throw std::runtime_error (std::string{"Failed to allocate memory for cloned object in module "} + this->get_module_id());
-            return nullptr;
-        } else {
-            auto head = std::shared_ptr<BaseModule<T> > {ptr};
-            head->clear_channels();
-            for (const auto& c : BaseModule<T>::get_channels()) {
-                if ((c.length() >= 1) && (c.at(0) == '_')) { // channel starting with _
-                    for (const auto& s : BaseModule<T>::m_sinks.find(c)->second) {
-                        head->connect_sink(s.m_module, c);
-                    }
+        // Set before the first callback: until then in_loop is false everywhere
+        m_thread_id = std::this_thread::get_id();
+        std::vector<Callback> ready;
+        std::vector<pollfd> fds;
+        for(;;) {
+            m_notified = false;
+            int timeout {-1};
+            fds.assign(1, pollfd{m_wakeup[0], POLLIN, 0});
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto now = std::chrono::steady_clock::now();
+                while (!m_timers.empty() && m_timers.begin()->first <= now) {
+                    ready.push_back(std::move(m_timers.begin()->second));
+                    m_timers.erase(m_timers.begin());
+                }
+                if (!m_timers.empty()) {
+                    timeout = std::chrono::duration_cast<std::chrono::milliseconds>(m_timers.begin()->first - now).count() + 1;
+                }
+                for (const auto& w : m_watches) {
+                    fds.push_back(pollfd{w.first, POLLIN, 0});
+                }
+            }
+            if (!ready.empty()) {
+                for (auto& callback : ready) {
+                    run(callback);
+                }
+                ready.clear();
+                continue;
+            }
+            if (poll(fds.data(), fds.size(), timeout) <= 0) {
+                continue;
+            }
+            if (fds[0].revents != 0) {
+                char buffer[64];
+                while (read(m_wakeup[0], buffer, sizeof(buffer)) > 0) {}
+            }
+            for (size_t i {1}; i < fds.size(); i++) {
+                if (fds[i].revents == 0) {
                     continue;
                 }
-                for (const auto& s : BaseModule<T>::m_sinks.find(c)->second) {
-                    head->connect_sink(s.m_module->clone(), c);
+                Callback callback;
+                {
+                    // The watch may have been removed by a previous callback
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    auto it = m_watches.find(fds[i].fd);
+                    if (it == m_watches.end()) {
+                        continue;
+                    }
+                    callback = it->second;
+                    m_running_watch = fds[i].fd;
+                }
+                run(callback);
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_running_watch = -1;
                 }
+                m_watch_done.notify_all();
             }
-            return head;
         }
     }
 
-    std::string getType() const override
+    void run(Callback& callback)
     {
-        return typeid(D).name();
+        try {
+            callback();
+        } catch (const std::exception& e) {
+            std::cerr << "Exception in event loop: " << e.what() << std::endl;
+        }
     }
+
+    std::mutex m_mutex;
+    std::multimap<std::chrono::steady_clock::time_point, Callback> m_timers;
+    std::map<int, Callback> m_watches;
+    int m_running_watch {-1};
+    std::condition_variable m_watch_done;
+    int m_wakeup[2];
+    std::atomic<bool> m_notified {false};
+    std::atomic<std::thread::id> m_thread_id {std::thread::id{}};
 };
 
 // *********************************************************************
-// PARALLEL PROCESSOR MODULE TEMPLATE
+// ASYNCHRONOUS MODULE TEMPLATE
 // *********************************************************************
-template<typename J>
-class ParallelProcessorBaseModule : public BaseModule<J> {
+
+/* Module which can wait (for a timer, a network reply...) without holding
+   a thread: on_incoming_async starts processing a packet and returns, and
+   the module calls complete once it is done, usually from a callback of
+   the event loop. The loop never runs the sinks of the module: packets
+   completed there are sent downstream by the shared scheduler. Up to
+   max_in_flight packets are processed (or wait to be sent) at the same
+   time: further packets wait for a slot, or are refused by try_submit */
+template <typename D, typename T>
+class AsyncModule : public Module<D, T> {
 public:
-    ParallelProcessorBaseModule(const std::string& mid) : BaseModule<J>(mid) {}
+    /* A packet owned by the module until complete is called */
+    struct Task {
+        Task(Packet<T>&& dta, const std::string& channel) : m_packet{std::move(dta)}, m_channel{channel} {}
 
-    ~ParallelProcessorBaseModule()
+        Packet<T> m_packet;
+        std::string m_channel;
+    };
+    typedef std::shared_ptr<Task> TaskPointer;
+
+    AsyncModule(const std::string& mid) : Module<D, T>(mid) {}
+
+    AsyncModule(const AsyncModule& o) : Module<D, T>(o), m_max_in_flight{o.m_max_in_flight} {}
+
+    ~AsyncModule()
     {
-        for (auto& t : m_thread_pool) {
-            t.detach();
-        }
+        shutdown();
     }
 
-    std::shared_ptr<BaseModule<J> > clone() const
+    void on_incoming_data(Packet<T>& dta, const std::string& channel) override
     {
-        throw std::runtime_error ("Cannot clone Parallel Processor object");
-        return nullptr;
+        Packet<T> copy {dta};
+        on_incoming_data(std::move(copy), channel);
     }
 
-    void start_processing()
+    void on_incoming_data(Packet<T>&& dta, const std::string& channel) override
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_in_flight_mutex);
+            // The loop must never wait for a slot
+            while (m_in_flight >= m_max_in_flight && !EventLoop::instance().in_loop()) {
+                if (m_completed_tasks.empty()) {
+                    m_completed.wait(lock);
+                    continue;
+                }
+                // The caller may be a thread of the scheduler: it sends
+                // the completed packets itself rather than waiting for it
+                lock.unlock();
+                if (!deliver_completed()) {
+                    std::this_thread::yield();
+                }
+                lock.lock();
+            }
+            m_in_flight++;
+        }
+        on_incoming_async(std::make_shared<Task>(std::move(dta), channel));
+    }
+
+    SubmitStatus on_offer(Packet<T>&& dta, const std::string& channel) override
     {
-        unsigned long sink_count{this->m_sinks["default"].size()};
-        if (sink_count) {
-            for(auto s : this->m_sinks["default"]) {
-                m_thread_pool.push_back(std::thread([=] {processor_fn(s.m_module);}));
+        {
+            std::lock_guard<std::mutex> lock(m_in_flight_mutex);
+            if (m_in_flight >= m_max_in_flight) {
+                return SubmitStatus::WOULD_BLOCK;
             }
+            m_in_flight++;
         }
-        for(;;) {};
+        on_incoming_async(std::make_shared<Task>(std::move(dta), channel));
+        return SubmitStatus::ACCEPTED;
     }
 
-    std::string getType()
+    bool would_block(const Packet<T>& dta, const std::string& channel) override
     {
-        return typeid(ParallelProcessorBaseModule).name();
+        std::lock_guard<std::mutex> lock(m_in_flight_mutex);
+        return m_in_flight >= m_max_in_flight;
+    }
+
+    void flush() override
+    {
+        std::unique_lock<std::mutex> lock(m_in_flight_mutex);
+        m_completed.wait(lock, [&] { return m_in_flight == 0; });
+    }
+
+    /* Packets completed on the loop but not yet sent are dropped */
+    void shutdown() override
+    {
+        Scheduler::Group* group;
+        {
+            std::lock_guard<std::mutex> lock(m_in_flight_mutex);
+            m_stopping = true;
+            group = m_group;
+            m_group = nullptr;
+        }
+        if (group != nullptr) {
+            Scheduler::instance().leave(group);
+        }
     }
 
 protected:
-    void processor_fn(std::shared_ptr<BaseModule<J>> mod)
+    /* Starts processing the packet of the task, without waiting */
+    virtual void on_incoming_async(const TaskPointer& task) = 0;
+
+    /* Sends the packet of the task downstream and releases its slot, from
+       any thread. On the event loop, which must never block on the sinks,
+       the packet is handed over to the shared scheduler instead */
+    void complete(const TaskPointer& task)
     {
-        mod->start_processing();
+        if (!EventLoop::instance().in_loop()) {
+            this->submit_data(std::move(task->m_packet));
+            release();
+            return;
+        }
+        Scheduler::Group* group;
+        {
+            std::lock_guard<std::mutex> lock(m_in_flight_mutex);
+            if (m_stopping) {
+                return;
+            }
+            m_completed_tasks.push_back(task);
+            if (m_group == nullptr) {
+                // Packets are sent by one thread at a time, in order
+                m_group = Scheduler::instance().join(this->get_module_id() + " completions", 1, [this] { return deliver_completed(); });
+            }
+            group = m_group;
+        }
+        // Wakes the senders waiting for a slot as well (see on_incoming_data)
+        m_completed.notify_all();
+        Scheduler::instance().wake(group);
     }
 
-private:
-    std::vector<std::thread> m_thread_pool;
-};
+    /* Releases the slot of a packet without sending it, from any thread */
+    void release()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_in_flight_mutex);
+            m_in_flight--;
+        }
+        m_completed.notify_all();
+    }
 
-// *********************************************************************
-// BOUNDED BUFFER
-// *********************************************************************
-template<typename T, int size = 0>
-class BoundedBuffer {
-public:
-	void set_bound(unsigned int s) {
-		m_buffer_size = s;
-	}
+    void set_max_in_flight(unsigned int n)
+    {
+        m_max_in_flight = std::max(n, 1u);
+    }
 
-	void push(T& item) {
-		std::unique_lock<std::mutex> lock(m_queue_lock);
-		m_space_available.wait(lock, [&] { return m_buffer_size == 0 || m_queue.size() < m_buffer_size; });
-		m_queue.push(item);
-		m_data_available.notify_one();
-	}
-	
-	T pop() {
-		std::unique_lock<std::mutex> lock(m_queue_lock);
-		m_data_available.wait(lock, [&]  { return m_queue.size() > 0; });
-		T item{m_queue.front()};
-		m_queue.pop();
-		m_space_available.notify_one();
-		return item;
-	}
-	
-	unsigned int count() {
-		std::unique_lock<std::mutex> lock(m_queue_lock);
-		return m_queue.size();
-	}
+    unsigned int max_in_flight() const
+    {
+        return m_max_in_flight;
+    }
 
+private:
+    /* Sends the packets completed on the loop. Returns false when another
+       thread is sending them or when there are none */
+    bool deliver_completed()
+    {
+        bool delivered {false};
+        while (!m_delivering.exchange(true)) {
+            std::deque<TaskPointer> tasks;
+            {
+                std::lock_guard<std::mutex> lock(m_in_flight_mutex);
+                tasks.swap(m_completed_tasks);
+            }
+            for (auto& task : tasks) {
+                this->submit_data(std::move(task->m_packet));
+                release();
+                delivered = true;
+            }
+            m_delivering = false;
+            std::lock_guard<std::mutex> lock(m_in_flight_mutex);
+            if (m_completed_tasks.empty()) {
+                break;
+            }
+        }
+        return delivered;
+    }
 
-private:
-	std::mutex m_queue_lock;
-	std::condition_variable m_data_available;
-	std::condition_variable m_space_available;
-	std::queue<T> m_queue;
-	unsigned int m_buffer_size{size};
+    unsigned int m_max_in_flight {1};
+    unsigned int m_in_flight {0};
+    std::mutex m_in_flight_mutex;
+    std::condition_variable m_completed;
+    std::deque<TaskPointer> m_completed_tasks;
+    std::atomic<bool> m_delivering {false};
+    bool m_stopping {false};
+    Scheduler::Group* m_group {nullptr};
 };
 
 // *********************************************************************
@@ -718,9 +3216,7 @@ public:
     {
         assert(m_incoming_queue.count() == 0);
         assert(m_outgoing_queue.count() == 0);
-        for (auto& t : m_thread_pool) {
-            t.detach();
-        }
+        shutdown();
     }
 
     void initialize()
@@ -729,22 +3225,35 @@ public:
         if (m_thread_limit < 0) m_thread_limit = n_threads;
         n_threads = m_thread_limit; //std::min(n_threads, m_thread_limit);
         m_incoming_queue.set_bound(n_threads);
+        m_executors = n_threads + 1;
         std::shared_ptr<BaseModule<J> > head;
         if (n_threads <= 0) {
             // do nothing
             std::cerr << "Sequential operation in module " << this->get_module_id() << std::endl;
-        } else if (this->m_sinks["template"].size() == 1) {
-            head = this->m_sinks["template"][0].m_module;
-            m_thread_pool.push_back(std::thread {&ForkBaseModule::collector_fn, this});
-            std::cerr << "Parallel operation in module " << this->get_module_id() << ": using " << n_threads << " worker threads" << std::endl;
+        } else if (this->sinks("template").size() == 1) {
+            head = this->sinks("template")[0].m_module;
+            if (m_work_stealing || m_partitioned) {
+                for (unsigned int i {0}; i < m_executors; i++) {
+                    m_worker_queues.emplace_back(new RingBuffer<Packet<J> >{});
+                    m_worker_queues.back()->set_bound(1);
+                    m_worker_counters.emplace_back(new WorkerCounters{});
+                }
+            }
+            if (m_shared) {
+                initialize_shared(head, n_threads);
+                return;
+            }
+            if (m_ordered) {
+                m_window.resize(m_window_size);
+                m_thread_pool.push_back(std::thread {&ForkBaseModule::ordered_collector_fn, this});
+            } else {
+                m_thread_pool.push_back(std::thread {&ForkBaseModule::collector_fn, this});
+            }
+            std::cerr << "Parallel operation in module " << this->get_module_id() << ": using " << n_threads << " worker threads" << (m_ordered ? " (ordered)" : "") << (m_work_stealing ? " (work stealing)" : "")
+                      << (m_partitioned ? " (partitioned by " + m_partition_key.path() + ")" : "") << std::endl;
             for (int i {0}; i<n_threads; i++) {
                 try {
-                    if (stateless) {
-                        m_thread_pool.push_back(std::thread {&ForkBaseModule::executor_fn, this, head});
-                    } else {
-                        std::shared_ptr<BaseModule<J> > chead = head->clone();
-                        m_thread_pool.push_back(std::thread {&ForkBaseModule::executor_fn, this, chead});
-                    }
+                    start_worker(head, i, !stateless);
                 } catch (const boost::exception& e) {
                     std::cerr << "DEBUG: Failed to initialize fork thread in module " << this->get_module_id() << ":" << boost::diagnostic_information(e)  << std::endl;
                     throw;
@@ -756,8 +3265,8 @@ public:
                     throw;
                 }
             }
-            m_thread_pool.push_back(std::thread {&ForkBaseModule::executor_fn, this, head});
-        } else if (this->m_sinks["template"].size() == 0) {
+            start_worker(head, n_threads, false);
+        } else if (this->sinks("template").size() == 0) {
             throw std::runtime_error (std::string{"Pipeline template channel is empty in module "} + this->get_module_id());
         } else {
             throw std::runtime_error (std::string{"Pipeline template channel is invalid in module "} + this->get_module_id());
@@ -766,19 +3275,80 @@ public:
 
     void on_incoming_data(Packet<J>& dta, const std::string& channel)
     {
-        if (channel == "default") {
-            if (m_thread_limit <= 0) {
-                this->submit_data(dta, "template");
-            } else {
-				m_incoming_buffer_size++;
-				m_incoming_queue.push(dta);
+        if (m_thread_limit <= 0) {
+            forward(dta, channel);
+        } else {
+            enqueue(Packet<J>{dta}, channel);
+        }
+    }
+
+    void on_incoming_data(Packet<J>&& dta, const std::string& channel)
+    {
+        if (m_thread_limit <= 0) {
+            forward(std::move(dta), channel);
+        } else {
+            enqueue(std::move(dta), channel);
+        }
+    }
+
+    /* Incoming packets are refused while all the workers are busy */
+    SubmitStatus on_offer(Packet<J>&& dta, const std::string& channel) override
+    {
+        if (m_thread_limit <= 0 || channel != "default") {
+            on_incoming_data(std::move(dta), channel);
+            return SubmitStatus::ACCEPTED;
+        }
+        uint64_t trace{dta.m_trace};
+        m_incoming_buffer_size.add();
+        if (!try_dispatch(std::move(dta))) {
+            m_incoming_buffer_size.remove();
+            return SubmitStatus::WOULD_BLOCK;
+        }
+        if (trace > Tracer::UNTRACED) {
+            Tracer::instance().event('s', trace, this->m_module_id + " incoming", "queue");
+        }
+        return SubmitStatus::ACCEPTED;
+    }
+
+    bool would_block(const Packet<J>& dta, const std::string& channel) override
+    {
+        if (m_thread_limit <= 0 || channel != "default") {
+            return false;
+        }
+        if (m_partitioned) {
+            return m_worker_queues[partition(dta)]->full();
+        }
+        if (m_work_stealing) {
+            return std::all_of(m_worker_queues.begin(), m_worker_queues.end(), [](const std::unique_ptr<RingBuffer<Packet<J> > >& q) { return q->full(); });
+        }
+        return m_incoming_queue.full();
+    }
+
+    void on_incoming_batch(PacketBatch<J>&& batch, const std::string& channel)
+    {
+        if (m_thread_limit <= 0) {
+            if (channel == "default") {
+                this->submit_batch(std::move(batch), "template");
+            } else if (channel == "_join") {
+                this->submit_batch(std::move(batch));
             }
+        } else if (channel == "default") {
+            trace_queue(batch.packets(), 's', "incoming");
+            m_incoming_buffer_size.add(batch.size());
+            dispatch_batch(std::move(batch.packets()));
         } else if (channel == "_join") {
-            if (m_thread_limit <= 0) {
-                this->submit_data(dta);
+            trace_queue(batch.packets(), 's', "outgoing");
+            m_outgoing_buffer_size.add(batch.size());
+            if (m_ordered) {
+                for (auto& dta : batch) {
+                    reorder(std::move(dta));
+                }
+            } else if (m_shared) {
+                for (auto& dta : batch) {
+                    push_result(std::move(dta));
+                }
             } else {
-				m_outgoing_buffer_size++;
-				m_outgoing_queue.push(dta);
+                m_outgoing_queue.push_batch(std::move(batch.packets()));
             }
         }
     }
@@ -797,48 +3367,723 @@ public:
     {
         boost::program_options::options_description pex("Parallel fork executor options");
         pex.add_options()
-        ("threads", boost::program_options::value<int>()->default_value(-1), "force number of threads");
+        ("threads", boost::program_options::value<int>()->default_value(-1), "force number of threads")
+        ("ordered", boost::program_options::value<bool>()->default_value(false), "emit results in the order of the incoming packets")
+        ("window", boost::program_options::value<unsigned int>()->default_value(1024), "ordered mode: maximum number of packets processed ahead of the oldest one in progress")
+        ("workstealing", boost::program_options::value<bool>()->default_value(false), "give each worker its own queue, idle workers steal from the others")
+        ("partitionkey", boost::program_options::value<std::string>()->default_value(""), "metadata property: packets with the same value always go to the same worker")
+        ("shared", boost::program_options::value<bool>()->default_value(false), "run the workers as tasks of the process-wide scheduler instead of dedicated threads");
         desc.add(pex);
     }
 
     void process_cli(boost::program_options::variables_map& vm)
     {
         m_thread_limit = vm["threads"].as<int>();
+        m_ordered = vm["ordered"].as<bool>();
+        m_window_size = vm["window"].as<unsigned int>();
+        if (m_window_size == 0) {
+            throw std::runtime_error (std::string{"Reorder window cannot be empty in module "} + this->get_module_id());
+        }
+        m_work_stealing = vm["workstealing"].as<bool>();
+        if (m_work_stealing && m_ordered) {
+            throw std::runtime_error (std::string{"Work stealing cannot be combined with ordered operation in module "} + this->get_module_id());
+        }
+        std::string partition_key {vm["partitionkey"].as<std::string>()};
+        m_partitioned = !partition_key.empty();
+        if (m_partitioned) {
+            if (m_work_stealing || m_ordered) {
+                throw std::runtime_error (std::string{"Key partitioning cannot be combined with work stealing or ordered operation in module "} + this->get_module_id());
+            }
+            m_partition_key = partition_key;
+        }
+        m_shared = vm["shared"].as<bool>();
+        if (m_shared && (m_ordered || m_work_stealing || m_partitioned)) {
+            throw std::runtime_error (std::string{"Shared scheduling cannot be combined with ordered, work stealing or partitioned operation in module "} + this->get_module_id());
+        }
     }
 
+    /* The workers queue their results before releasing their packets,
+       but modules of the template (a Buffer, an asynchronous module) may
+       still hold packets once the workers are idle: the template and its
+       clones are flushed before waiting for the results */
     void flush() override
     {
-        while(m_incoming_buffer_size != 0 || m_outgoing_buffer_size != 0) {
-            std::this_thread::yield();
-        };
+        m_incoming_buffer_size.wait_idle();
+        for (auto head : this->sinks_of("template")) {
+            head->flush_pipeline();
+        }
+        for (const auto& head : m_clones) {
+            head->flush_pipeline();
+        }
+        m_outgoing_buffer_size.wait_idle();
+    }
+
+    /* The workers find their queues closed once they are empty */
+    void shutdown() override
+    {
+        if (m_group != nullptr) {
+            Scheduler::instance().leave(m_group);
+            m_group = nullptr;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_window_mutex);
+            m_stopping = true;
+        }
+        m_window_room.notify_all();
+        m_window_ready.notify_all();
+        m_incoming_queue.close();
+        m_outgoing_queue.close();
+        for (auto& q : m_worker_queues) {
+            q->close();
+        }
+        m_work_available.notify();
+        for (auto& t : m_thread_pool) {
+            t.join();
+        }
+        m_thread_pool.clear();
+    }
+
+    /* The clones of the template are idle once the pipeline is flushed */
+    void combine() override
+    {
+        if (m_clones.empty()) {
+            return;
+        }
+        std::shared_ptr<BaseModule<J> > head = this->sinks("template")[0].m_module;
+        for (const auto& clone : m_clones) {
+            head->merge_pipeline(*clone);
+        }
+    }
+
+    void finalize() override
+    {
+        if (m_ordered && m_thread_limit > 0) {
+            LinkStats::Snapshot stats{reorder_stats()};
+            std::cerr << "Reorder window of module " << this->get_module_id() << ": " << stats.m_packets << " packets, wait mean "
+                      << stats.mean_ns() << " ns, p50 < " << stats.percentile_ns(0.5) << " ns, p99 < " << stats.percentile_ns(0.99) << " ns" << std::endl;
+        }
+        std::vector<WorkerStats> workers{worker_stats()};
+        for (size_t i {0}; i < workers.size(); i++) {
+            std::cerr << "Worker " << i << " of module " << this->get_module_id() << ": " << workers[i].m_packets << " packets";
+            if (m_work_stealing) {
+                std::cerr << ", " << workers[i].m_steals << " steals (" << workers[i].m_stolen << " packets), idle "
+                          << workers[i].m_idle << " times (" << workers[i].m_idle_ns / 1000000 << " ms)";
+            }
+            std::cerr << std::endl;
+        }
+    }
+
+    struct WorkerStats {
+        uint64_t m_packets {0};   // processed by the worker
+        uint64_t m_steals {0};    // successful steals from other workers
+        uint64_t m_stolen {0};    // packets taken by those steals
+        uint64_t m_idle {0};      // times the worker blocked without work
+        uint64_t m_idle_ns {0};   // time spent blocked
+    };
+
+    /* Work-stealing and partitioned modes: counters of each worker (the
+       last one runs the template itself), empty in the other modes */
+    std::vector<WorkerStats> worker_stats() const
+    {
+        std::vector<WorkerStats> result;
+        for (const auto& c : m_worker_counters) {
+            WorkerStats w;
+            w.m_packets = c->m_packets.load(std::memory_order_relaxed);
+            w.m_steals = c->m_steals.load(std::memory_order_relaxed);
+            w.m_stolen = c->m_stolen.load(std::memory_order_relaxed);
+            w.m_idle = c->m_idle.load(std::memory_order_relaxed);
+            w.m_idle_ns = c->m_idle_ns.load(std::memory_order_relaxed);
+            result.push_back(w);
+        }
+        return result;
+    }
+
+    /* Ordered mode: time spent by the results in the reorder window, from
+       the end of their processing to their release */
+    LinkStats::Snapshot reorder_stats() const
+    {
+        return m_window_stats.snapshot();
     }
 
 
 protected:
-    void executor_fn(std::shared_ptr<BaseModule<J> > head)
+    struct WorkerCounters {
+        std::atomic<uint64_t> m_packets {0};
+        std::atomic<uint64_t> m_steals {0};
+        std::atomic<uint64_t> m_stolen {0};
+        std::atomic<uint64_t> m_idle {0};
+        std::atomic<uint64_t> m_idle_ns {0};
+        // keeps the counters of two workers off the same cache line
+        char m_padding[64];
+    };
+
+    /* Sequential operation */
+    template<typename P>
+    void forward(P&& dta, const std::string& channel)
+    {
+        if (channel == "default") {
+            this->submit_data(std::forward<P>(dta), "template");
+        } else if (channel == "_join") {
+            this->submit_data(std::forward<P>(dta));
+        }
+    }
+
+    void enqueue(Packet<J>&& dta, const std::string& channel)
+    {
+        if (channel == "default") {
+            trace_queue(dta, 's', "incoming");
+            m_incoming_buffer_size.add();
+            dispatch(std::move(dta));
+        } else if (channel == "_join") {
+            trace_queue(dta, 's', "outgoing");
+            m_outgoing_buffer_size.add();
+            if (m_ordered) {
+                reorder(std::move(dta));
+            } else if (m_shared) {
+                push_result(std::move(dta));
+            } else {
+                m_outgoing_queue.push(std::move(dta));
+            }
+        }
+    }
+
+    /* Partitioned mode: the worker of a packet depends only on the value
+       of its partition key (packets without the key go to the same worker) */
+    unsigned int partition(const Packet<J>& dta) const
+    {
+        return std::hash<std::string>{}(dta.m_properties.get(m_partition_key, "")) % m_worker_queues.size();
+    }
+
+    void dispatch(Packet<J>&& dta)
+    {
+        if (m_partitioned) {
+            m_worker_queues[partition(dta)]->push(std::move(dta));
+            return;
+        }
+        if (m_shared) {
+            push_shared(std::move(dta));
+            return;
+        }
+        if (!m_work_stealing) {
+            m_incoming_queue.push(std::move(dta));
+            return;
+        }
+        unsigned int first {m_next_worker++};
+        for (size_t i {0}; i < m_worker_queues.size(); i++) {
+            if (m_worker_queues[(first + i) % m_worker_queues.size()]->try_push(std::move(dta))) {
+                m_work_available.notify();
+                return;
+            }
+        }
+        m_worker_queues[first % m_worker_queues.size()]->push(std::move(dta));
+        m_work_available.notify();
+    }
+
+    bool try_dispatch(Packet<J>&& dta)
+    {
+        if (m_partitioned) {
+            return m_worker_queues[partition(dta)]->try_push(std::move(dta));
+        }
+        if (m_shared) {
+            if (!m_incoming_queue.try_push(std::move(dta))) {
+                return false;
+            }
+            Scheduler::instance().wake(m_group);
+            return true;
+        }
+        if (!m_work_stealing) {
+            return m_incoming_queue.try_push(std::move(dta));
+        }
+        unsigned int first {m_next_worker++};
+        for (size_t i {0}; i < m_worker_queues.size(); i++) {
+            if (m_worker_queues[(first + i) % m_worker_queues.size()]->try_push(std::move(dta))) {
+                m_work_available.notify();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Work-stealing mode: batches are not split, idle workers steal part of them */
+    void dispatch_batch(std::vector<Packet<J> >&& items)
+    {
+        if (m_partitioned) {
+            // One sub-batch per worker, packets keep their relative order
+            std::vector<std::vector<Packet<J> > > parts(m_worker_queues.size());
+            for (auto& dta : items) {
+                parts[partition(dta)].push_back(std::move(dta));
+            }
+            items.clear();
+            for (size_t i {0}; i < parts.size(); i++) {
+                if (!parts[i].empty()) {
+                    m_worker_queues[i]->push_batch(std::move(parts[i]));
+                }
+            }
+            return;
+        }
+        if (m_shared) {
+            for (auto& dta : items) {
+                push_shared(std::move(dta));
+            }
+            items.clear();
+            return;
+        }
+        if (!m_work_stealing) {
+            m_incoming_queue.push_batch(std::move(items));
+            return;
+        }
+        unsigned int first {m_next_worker++};
+        size_t n {m_worker_queues.size()};
+        size_t target {first % n};
+        for (size_t i {0}; i < n; i++) {
+            if (!m_worker_queues[(first + i) % n]->full()) {
+                target = (first + i) % n;
+                break;
+            }
+        }
+        m_worker_queues[target]->push_batch(std::move(items));
+        m_work_available.notify();
+    }
+
+    /* Each executor takes its share of the queued packets */
+    /* The worker is pinned by the placement policy before it clones the
+       template, so that the clone is allocated from its own NUMA node.
+       Returns once the clone is ready, rethrowing its exceptions */
+    void start_worker(const std::shared_ptr<BaseModule<J> >& head, unsigned int index, bool clone)
+    {
+        auto ready = std::make_shared<std::promise<std::shared_ptr<BaseModule<J> > > >();
+        std::future<std::shared_ptr<BaseModule<J> > > worker_head {ready->get_future()};
+        m_thread_pool.push_back(std::thread {[this, head, index, clone, ready] {
+            Placement::instance().pin(this->get_module_id() + " worker " + std::to_string(index));
+            std::shared_ptr<BaseModule<J> > mine {head};
+            try {
+                if (clone) {
+                    mine = head->clone();
+                }
+                ready->set_value(mine);
+            } catch (...) {
+                ready->set_exception(std::current_exception());
+                return;
+            }
+            executor_fn(mine, index);
+        }});
+        std::shared_ptr<BaseModule<J> > chead {worker_head.get()};
+        if (clone) {
+            m_clones.push_back(chead);
+        }
+    }
+
+    void executor_fn(std::shared_ptr<BaseModule<J> > head, unsigned int index)
+    {
+        if (m_ordered) {
+            ordered_executor_fn(head);
+            return;
+        }
+        if (m_work_stealing) {
+            stealing_executor_fn(head, index);
+            return;
+        }
+        if (m_partitioned) {
+            partitioned_executor_fn(head, index);
+            return;
+        }
+        std::vector<Packet<J> > items;
+        while (m_incoming_queue.pop_batch(items, m_executors)) {
+            int n {(int) items.size()};
+            execute(head, std::move(items));
+            m_incoming_buffer_size.remove(n);
+            items.clear();
+        }
+    }
+
+    /* Work-stealing mode: packets are distributed round-robin to the
+       queues of the workers (skipping the full ones). A worker takes its
+       share of its own queue, otherwise it steals half of the packets
+       queued for another worker, and only blocks when all the queues are
+       empty */
+    void stealing_executor_fn(std::shared_ptr<BaseModule<J> > head, unsigned int index)
+    {
+        WorkerCounters& counters = *m_worker_counters[index];
+        while (!m_stopping) {
+            std::vector<Packet<J> > items;
+            if (!find_work(index, items, counters)) {
+                for (int i {0}; i < POMA_RING_SPIN && !find_work(index, items, counters); i++) {
+                    std::this_thread::yield();
+                }
+            }
+            while (items.empty()) {
+                uint64_t epoch {m_work_available.prepare_wait()};
+                if (find_work(index, items, counters)) {
+                    m_work_available.cancel_wait();
+                    break;
+                }
+                if (m_stopping) {
+                    m_work_available.cancel_wait();
+                    return;
+                }
+                counters.m_idle.fetch_add(1, std::memory_order_relaxed);
+                auto start = std::chrono::steady_clock::now();
+                m_work_available.wait(epoch);
+                counters.m_idle_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+            }
+            int n {(int) items.size()};
+            counters.m_packets.fetch_add(n, std::memory_order_relaxed);
+            execute(head, std::move(items));
+            m_incoming_buffer_size.remove(n);
+        }
+    }
+
+    /* Partitioned mode: each worker (with its own clone of the template)
+       only takes the packets of its own queue */
+    void partitioned_executor_fn(std::shared_ptr<BaseModule<J> > head, unsigned int index)
+    {
+        WorkerCounters& counters = *m_worker_counters[index];
+        std::vector<Packet<J> > items;
+        while (m_worker_queues[index]->pop_batch(items)) {
+            int n {(int) items.size()};
+            counters.m_packets.fetch_add(n, std::memory_order_relaxed);
+            execute(head, std::move(items));
+            m_incoming_buffer_size.remove(n);
+            items.clear();
+        }
+    }
+
+    /* Shared mode: the template and each of its clones can be used by
+       one step at a time */
+    void initialize_shared(const std::shared_ptr<BaseModule<J> >& head, int n_threads)
+    {
+        std::cerr << "Parallel operation in module " << this->get_module_id() << ": using up to " << n_threads << " worker threads (shared scheduler)" << std::endl;
+        for (int i {0}; i < n_threads; i++) {
+            if (stateless) {
+                m_idle_heads.push_back(head);
+            } else {
+                std::shared_ptr<BaseModule<J> > chead = head->clone();
+                m_clones.push_back(chead);
+                m_idle_heads.push_back(chead);
+            }
+        }
+        m_idle_heads.push_back(head);
+        m_group = Scheduler::instance().join(this->get_module_id(), m_executors, [this] { return shared_step(); });
+    }
+
+    /* Shared mode: a step takes a share of the incoming packets and
+       processes them with an idle copy of the template, then sends the
+       results downstream. When all the copies are in use, their users
+       (scheduled or not, see push_shared) wake the module again once
+       they have queued their packets */
+    bool shared_step()
+    {
+        bool progress {collect()};
+        std::shared_ptr<BaseModule<J> > head;
+        {
+            std::lock_guard<std::mutex> lock(m_heads_mutex);
+            if (!m_idle_heads.empty()) {
+                head = std::move(m_idle_heads.back());
+                m_idle_heads.pop_back();
+            }
+        }
+        if (head) {
+            std::vector<Packet<J> > items;
+            if (m_incoming_queue.try_pop_batch(items, m_executors)) {
+                int n {(int) items.size()};
+                execute(head, std::move(items));
+                m_incoming_buffer_size.remove(n);
+                progress = true;
+            }
+            std::lock_guard<std::mutex> lock(m_heads_mutex);
+            m_idle_heads.push_back(std::move(head));
+        }
+        return collect() || progress;
+    }
+
+    /* Shared mode: the results are sent downstream by one thread at a
+       time, the others leave them to it */
+    bool collect()
+    {
+        bool progress {false};
+        while (!m_collecting.exchange(true)) {
+            std::vector<Packet<J> > items;
+            while (m_outgoing_queue.try_pop_batch(items)) {
+                trace_queue(items, 'f', "outgoing");
+                int n {(int) items.size()};
+                this->submit_batch(PacketBatch<J>{std::move(items)}, "default");
+                m_outgoing_buffer_size.remove(n);
+                items.clear();
+                progress = true;
+            }
+            m_collecting = false;
+            if (m_outgoing_queue.count() == 0) {
+                break;
+            }
+        }
+        return progress;
+    }
+
+    /* Shared mode: a thread which cannot queue a packet (which may be a
+       thread of the scheduler) runs a step itself rather than waiting for
+       the scheduler */
+    void push_shared(Packet<J>&& dta)
+    {
+        while (!m_incoming_queue.try_push(std::move(dta))) {
+            if (!shared_step()) {
+                std::this_thread::yield();
+            }
+        }
+        Scheduler::instance().wake(m_group);
+    }
+
+    void push_result(Packet<J>&& dta)
+    {
+        while (!m_outgoing_queue.try_push(std::move(dta))) {
+            if (!collect()) {
+                std::this_thread::yield();
+            }
+        }
+        Scheduler::instance().wake(m_group);
+    }
+
+    bool find_work(unsigned int index, std::vector<Packet<J> >& items, WorkerCounters& counters)
+    {
+        if (m_worker_queues[index]->try_pop_batch(items, m_executors)) {
+            return true;
+        }
+        size_t n {m_worker_queues.size()};
+        for (size_t i {1}; i < n; i++) {
+            if (m_worker_queues[(index + i) % n]->try_pop_batch(items, 2)) {
+                counters.m_steals.fetch_add(1, std::memory_order_relaxed);
+                counters.m_stolen.fetch_add(items.size(), std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void execute(const std::shared_ptr<BaseModule<J> >& head, std::vector<Packet<J> >&& items)
+    {
+        int n {(int) items.size()};
+        std::vector<uint64_t> traces{trace_queue(items, 'f', "incoming")};
+        uint64_t start{traces.empty() ? 0 : Tracer::now_ns()};
+        if (n == 1) {
+            head->on_incoming_data(std::move(items[0]), "default");
+        } else {
+            head->on_incoming_batch(PacketBatch<J>{std::move(items)}, "default");
+        }
+        if (!traces.empty()) {
+            uint64_t end{Tracer::now_ns()};
+            for (auto trace : traces) {
+                Tracer::instance().span(trace, head->get_module_id(), "module", start, end);
+            }
+        }
+    }
+
+    /* Ordered mode: the position of a packet in the incoming queue is its
+       sequence number. The outputs sent to _join by the worker while it
+       processes a packet are kept in the slot of that packet, until the
+       collector has released all the earlier ones. Contiguous packets
+       taken together are processed as a batch, and their outputs are
+       kept in the slot of the last one */
+    void ordered_executor_fn(std::shared_ptr<BaseModule<J> > head)
     {
+        std::vector<Packet<J> > outputs;
+        ReorderContext& context = reorder_context();
+        context.m_owner = this;
+        context.m_outputs = &outputs;
         for(;;) {
-            Packet<J> du{m_incoming_queue.pop()};
-            head->on_incoming_data(du, "default");
-            m_incoming_buffer_size--;
+            std::vector<Packet<J> > items;
+            std::vector<size_t> sequences;
+            if (!m_incoming_queue.pop_batch(items, sequences, m_executors)) {
+                return;
+            }
+            size_t first{0};
+            while (first < items.size()) {
+                size_t last{first};
+                while (last + 1 < items.size() && sequences[last + 1] == sequences[last] + 1 && last + 1 - first < m_window_size) {
+                    last++;
+                }
+                {
+                    // Keep at most m_window_size packets ahead of the oldest one
+                    std::unique_lock<std::mutex> lock(m_window_mutex);
+                    m_window_room.wait(lock, [&] { return sequences[last] < m_next_release + m_window_size || m_stopping; });
+                    if (m_stopping) {
+                        return;
+                    }
+                }
+                std::vector<Packet<J> > run;
+                run.reserve(last - first + 1);
+                for (size_t i{first}; i <= last; ++i) {
+                    run.push_back(std::move(items[i]));
+                }
+                execute(head, std::move(run));
+                complete(sequences[first], sequences[last], outputs);
+                m_incoming_buffer_size.remove(last - first + 1);
+                first = last + 1;
+            }
         }
     }
 
-    void collector_fn()
+    void complete(size_t first, size_t last, std::vector<Packet<J> >& outputs)
+    {
+        uint64_t now{steady_ns()};
+        bool ready;
+        {
+            std::lock_guard<std::mutex> lock(m_window_mutex);
+            for (size_t seq{first}; seq <= last; ++seq) {
+                ReorderSlot& slot = m_window[seq % m_window_size];
+                slot.m_done = true;
+                slot.m_completed = now;
+            }
+            m_window[last % m_window_size].m_packets.swap(outputs);
+            ready = first == m_next_release;
+        }
+        outputs.clear();
+        if (ready) {
+            m_window_ready.notify_one();
+        }
+    }
+
+    /* Outputs produced by other threads (e.g. by a Buffer or a parallel
+       executor in the template) are not reordered */
+    void reorder(Packet<J>&& dta)
+    {
+        ReorderContext& context = reorder_context();
+        if (context.m_owner == this) {
+            context.m_outputs->push_back(std::move(dta));
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_window_mutex);
+            m_unordered.push_back(std::move(dta));
+        }
+        m_window_ready.notify_one();
+    }
+
+    void ordered_collector_fn()
     {
+        Placement::instance().pin(this->get_module_id() + " collector");
         for(;;) {
-            Packet<J> du{m_outgoing_queue.pop()};
-            this->submit_data(du, "default");
-            m_outgoing_buffer_size--;
+            std::vector<Packet<J> > items;
+            {
+                std::unique_lock<std::mutex> lock(m_window_mutex);
+                m_window_ready.wait(lock, [&] { return m_window[m_next_release % m_window_size].m_done || !m_unordered.empty() || m_stopping; });
+                if (m_stopping) {
+                    return;
+                }
+                items.swap(m_unordered);
+                uint64_t now{steady_ns()};
+                for (;;) {
+                    ReorderSlot& slot = m_window[m_next_release % m_window_size];
+                    if (!slot.m_done) {
+                        break;
+                    }
+                    m_window_stats.count(slot.m_packets.size(), 0, false);
+                    for (auto& dta : slot.m_packets) {
+                        m_window_stats.latency(now - slot.m_completed);
+                        items.push_back(std::move(dta));
+                    }
+                    slot.m_packets.clear();
+                    slot.m_done = false;
+                    m_next_release++;
+                }
+            }
+            m_window_room.notify_all();
+            if (items.empty()) {
+                // the released packets had no output
+                continue;
+            }
+            trace_queue(items, 'f', "outgoing");
+            int n {(int) items.size()};
+            this->submit_batch(PacketBatch<J>{std::move(items)}, "default");
+            m_outgoing_buffer_size.remove(n);
+        }
+    }
+
+    static uint64_t steady_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /* Queue hops of traced packets are recorded as flow events, from the
+       enqueuing thread ('s') to the dequeuing one ('f') */
+    void trace_queue(const Packet<J>& dta, char phase, const char* queue)
+    {
+        if (traced(dta)) {
+            Tracer::instance().event(phase, dta.m_trace, this->m_module_id + " " + queue, "queue");
+        }
+    }
+
+    std::vector<uint64_t> trace_queue(const std::vector<Packet<J> >& items, char phase, const char* queue)
+    {
+        std::vector<uint64_t> traces;
+        for (const auto& dta : items) {
+            if (traced(dta)) {
+                trace_queue(dta, phase, queue);
+                traces.push_back(dta.m_trace);
+            }
+        }
+        return traces;
+    }
+
+    void collector_fn()
+    {
+        Placement::instance().pin(this->get_module_id() + " collector");
+        std::vector<Packet<J> > items;
+        while (m_outgoing_queue.pop_batch(items)) {
+            trace_queue(items, 'f', "outgoing");
+            int n {(int) items.size()};
+            this->submit_batch(PacketBatch<J>{std::move(items)}, "default");
+            m_outgoing_buffer_size.remove(n);
+            items.clear();
         }
     }
 
 private:
-    std::atomic_int m_incoming_buffer_size{0}, m_outgoing_buffer_size{0};
+    struct ReorderSlot {
+        std::vector<Packet<J> > m_packets;
+        bool m_done {false};
+        uint64_t m_completed {0};
+    };
+
+    /* The outputs of the packet being processed by the calling worker */
+    struct ReorderContext {
+        ForkBaseModule* m_owner {nullptr};
+        std::vector<Packet<J> >* m_outputs {nullptr};
+    };
+
+    static ReorderContext& reorder_context()
+    {
+        static thread_local ReorderContext context;
+        return context;
+    }
+
+    InFlightCounter m_incoming_buffer_size, m_outgoing_buffer_size;
+    std::atomic<bool> m_stopping {false};
     int m_thread_limit {-1};
+    bool m_ordered {false};
+    unsigned int m_window_size {1024};
+    std::vector<ReorderSlot> m_window;
+    size_t m_next_release {0};
+    std::vector<Packet<J> > m_unordered;
+    std::mutex m_window_mutex;
+    std::condition_variable m_window_room;
+    std::condition_variable m_window_ready;
+    LinkStats m_window_stats;
+    bool m_work_stealing {false};
+    bool m_partitioned {false};
+    PropertyKey m_partition_key;
+    std::vector<std::unique_ptr<RingBuffer<Packet<J> > > > m_worker_queues;
+    std::vector<std::unique_ptr<WorkerCounters> > m_worker_counters;
+    std::atomic<unsigned int> m_next_worker {0};
+    EventCount m_work_available;
+    unsigned int m_executors {1};
     std::vector<std::thread> m_thread_pool;
-    BoundedBuffer<Packet<J> > m_incoming_queue;
-    BoundedBuffer<Packet<J> > m_outgoing_queue;
+    std::vector<std::shared_ptr<BaseModule<J> > > m_clones;
+    bool m_shared {false};
+    Scheduler::Group* m_group {nullptr};
+    std::vector<std::shared_ptr<BaseModule<J> > > m_idle_heads;
+    std::mutex m_heads_mutex;
+    std::atomic<bool> m_collecting {false};
+    RingBuffer<Packet<J> > m_incoming_queue;
+    RingBuffer<Packet<J> > m_outgoing_queue;
 };
 
 // *********************************************************************
@@ -854,6 +4099,16 @@ public:
     {
         this->submit_data(dta, "_join");
     }
+
+    void on_incoming_data(Packet<J>&& dta, const std::string& channel)
+    {
+        this->submit_data(std::move(dta), "_join");
+    }
+
+    void on_incoming_batch(PacketBatch<J>&& batch, const std::string& channel)
+    {
+        this->submit_batch(std::move(batch), "_join");
+    }
 };
 
 // *********************************************************************
@@ -900,7 +4155,9 @@ struct ModuleFactory {
 #define DEFAULT_DEFINITIONS(thedatatype) \
     using PomaDataType = thedatatype; \
     using PomaModuleType = poma::BaseModule<thedatatype>; \
-    using PomaPacketType = poma::Packet<thedatatype>;
+    using PomaPacketType = poma::Packet<thedatatype>; \
+    using PomaPacketPool = poma::PacketPool<thedatatype>; \
+    using PomaPacketBatch = poma::PacketBatch<thedatatype>;
 
 #define DEFAULT_EXPORT_ALL(themoduletype, themoduledescription, themoduleconstructionparameters, canbesource) \
     struct LocalFactory : public poma::ModuleFactory<PomaModuleType> { \
@@ -0,0 +1,271 @@
+/*
+ * Copyright (C)2015,2016,2017 Amos Brocco (amos.brocco@supsi.ch)
+ *                             Scuola Universitaria Professionale della
+ *                             Svizzera Italiana (SUPSI)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Scuola Universitaria Professionale della Svizzera
+ *       Italiana (SUPSI) nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef POMAPLACEMENT_H
+#define POMAPLACEMENT_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <tuple>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cctype>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+namespace poma {
+
+// *********************************************************************
+// THREAD PLACEMENT
+// *********************************************************************
+//
+// The threads started by the runtime (parallel executor workers and
+// collectors, Buffer collectors, ParProcessor sources, the threads of the
+// shared scheduler) take the next CPU of a list built from the topology
+// in sysfs, and are pinned to it:
+//   compact  hardware threads of the same core, then of the same package
+//            and node, are used one after the other
+//   scatter  consecutive threads go to different nodes, and to different
+//            cores of a node before sharing one
+// An explicit list of CPUs ("0-3,8") restricts the CPUs used by a policy,
+// or is used in the given order when no policy is set. Without a policy
+// threads are left to the operating system.
+
+class Placement {
+public:
+    struct Cpu {
+        int m_id;
+        int m_node;
+        int m_package;
+        int m_core;
+        int m_sibling;  // rank among the hardware threads of the core
+    };
+
+    static Placement& instance()
+    {
+        static Placement placement;
+        return placement;
+    }
+
+    /* Parses a CPU list, as found in sysfs ("0-3,8-11") */
+    static std::vector<int> parse_cpus(const std::string& list)
+    {
+        std::vector<int> cpus;
+        std::stringstream ss{list};
+        std::string range;
+        while (std::getline(ss, range, ',')) {
+            range.erase(std::remove_if(range.begin(), range.end(), ::isspace), range.end());
+            if (range.empty()) {
+                continue;
+            }
+            try {
+                size_t dash {range.find('-')};
+                int first {std::stoi(range.substr(0, dash))};
+                int last {dash == std::string::npos ? first : std::stoi(range.substr(dash + 1))};
+                for (int cpu {first}; cpu <= last; cpu++) {
+                    cpus.push_back(cpu);
+                }
+            } catch (const std::logic_error&) {
+                throw std::runtime_error("Invalid CPU list: " + list);
+            }
+        }
+        return cpus;
+    }
+
+    /* Reads the CPUs the process may run on, with their node and core */
+    static std::vector<Cpu> topology()
+    {
+        std::vector<int> online {parse_cpus(read_line("/sys/devices/system/cpu/online"))};
+        std::map<int, int> nodes;
+        if (DIR* dir = opendir("/sys/devices/system/node")) {
+            while (struct dirent* entry = readdir(dir)) {
+                std::string name {entry->d_name};
+                if (name.compare(0, 4, "node") != 0 || name.size() == 4 || !std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+                    continue;
+                }
+                for (int cpu : parse_cpus(read_line("/sys/devices/system/node/" + name + "/cpulist"))) {
+                    nodes[cpu] = std::stoi(name.substr(4));
+                }
+            }
+            closedir(dir);
+        }
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            for (int cpu : online) {
+                CPU_SET(cpu, &allowed);
+            }
+        }
+        std::vector<Cpu> cpus;
+        for (int id : online) {
+            if (id >= CPU_SETSIZE || !CPU_ISSET(id, &allowed)) {
+                continue;
+            }
+            std::string topology {"/sys/devices/system/cpu/cpu" + std::to_string(id) + "/topology/"};
+            Cpu cpu {id, nodes.count(id) ? nodes[id] : 0, read_int(topology + "physical_package_id", 0), read_int(topology + "core_id", id), 0};
+            for (const auto& c : cpus) {
+                if (c.m_package == cpu.m_package && c.m_core == cpu.m_core) {
+                    cpu.m_sibling++;
+                }
+            }
+            cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+    /* Policies: none, compact or scatter; cpus is an optional CPU list */
+    void configure(const std::string& policy, const std::string& cpus)
+    {
+        std::vector<Cpu> available {topology()};
+        if (!cpus.empty()) {
+            std::vector<Cpu> selected;
+            for (int id : parse_cpus(cpus)) {
+                auto it = std::find_if(available.begin(), available.end(), [id](const Cpu& c) { return c.m_id == id; });
+                if (it == available.end()) {
+                    throw std::runtime_error("CPU " + std::to_string(id) + " is not available for thread placement");
+                }
+                selected.push_back(*it);
+            }
+            available.swap(selected);
+        }
+        if (policy == "compact") {
+            std::sort(available.begin(), available.end(), [](const Cpu& a, const Cpu& b) {
+                return std::make_tuple(a.m_node, a.m_package, a.m_core, a.m_sibling) < std::make_tuple(b.m_node, b.m_package, b.m_core, b.m_sibling);
+            });
+        } else if (policy == "scatter") {
+            std::map<int, std::vector<Cpu> > by_node;
+            for (const auto& c : available) {
+                by_node[c.m_node].push_back(c);
+            }
+            available.clear();
+            for (auto& n : by_node) {
+                std::sort(n.second.begin(), n.second.end(), [](const Cpu& a, const Cpu& b) {
+                    return std::make_tuple(a.m_sibling, a.m_package, a.m_core) < std::make_tuple(b.m_sibling, b.m_package, b.m_core);
+                });
+            }
+            for (size_t i {0};; i++) {
+                size_t added {0};
+                for (auto& n : by_node) {
+                    if (i < n.second.size()) {
+                        available.push_back(n.second[i]);
+                        added++;
+                    }
+                }
+                if (added == 0) {
+                    break;
+                }
+            }
+        } else if (policy == "none" || policy.empty()) {
+            if (cpus.empty()) {
+                available.clear();
+            }
+        } else {
+            throw std::runtime_error("Invalid thread placement policy: " + policy);
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cpus.swap(available);
+        m_next = 0;
+        if (m_cpus.empty()) {
+            return;
+        }
+        std::set<int> used_nodes;
+        for (const auto& c : m_cpus) {
+            used_nodes.insert(c.m_node);
+        }
+        std::cerr << "Thread placement: " << (policy.empty() || policy == "none" ? "explicit" : policy) << ", " << m_cpus.size() << " CPUs on " << used_nodes.size() << " nodes, order";
+        for (const auto& c : m_cpus) {
+            std::cerr << " " << c.m_id;
+        }
+        std::cerr << std::endl;
+    }
+
+    bool enabled()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return !m_cpus.empty();
+    }
+
+    /* Pins the calling thread to the next CPU, returns the CPU (or -1) */
+    int pin(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_cpus.empty()) {
+            return -1;
+        }
+        const Cpu& cpu = m_cpus[m_next++ % m_cpus.size()];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu.m_id, &set);
+        int rc {pthread_setaffinity_np(pthread_self(), sizeof(set), &set)};
+        if (rc != 0) {
+            std::cerr << "Thread placement: cannot pin " << name << " to CPU " << cpu.m_id << ": " << strerror(rc) << std::endl;
+            return -1;
+        }
+        std::cerr << "Thread placement: " << name << " on CPU " << cpu.m_id << " (node " << cpu.m_node << ")" << std::endl;
+        return cpu.m_id;
+    }
+
+private:
+    Placement() {}
+
+    static std::string read_line(const std::string& path)
+    {
+        std::ifstream in{path};
+        std::string line;
+        std::getline(in, line);
+        return line;
+    }
+
+    static int read_int(const std::string& path, int fallback)
+    {
+        std::string line {read_line(path)};
+        try {
+            return line.empty() ? fallback : std::stoi(line);
+        } catch (const std::logic_error&) {
+            return fallback;
+        }
+    }
+
+    std::mutex m_mutex;
+    std::vector<Cpu> m_cpus;
+    size_t m_next {0};
+};
+
+}
+
+#endif
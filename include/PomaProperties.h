@@ -0,0 +1,871 @@
+/*
+ * Copyright (C)2015,2016,2017 Amos Brocco (amos.brocco@supsi.ch)
+ *                             Scuola Universitaria Professionale della
+ *                             Svizzera Italiana (SUPSI)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Scuola Universitaria Professionale della Svizzera
+ *       Italiana (SUPSI) nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef POMAPROPERTIES_H
+#define POMAPROPERTIES_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <boost/optional.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+namespace poma {
+
+// *********************************************************************
+// NAME REGISTRIES
+// *********************************************************************
+
+/* Process-wide interning of names (one registry per Tag) into dense
+   integer identifiers. Lookups are served from per-thread caches, the
+   shared tables are only locked the first time a thread sees a name */
+template<typename Tag>
+class NameRegistry {
+public:
+    static NameRegistry& instance()
+    {
+        static NameRegistry registry;
+        return registry;
+    }
+
+    uint32_t intern(const std::string& key)
+    {
+        std::unordered_map<std::string, uint32_t>& cache{local_ids()};
+        auto it = cache.find(key);
+        if (it != cache.end()) {
+            return it->second;
+        }
+        uint32_t id;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            auto git = m_ids.find(key);
+            if (git == m_ids.end()) {
+                id = (uint32_t) m_names.size();
+                m_names.push_back(key);
+                m_ids.emplace(key, id);
+            } else {
+                id = git->second;
+            }
+        }
+        cache.emplace(key, id);
+        return id;
+    }
+
+    /* Identifier of a name that was already interned: unlike intern, never
+       adds the name, so that it can be used with names taken from packets */
+    bool find(const std::string& key, uint32_t& id)
+    {
+        std::unordered_map<std::string, uint32_t>& cache{local_ids()};
+        auto it = cache.find(key);
+        if (it != cache.end()) {
+            id = it->second;
+            return true;
+        }
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            auto git = m_ids.find(key);
+            if (git == m_ids.end()) {
+                return false;
+            }
+            id = git->second;
+        }
+        cache.emplace(key, id);
+        return true;
+    }
+
+    const std::string& name(uint32_t id)
+    {
+        static thread_local std::vector<const std::string*> cache;
+        if (id < cache.size() && cache[id] != nullptr) {
+            return *cache[id];
+        }
+        const std::string* name;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (id >= m_names.size()) {
+                throw std::out_of_range{std::string{"invalid "} + Tag::description() + " identifier"};
+            }
+            // deque elements never move, the pointer stays valid
+            name = &m_names[id];
+        }
+        if (cache.size() <= id) {
+            cache.resize(id + 1, nullptr);
+        }
+        cache[id] = name;
+        return *name;
+    }
+
+private:
+    NameRegistry() = default;
+    NameRegistry(const NameRegistry&) = delete;
+
+    /* Per thread cache of the registry, holds interned names only */
+    static std::unordered_map<std::string, uint32_t>& local_ids()
+    {
+        static thread_local std::unordered_map<std::string, uint32_t> cache;
+        return cache;
+    }
+
+    std::mutex m_mutex;
+    std::unordered_map<std::string, uint32_t> m_ids;
+    std::deque<std::string> m_names;
+};
+
+/* Metadata keys: full dotted paths */
+struct MetadataKeys {
+    static const char* description()
+    {
+        return "metadata key";
+    }
+};
+
+typedef NameRegistry<MetadataKeys> KeyRegistry;
+
+/* Handle to a metadata key, resolved once (typically in process_cli)
+   and then used for lookups that involve no hashing or path parsing */
+class PropertyKey {
+public:
+    PropertyKey() = default;
+
+    PropertyKey(const std::string& path) : m_id{KeyRegistry::instance().intern(path)} {}
+
+    PropertyKey(const char* path) : m_id{KeyRegistry::instance().intern(path)} {}
+
+    uint32_t id() const
+    {
+        return m_id;
+    }
+
+    bool valid() const
+    {
+        return m_id != INVALID;
+    }
+
+    const std::string& path() const
+    {
+        return KeyRegistry::instance().name(m_id);
+    }
+
+    bool operator==(const PropertyKey& o) const
+    {
+        return m_id == o.m_id;
+    }
+
+private:
+    static const uint32_t INVALID {0xFFFFFFFF};
+    uint32_t m_id {INVALID};
+};
+
+// *********************************************************************
+// TYPED METADATA VALUE
+// *********************************************************************
+class PropertyValue {
+public:
+    enum class Type : unsigned char {
+        EMPTY, INT, DOUBLE, BOOL, STRING, NESTED
+    };
+
+    PropertyValue() = default;
+
+    Type type() const
+    {
+        return m_type;
+    }
+
+    int64_t int_value() const
+    {
+        return m_int;
+    }
+
+    double double_value() const
+    {
+        return m_double;
+    }
+
+    bool bool_value() const
+    {
+        return m_bool;
+    }
+
+    const std::string& string_value() const
+    {
+        return m_string;
+    }
+
+    const boost::property_tree::ptree& nested_value() const
+    {
+        return *m_nested;
+    }
+
+    void set_empty()
+    {
+        m_type = Type::EMPTY;
+        m_string.clear();
+        m_nested.reset();
+    }
+
+    void set_int(int64_t value)
+    {
+        set_empty();
+        m_type = Type::INT;
+        m_int = value;
+    }
+
+    void set_double(double value)
+    {
+        set_empty();
+        m_type = Type::DOUBLE;
+        m_double = value;
+    }
+
+    void set_bool(bool value)
+    {
+        set_empty();
+        m_type = Type::BOOL;
+        m_bool = value;
+    }
+
+    void set_string(const std::string& value)
+    {
+        m_nested.reset();
+        m_type = Type::STRING;
+        m_string = value;
+    }
+
+    void set_string(std::string&& value)
+    {
+        m_nested.reset();
+        m_type = Type::STRING;
+        m_string = std::move(value);
+    }
+
+    template<typename Iterator>
+    void set_string(Iterator first, Iterator last)
+    {
+        m_nested.reset();
+        m_type = Type::STRING;
+        m_string.assign(first, last);
+    }
+
+    /* Subtrees that have no flat representation (arrays, duplicate keys) */
+    void set_nested(const boost::property_tree::ptree& value)
+    {
+        set_empty();
+        m_type = Type::NESTED;
+        m_nested = std::make_shared<const boost::property_tree::ptree>(value);
+    }
+
+    /* Text form, as boost::property_tree would store the value */
+    std::string to_string() const
+    {
+        switch (m_type) {
+        case Type::INT:
+            return std::to_string(m_int);
+        case Type::DOUBLE:
+            return *translator<double>().put_value(m_double);
+        case Type::BOOL:
+            return m_bool ? "true" : "false";
+        case Type::STRING:
+            return m_string;
+        case Type::NESTED:
+            return m_nested->data();
+        default:
+            return std::string{};
+        }
+    }
+
+    /* Conversions follow boost::property_tree rules, but typed values
+       are converted without going through their text form */
+    bool as(std::string& out) const
+    {
+        out = to_string();
+        return true;
+    }
+
+    bool as(bool& out) const
+    {
+        switch (m_type) {
+        case Type::BOOL:
+            out = m_bool;
+            return true;
+        case Type::INT:
+            if (m_int == 0 || m_int == 1) {
+                out = m_int == 1;
+                return true;
+            }
+            return false;
+        case Type::STRING:
+            return parse(m_string, out);
+        default:
+            return parse(to_string(), out);
+        }
+    }
+
+    template<typename T>
+    typename std::enable_if<std::is_arithmetic<T>::value, bool>::type as(T& out) const
+    {
+        switch (m_type) {
+        case Type::INT:
+            return convert_number(m_int, out);
+        case Type::DOUBLE:
+            return convert_number(m_double, out);
+        case Type::BOOL:
+            return false;
+        case Type::STRING:
+            return parse(m_string, out);
+        default:
+            return parse(to_string(), out);
+        }
+    }
+
+    template<typename T>
+    typename std::enable_if<!std::is_arithmetic<T>::value, bool>::type as(T& out) const
+    {
+        return parse(to_string(), out);
+    }
+
+    bool operator==(const PropertyValue& o) const
+    {
+        if (m_type != o.m_type) return false;
+        switch (m_type) {
+        case Type::INT:
+            return m_int == o.m_int;
+        case Type::DOUBLE:
+            return m_double == o.m_double;
+        case Type::BOOL:
+            return m_bool == o.m_bool;
+        case Type::STRING:
+            return m_string == o.m_string;
+        case Type::NESTED:
+            return *m_nested == *o.m_nested;
+        default:
+            return true;
+        }
+    }
+
+private:
+    template<typename T>
+    static typename boost::property_tree::translator_between<std::string, T>::type translator()
+    {
+        return typename boost::property_tree::translator_between<std::string, T>::type{};
+    }
+
+    template<typename T>
+    static bool parse(const std::string& text, T& out)
+    {
+        boost::optional<T> value{translator<T>().get_value(text)};
+        if (value) {
+            out = *value;
+            return true;
+        }
+        return false;
+    }
+
+    static bool parse(const std::string& text, std::string& out)
+    {
+        out = text;
+        return true;
+    }
+
+    template<typename S, typename T>
+    static typename std::enable_if<std::is_integral<T>::value, bool>::type convert_number(S value, T& out)
+    {
+        // Same outcome as parsing the text form: fractional or out of range values fail
+        if (std::is_floating_point<S>::value && std::trunc((double) value) != (double) value) return false;
+        if ((long double) value < (long double) std::numeric_limits<T>::lowest()) return false;
+        if ((long double) value > (long double) std::numeric_limits<T>::max()) return false;
+        out = (T) value;
+        return true;
+    }
+
+    template<typename S, typename T>
+    static typename std::enable_if<std::is_floating_point<T>::value, bool>::type convert_number(S value, T& out)
+    {
+        out = (T) value;
+        return true;
+    }
+
+    Type m_type {Type::EMPTY};
+    union {
+        int64_t m_int{0};
+        double m_double;
+        bool m_bool;
+    };
+    std::string m_string;
+    std::shared_ptr<const boost::property_tree::ptree> m_nested;
+};
+
+// *********************************************************************
+// FLAT METADATA STORE
+// *********************************************************************
+
+/* Packet metadata: a small contiguous vector of typed values keyed by
+   interned key identifiers. Dotted paths ("color.red") are keys on their
+   own, so no tree is walked on access. The interface mirrors the parts
+   of boost::property_tree::ptree used by modules (put, get, get_optional,
+   get_child, put_child), to_ptree/from_ptree convert from and to a tree.
+   Accessors take a PropertyKey: plain paths are resolved on each call,
+   modules should resolve the keys they use once.
+   Cleared entries are kept (with the capacity of their strings) and are
+   reused by the next insertions: a recycled store does not allocate
+   again for metadata of similar shape (see PacketPool) */
+class Properties {
+public:
+    struct Entry {
+        uint32_t m_key;
+        PropertyValue m_value;
+
+        const std::string& name() const
+        {
+            return KeyRegistry::instance().name(m_key);
+        }
+    };
+
+    typedef std::vector<Entry>::const_iterator const_iterator;
+
+    /* Decodes the deferred encoding of a lazily decoded instance */
+    typedef void (*Decoder)(Properties& properties, const std::string& encoded, const std::vector<uint32_t>& keys);
+
+    Properties() = default;
+
+    explicit Properties(const boost::property_tree::ptree& pt)
+    {
+        from_ptree(pt);
+    }
+
+    /* Copies only hold the live entries (or the deferred encoding) */
+    Properties(const Properties& o) : m_entries(o.m_entries.begin(), o.m_entries.begin() + o.m_size), m_size{o.m_size},
+        m_encoded(o.m_encoded), m_encoded_keys(o.m_encoded_keys), m_decoder{o.m_decoder} {}
+
+    Properties(Properties&& o) noexcept : m_entries(std::move(o.m_entries)), m_size{o.m_size},
+        m_encoded(std::move(o.m_encoded)), m_encoded_keys(std::move(o.m_encoded_keys)), m_decoder{o.m_decoder}
+    {
+        o.m_entries.clear();
+        o.m_size = 0;
+        o.m_decoder = nullptr;
+    }
+
+    Properties& operator=(const Properties& o)
+    {
+        if (this != &o) {
+            clear();
+            for (size_t i{0}; i < o.m_size; ++i) {
+                slot_for_new(o.m_entries[i].m_key) = o.m_entries[i].m_value;
+            }
+            if (o.m_decoder != nullptr) {
+                m_encoded = o.m_encoded;
+                m_encoded_keys = o.m_encoded_keys;
+                m_decoder = o.m_decoder;
+            }
+        }
+        return *this;
+    }
+
+    Properties& operator=(Properties&& o) noexcept
+    {
+        m_entries.swap(o.m_entries);
+        std::swap(m_size, o.m_size);
+        m_encoded.swap(o.m_encoded);
+        m_encoded_keys.swap(o.m_encoded_keys);
+        std::swap(m_decoder, o.m_decoder);
+        o.clear();
+        return *this;
+    }
+
+    /* Lazy decoding: encoded holds the entries, keys their (already
+       resolved) identifiers. The entries are decoded the first time the
+       instance is accessed */
+    void defer(std::string&& encoded, Decoder decoder)
+    {
+        clear();
+        m_encoded.swap(encoded);
+        m_decoder = decoder;
+    }
+
+    /* Key identifiers of the deferred encoding, to be filled by the caller of defer */
+    std::vector<uint32_t>& deferred_keys()
+    {
+        return m_encoded_keys;
+    }
+
+    bool deferred() const
+    {
+        return m_decoder != nullptr;
+    }
+
+    const std::string& deferred_encoding() const
+    {
+        return m_encoded;
+    }
+
+    void materialize() const
+    {
+        if (m_decoder != nullptr) {
+            Decoder decoder{m_decoder};
+            m_decoder = nullptr;
+            // instances are only deferred through the non const interface
+            decoder(const_cast<Properties&>(*this), m_encoded, m_encoded_keys);
+        }
+    }
+
+    /* Key identifier based access */
+    const PropertyValue* find(uint32_t key) const
+    {
+        materialize();
+        for (size_t i{0}; i < m_size; ++i) {
+            if (m_entries[i].m_key == key) {
+                return &m_entries[i].m_value;
+            }
+        }
+        return nullptr;
+    }
+
+    PropertyValue& slot(uint32_t key)
+    {
+        materialize();
+        for (size_t i{0}; i < m_size; ++i) {
+            if (m_entries[i].m_key == key) {
+                return m_entries[i].m_value;
+            }
+        }
+        return slot_for_new(key);
+    }
+
+    /* Path based access (ptree compatible) */
+    template<typename V>
+    void put(const PropertyKey& key, const V& value)
+    {
+        assign(slot(key.id()), value);
+    }
+
+    template<typename T>
+    T get(const PropertyKey& key) const
+    {
+        const PropertyValue* v{find(key.id())};
+        if (v == nullptr) {
+            throw boost::property_tree::ptree_bad_path{"No such node", boost::property_tree::ptree::path_type{key.valid() ? key.path() : ""}};
+        }
+        T result;
+        if (!v->as(result)) {
+            throw boost::property_tree::ptree_bad_data{"conversion of data failed", v->to_string()};
+        }
+        return result;
+    }
+
+    template<typename T>
+    T get(const PropertyKey& key, const T& default_value) const
+    {
+        const PropertyValue* v{find(key.id())};
+        T result;
+        if (v != nullptr && v->as(result)) {
+            return result;
+        }
+        return default_value;
+    }
+
+    std::string get(const PropertyKey& key, const char* default_value) const
+    {
+        return get<std::string>(key, std::string{default_value});
+    }
+
+    template<typename T>
+    boost::optional<T> get_optional(const PropertyKey& key) const
+    {
+        const PropertyValue* v{find(key.id())};
+        T result;
+        if (v != nullptr && v->as(result)) {
+            return result;
+        }
+        return boost::none;
+    }
+
+    bool has(const PropertyKey& key) const
+    {
+        return find(key.id()) != nullptr;
+    }
+
+    /* Removes path and every key below it */
+    void erase(const std::string& path)
+    {
+        materialize();
+        std::string prefix{path + "."};
+        // removed entries are moved past the live ones, and kept for reuse
+        auto live_end = std::stable_partition(m_entries.begin(), m_entries.begin() + m_size, [&](const Entry& e) {
+            const std::string& name{e.name()};
+            return !(name == path || name.compare(0, prefix.size(), prefix) == 0);
+        });
+        m_size = live_end - m_entries.begin();
+    }
+
+    /* Subtree as a property tree (slow path) */
+    boost::property_tree::ptree get_child(const std::string& path) const
+    {
+        boost::property_tree::ptree result;
+        bool found{false};
+        std::string prefix{path + "."};
+        for (const auto& e : *this) {
+            const std::string& name{e.name()};
+            if (name == path) {
+                found = true;
+                if (e.m_value.type() == PropertyValue::Type::NESTED) {
+                    result = e.m_value.nested_value();
+                } else {
+                    result.data() = e.m_value.to_string();
+                }
+            } else if (name.compare(0, prefix.size(), prefix) == 0) {
+                found = true;
+                add_to_ptree(result, name.substr(prefix.size()), e.m_value);
+            }
+        }
+        if (!found) {
+            throw boost::property_tree::ptree_bad_path{"No such node", boost::property_tree::ptree::path_type{path}};
+        }
+        return result;
+    }
+
+    void put_child(const std::string& path, const boost::property_tree::ptree& child)
+    {
+        erase(path);
+        load(child, path);
+    }
+
+    size_t size() const
+    {
+        materialize();
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    void clear()
+    {
+        m_size = 0;
+        m_decoder = nullptr;
+    }
+
+    /* Releases the memory held by cleared entries */
+    void shrink()
+    {
+        materialize();
+        m_entries.erase(m_entries.begin() + m_size, m_entries.end());
+        m_entries.shrink_to_fit();
+        m_encoded.clear();
+        m_encoded.shrink_to_fit();
+        m_encoded_keys.clear();
+        m_encoded_keys.shrink_to_fit();
+    }
+
+    const_iterator begin() const
+    {
+        materialize();
+        return m_entries.begin();
+    }
+
+    const_iterator end() const
+    {
+        materialize();
+        return m_entries.begin() + m_size;
+    }
+
+    boost::property_tree::ptree to_ptree() const
+    {
+        boost::property_tree::ptree result;
+        for (const auto& e : *this) {
+            add_to_ptree(result, e.name(), e.m_value);
+        }
+        return result;
+    }
+
+    void from_ptree(const boost::property_tree::ptree& pt)
+    {
+        clear();
+        load(pt, "");
+    }
+
+    /* Same keys with the same values, regardless of insertion order */
+    bool operator==(const Properties& o) const
+    {
+        if (size() != o.size()) return false;
+        for (const auto& e : *this) {
+            const PropertyValue* v{o.find(e.m_key)};
+            if (v == nullptr || !(*v == e.m_value)) return false;
+        }
+        return true;
+    }
+
+    bool operator!=(const Properties& o) const
+    {
+        return !(*this == o);
+    }
+
+    static uint32_t intern(const std::string& path)
+    {
+        return KeyRegistry::instance().intern(path);
+    }
+
+private:
+    PropertyValue& slot_for_new(uint32_t key)
+    {
+        if (m_size < m_entries.size()) {
+            Entry& e = m_entries[m_size++];
+            e.m_key = key;
+            e.m_value.set_empty();
+            return e.m_value;
+        }
+        if (m_entries.capacity() == 0) {
+            m_entries.reserve(8);
+        }
+        m_entries.push_back(Entry{key, PropertyValue{}});
+        m_size++;
+        return m_entries.back().m_value;
+    }
+
+    static void assign(PropertyValue& slot, bool value)
+    {
+        slot.set_bool(value);
+    }
+
+    static void assign(PropertyValue& slot, char value)
+    {
+        slot.set_string(std::string(1, value));
+    }
+
+    static void assign(PropertyValue& slot, const char* value)
+    {
+        slot.set_string(std::string{value});
+    }
+
+    static void assign(PropertyValue& slot, const std::string& value)
+    {
+        slot.set_string(value);
+    }
+
+    template<typename V>
+    static typename std::enable_if<std::is_integral<V>::value && std::is_signed<V>::value>::type assign(PropertyValue& slot, V value)
+    {
+        slot.set_int(value);
+    }
+
+    template<typename V>
+    static typename std::enable_if<std::is_integral<V>::value && !std::is_signed<V>::value>::type assign(PropertyValue& slot, V value)
+    {
+        if ((uint64_t) value <= (uint64_t) std::numeric_limits<int64_t>::max()) {
+            slot.set_int((int64_t) value);
+        } else {
+            slot.set_string(std::to_string(value));
+        }
+    }
+
+    template<typename V>
+    static typename std::enable_if<std::is_floating_point<V>::value>::type assign(PropertyValue& slot, V value)
+    {
+        slot.set_double(value);
+    }
+
+    template<typename V>
+    static typename std::enable_if<!std::is_arithmetic<V>::value && !std::is_convertible<V, std::string>::value>::type assign(PropertyValue& slot, const V& value)
+    {
+        typename boost::property_tree::translator_between<std::string, V>::type tr;
+        slot.set_string(*tr.put_value(value));
+    }
+
+    template<typename V>
+    static typename std::enable_if<!std::is_arithmetic<V>::value && std::is_convertible<V, std::string>::value
+    && !std::is_same<V, std::string>::value>::type assign(PropertyValue& slot, const V& value)
+    {
+        slot.set_string(std::string(value));
+    }
+
+    static void add_to_ptree(boost::property_tree::ptree& pt, const std::string& path, const PropertyValue& value)
+    {
+        if (value.type() == PropertyValue::Type::NESTED) {
+            if (path.empty()) {
+                for (const auto& kv : value.nested_value()) {
+                    pt.push_back(kv);
+                }
+            } else {
+                pt.put_child(path, value.nested_value());
+            }
+        } else {
+            pt.put(path, value.to_string());
+        }
+    }
+
+    /* Subtrees with empty, dotted or duplicate keys (e.g. JSON arrays)
+       cannot be flattened into paths and are kept as nested values */
+    static bool is_flat(const boost::property_tree::ptree& pt)
+    {
+        std::vector<const std::string*> keys;
+        for (const auto& kv : pt) {
+            if (kv.first.empty() || kv.first.find('.') != std::string::npos) return false;
+            for (auto k : keys) {
+                if (*k == kv.first) return false;
+            }
+            keys.push_back(&kv.first);
+        }
+        return true;
+    }
+
+    void load(const boost::property_tree::ptree& pt, const std::string& prefix)
+    {
+        if (!is_flat(pt)) {
+            slot(intern(prefix)).set_nested(pt);
+            return;
+        }
+        if (!prefix.empty() && (!pt.data().empty() || pt.empty())) {
+            slot(intern(prefix)).set_string(pt.data());
+        }
+        for (const auto& kv : pt) {
+            load(kv.second, prefix.empty() ? kv.first : prefix + "." + kv.first);
+        }
+    }
+
+    std::vector<Entry> m_entries;
+    size_t m_size {0};
+    // deferred encoding (see defer), kept for reuse once decoded
+    std::string m_encoded;
+    std::vector<uint32_t> m_encoded_keys;
+    mutable Decoder m_decoder {nullptr};
+};
+
+}
+
+#endif
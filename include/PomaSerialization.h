@@ -0,0 +1,863 @@
+/*
+ * Copyright (C)2015,2016,2017 Amos Brocco (amos.brocco@supsi.ch)
+ *                             Scuola Universitaria Professionale della
+ *                             Svizzera Italiana (SUPSI)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Scuola Universitaria Professionale della Svizzera
+ *       Italiana (SUPSI) nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef POMASERIALIZATION_H
+#define POMASERIALIZATION_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <stdexcept>
+#include <random>
+#include <cstdint>
+#include <cstring>
+#include <boost/property_tree/ptree.hpp>
+#include "PomaProperties.h"
+
+namespace poma {
+
+// *********************************************************************
+// BINARY METADATA ENCODING
+// *********************************************************************
+//
+// Layout of a binary encoded packet (all varints are LEB128):
+//
+//   0xB1 'P' 'M' <version>        magic and format version
+//   varint session                key dictionary session (0 = none)
+//   varint base                   dictionary size assumed by the sender
+//   uint64 (little endian)        length of the metadata section
+//   varint count                  number of metadata entries
+//   <key> <value> ...             one pair per entry
+//   <payload>                     user data, as written by Serializable
+//
+// Keys are full paths, sent either as a dictionary reference or as a
+// literal string. Values start with a type byte; nested values (arrays)
+// are encoded as trees: <value> varint(children) <key> <node> ...
+// Version 1 packets (a single root node) are still accepted.
+
+const unsigned char BINARY_ENCODING_VERSION {2};
+
+enum class Encoding {
+    JSON, BINARY
+};
+
+class DictionaryMismatch : public std::runtime_error {
+public:
+    DictionaryMismatch(const std::string& msg) : std::runtime_error{msg} {}
+};
+
+/* Per-connection key dictionary: both endpoints of a connection keep one
+   instance, keys are sent in full only the first time they are seen.
+   Connection identifiers are mapped to process-wide key identifiers
+   (see KeyRegistry), so no string is hashed on the hot path */
+class MetadataDictionary {
+public:
+    MetadataDictionary(unsigned int max_keys = 4096) : m_max_keys{max_keys}
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        static thread_local std::mt19937_64 generator{std::random_device{}()};
+        m_ids.clear();
+        m_keys.clear();
+        do {
+            m_session = generator();
+        } while (m_session == 0);
+    }
+
+    void reset(uint64_t session)
+    {
+        m_ids.clear();
+        m_keys.clear();
+        m_session = session;
+    }
+
+    uint64_t session() const
+    {
+        return m_session;
+    }
+
+    size_t size() const
+    {
+        return m_keys.size();
+    }
+
+    bool full() const
+    {
+        return m_keys.size() >= m_max_keys;
+    }
+
+    /* Returns the connection identifier of key, or -1 if the key is not known */
+    long find(uint32_t key) const
+    {
+        return key < m_ids.size() ? m_ids[key] : -1;
+    }
+
+    void add(uint32_t key)
+    {
+        if (m_ids.size() <= key) {
+            m_ids.resize(key + 1, -1);
+        }
+        m_ids[key] = (long) m_keys.size();
+        m_keys.push_back(key);
+    }
+
+    uint32_t key(uint64_t id) const
+    {
+        if (id >= m_keys.size()) {
+            throw DictionaryMismatch{"unknown metadata key identifier"};
+        }
+        return m_keys[id];
+    }
+
+private:
+    uint64_t m_session{0};
+    unsigned int m_max_keys;
+    std::vector<long> m_ids;
+    std::vector<uint32_t> m_keys;
+};
+
+/* Receiver side: one dictionary per remote session */
+class MetadataDictionaries {
+public:
+    MetadataDictionaries(unsigned int max_sessions = 256) : m_max_sessions{max_sessions} {}
+
+    MetadataDictionary& session(uint64_t id)
+    {
+        auto it = m_sessions.find(id);
+        if (it == m_sessions.end()) {
+            if (m_sessions.size() >= m_max_sessions) {
+                // Evicted senders will be asked to resynchronize
+                m_sessions.clear();
+            }
+            it = m_sessions.emplace(id, MetadataDictionary{}).first;
+            it->second.reset(id);
+        }
+        return it->second;
+    }
+
+    void drop(uint64_t id)
+    {
+        m_sessions.erase(id);
+    }
+
+private:
+    unsigned int m_max_sessions;
+    std::unordered_map<uint64_t, MetadataDictionary> m_sessions;
+};
+
+// *********************************************************************
+// SEGMENTED (SCATTER-GATHER) OUTPUT
+// *********************************************************************
+
+/* Serialized packet as a list of buffers (header, metadata, one per
+   payload field), sent as they are without being joined. Segments are
+   either owned by the list or views of memory owned by someone else,
+   which must stay valid until the segments are sent */
+class Segments {
+public:
+    /* Appends an empty owned segment, the reference stays valid */
+    std::string& add()
+    {
+        m_segments.emplace_back();
+        return m_segments.back().m_owned;
+    }
+
+    void add(std::string&& data)
+    {
+        add() = std::move(data);
+    }
+
+    void add_view(const char* data, size_t size)
+    {
+        m_segments.emplace_back();
+        m_segments.back().m_view = data;
+        m_segments.back().m_view_size = size;
+    }
+
+    size_t size() const
+    {
+        return m_segments.size();
+    }
+
+    bool empty() const
+    {
+        return m_segments.empty();
+    }
+
+    bool is_view(size_t i) const
+    {
+        return m_segments[i].m_view != nullptr;
+    }
+
+    const char* data(size_t i) const
+    {
+        return is_view(i) ? m_segments[i].m_view : m_segments[i].m_owned.data();
+    }
+
+    size_t length(size_t i) const
+    {
+        return is_view(i) ? m_segments[i].m_view_size : m_segments[i].m_owned.size();
+    }
+
+    /* Moves an owned segment out of the list */
+    std::string take(size_t i)
+    {
+        return std::move(m_segments[i].m_owned);
+    }
+
+    size_t total_size() const
+    {
+        size_t total{0};
+        for (size_t i{0}; i < size(); ++i) {
+            total += length(i);
+        }
+        return total;
+    }
+
+    /* Contiguous copy, same bytes as the single string serialization */
+    void flatten(std::string& output) const
+    {
+        output.reserve(output.size() + total_size());
+        for (size_t i{0}; i < size(); ++i) {
+            output.append(data(i), length(i));
+        }
+    }
+
+    void clear()
+    {
+        m_segments.clear();
+    }
+
+private:
+    struct Segment {
+        std::string m_owned;
+        const char* m_view{nullptr};
+        size_t m_view_size{0};
+    };
+
+    // deque: references returned by add() are not invalidated
+    std::deque<Segment> m_segments;
+};
+
+namespace codec {
+
+enum : unsigned char {
+    VALUE_EMPTY = 0, VALUE_STRING = 1, VALUE_INT = 2, VALUE_FALSE = 3, VALUE_TRUE = 4,
+    VALUE_DOUBLE = 5, VALUE_NESTED = 6
+};
+
+enum : unsigned char {
+    KEY_REFERENCE = 0, KEY_REGISTER = 1, KEY_LITERAL = 2
+};
+
+const size_t HEADER_MAGIC_SIZE {4};
+const size_t METADATA_LENGTH_SIZE {8};
+
+inline void write_varint(std::string& out, uint64_t value)
+{
+    char buffer[10];
+    size_t n{0};
+    while (value >= 0x80) {
+        buffer[n++] = (char) ((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buffer[n++] = (char) value;
+    out.append(buffer, n);
+}
+
+inline uint64_t read_varint(std::string::const_iterator& from, std::string::const_iterator end)
+{
+    uint64_t value{0};
+    for (unsigned int shift{0}; shift < 64; shift += 7) {
+        if (from == end) {
+            throw std::runtime_error{"truncated varint in binary packet"};
+        }
+        unsigned char b = (unsigned char) *from++;
+        value |= (uint64_t) (b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw std::runtime_error{"invalid varint in binary packet"};
+}
+
+inline void write_fixed64(std::string& out, uint64_t value)
+{
+    char buffer[8];
+    for (int i{0}; i < 8; ++i) {
+        buffer[i] = (char) ((value >> (8 * i)) & 0xFF);
+    }
+    out.append(buffer, 8);
+}
+
+inline uint64_t read_fixed64(std::string::const_iterator& from, std::string::const_iterator end)
+{
+    if (end - from < 8) {
+        throw std::runtime_error{"truncated binary packet"};
+    }
+    uint64_t value{0};
+    for (int i{0}; i < 8; ++i) {
+        value |= (uint64_t) (unsigned char) *from++ << (8 * i);
+    }
+    return value;
+}
+
+inline void write_string(std::string& out, const std::string& value)
+{
+    write_varint(out, value.size());
+    out.append(value);
+}
+
+inline std::string read_string(std::string::const_iterator& from, std::string::const_iterator end)
+{
+    uint64_t length{read_varint(from, end)};
+    if ((uint64_t) (end - from) < length) {
+        throw std::runtime_error{"truncated string in binary packet"};
+    }
+    std::string result{from, from + length};
+    from += length;
+    return result;
+}
+
+/* Property trees only hold strings: integers and booleans are sent in
+   binary form only when they convert back to exactly the same text */
+inline bool parse_canonical_int(const std::string& s, int64_t& value)
+{
+    size_t i{0};
+    bool negative{false};
+    if (s.size() > 0 && s[0] == '-') {
+        negative = true;
+        i = 1;
+    }
+    size_t digits{s.size() - i};
+    if (digits == 0 || digits > 18) return false;
+    if (s[i] == '0' && (digits > 1 || negative)) return false;
+    int64_t v{0};
+    for (; i < s.size(); ++i) {
+        if (s[i] < '0' || s[i] > '9') return false;
+        v = v * 10 + (s[i] - '0');
+    }
+    value = negative ? -v : v;
+    return true;
+}
+
+inline void write_key(std::string& out, uint32_t key_id, MetadataDictionary* dictionary)
+{
+    const std::string& key{KeyRegistry::instance().name(key_id)};
+    if (dictionary != nullptr) {
+        long id{dictionary->find(key_id)};
+        if (id >= 0) {
+            write_varint(out, ((uint64_t) id << 2) | KEY_REFERENCE);
+            return;
+        }
+        if (!dictionary->full()) {
+            dictionary->add(key_id);
+            write_varint(out, ((uint64_t) key.size() << 2) | KEY_REGISTER);
+            out.append(key);
+            return;
+        }
+    }
+    write_varint(out, ((uint64_t) key.size() << 2) | KEY_LITERAL);
+    out.append(key);
+}
+
+inline uint32_t read_key(std::string::const_iterator& from, std::string::const_iterator end, MetadataDictionary* dictionary)
+{
+    uint64_t tag{read_varint(from, end)};
+    uint64_t value{tag >> 2};
+    switch (tag & 0x03) {
+    case KEY_REFERENCE:
+        if (dictionary == nullptr) {
+            throw DictionaryMismatch{"binary packet references a key dictionary"};
+        }
+        return dictionary->key(value);
+    case KEY_REGISTER:
+    case KEY_LITERAL: {
+        if ((uint64_t) (end - from) < value) {
+            throw std::runtime_error{"truncated key in binary packet"};
+        }
+        uint32_t key{KeyRegistry::instance().intern(std::string{from, from + value})};
+        from += value;
+        if ((tag & 0x03) == KEY_REGISTER && dictionary != nullptr) {
+            dictionary->add(key);
+        }
+        return key;
+    }
+    default:
+        throw std::runtime_error{"invalid key tag in binary packet"};
+    }
+}
+
+/* Keys of a deferred encoding, resolved in order when the packet was
+   received: the encoded keys are skipped */
+struct ResolvedKeys {
+    const std::vector<uint32_t>& m_keys;
+    size_t m_next;
+};
+
+inline uint32_t read_key(std::string::const_iterator& from, std::string::const_iterator end, ResolvedKeys& keys)
+{
+    uint64_t tag{read_varint(from, end)};
+    if ((tag & 0x03) != KEY_REFERENCE) {
+        from += tag >> 2;
+    }
+    if (keys.m_next >= keys.m_keys.size()) {
+        throw std::runtime_error{"missing resolved key in deferred metadata"};
+    }
+    return keys.m_keys[keys.m_next++];
+}
+
+inline void write_value(std::string& out, const std::string& data)
+{
+    int64_t ivalue;
+    if (data.empty()) {
+        out.push_back((char) VALUE_EMPTY);
+    } else if (data == "true") {
+        out.push_back((char) VALUE_TRUE);
+    } else if (data == "false") {
+        out.push_back((char) VALUE_FALSE);
+    } else if (parse_canonical_int(data, ivalue)) {
+        out.push_back((char) VALUE_INT);
+        // zigzag encoding keeps small negative numbers short
+        write_varint(out, ((uint64_t) ivalue << 1) ^ (uint64_t) (ivalue >> 63));
+    } else {
+        out.push_back((char) VALUE_STRING);
+        write_string(out, data);
+    }
+}
+
+inline std::string read_value(std::string::const_iterator& from, std::string::const_iterator end)
+{
+    if (from == end) {
+        throw std::runtime_error{"truncated value in binary packet"};
+    }
+    switch ((unsigned char) *from++) {
+    case VALUE_EMPTY:
+        return std::string{};
+    case VALUE_TRUE:
+        return "true";
+    case VALUE_FALSE:
+        return "false";
+    case VALUE_INT: {
+        uint64_t zz{read_varint(from, end)};
+        int64_t value = (int64_t) (zz >> 1) ^ -(int64_t) (zz & 1);
+        return std::to_string(value);
+    }
+    case VALUE_STRING:
+        return read_string(from, end);
+    default:
+        throw std::runtime_error{"invalid value type in binary packet"};
+    }
+}
+
+/* Version 1 and nested values: text based trees */
+inline size_t estimate_size(const boost::property_tree::ptree& pt)
+{
+    size_t size{pt.data().size() + 12};
+    for (const auto& kv : pt) {
+        size += kv.first.size() + 10 + estimate_size(kv.second);
+    }
+    return size;
+}
+
+inline void write_node(std::string& out, const boost::property_tree::ptree& pt, MetadataDictionary* dictionary)
+{
+    write_value(out, pt.data());
+    write_varint(out, pt.size());
+    for (const auto& kv : pt) {
+        write_key(out, KeyRegistry::instance().intern(kv.first), dictionary);
+        write_node(out, kv.second, dictionary);
+    }
+}
+
+/* Keys are read from a dictionary (MetadataDictionary*) or ResolvedKeys */
+template<typename K>
+void read_node(std::string::const_iterator& from, std::string::const_iterator end, boost::property_tree::ptree& pt, K& keys)
+{
+    pt.data() = read_value(from, end);
+    uint64_t children{read_varint(from, end)};
+    for (uint64_t i{0}; i < children; ++i) {
+        const std::string& key{KeyRegistry::instance().name(read_key(from, end, keys))};
+        auto it = pt.push_back(std::make_pair(key, boost::property_tree::ptree{}));
+        read_node(from, end, it->second, keys);
+    }
+}
+
+/* Version 2: typed values of the flat metadata store */
+inline void write_typed_value(std::string& out, const PropertyValue& value, MetadataDictionary* dictionary)
+{
+    switch (value.type()) {
+    case PropertyValue::Type::INT: {
+        int64_t ivalue{value.int_value()};
+        out.push_back((char) VALUE_INT);
+        write_varint(out, ((uint64_t) ivalue << 1) ^ (uint64_t) (ivalue >> 63));
+        break;
+    }
+    case PropertyValue::Type::DOUBLE: {
+        double dvalue{value.double_value()};
+        uint64_t bits;
+        std::memcpy(&bits, &dvalue, sizeof(bits));
+        out.push_back((char) VALUE_DOUBLE);
+        write_fixed64(out, bits);
+        break;
+    }
+    case PropertyValue::Type::BOOL:
+        out.push_back((char) (value.bool_value() ? VALUE_TRUE : VALUE_FALSE));
+        break;
+    case PropertyValue::Type::STRING:
+        out.push_back((char) VALUE_STRING);
+        write_string(out, value.string_value());
+        break;
+    case PropertyValue::Type::NESTED:
+        out.push_back((char) VALUE_NESTED);
+        write_node(out, value.nested_value(), dictionary);
+        break;
+    default:
+        out.push_back((char) VALUE_EMPTY);
+    }
+}
+
+template<typename K>
+void read_typed_value(std::string::const_iterator& from, std::string::const_iterator end, PropertyValue& value, K& keys)
+{
+    if (from == end) {
+        throw std::runtime_error{"truncated value in binary packet"};
+    }
+    switch ((unsigned char) *from++) {
+    case VALUE_EMPTY:
+        value.set_empty();
+        break;
+    case VALUE_TRUE:
+        value.set_bool(true);
+        break;
+    case VALUE_FALSE:
+        value.set_bool(false);
+        break;
+    case VALUE_INT: {
+        uint64_t zz{read_varint(from, end)};
+        value.set_int((int64_t) (zz >> 1) ^ -(int64_t) (zz & 1));
+        break;
+    }
+    case VALUE_DOUBLE: {
+        uint64_t bits{read_fixed64(from, end)};
+        double dvalue;
+        std::memcpy(&dvalue, &bits, sizeof(dvalue));
+        value.set_double(dvalue);
+        break;
+    }
+    case VALUE_STRING: {
+        uint64_t length{read_varint(from, end)};
+        if ((uint64_t) (end - from) < length) {
+            throw std::runtime_error{"truncated string in binary packet"};
+        }
+        value.set_string(from, from + length);
+        from += length;
+        break;
+    }
+    case VALUE_NESTED: {
+        boost::property_tree::ptree pt;
+        read_node(from, end, pt, keys);
+        value.set_nested(pt);
+        break;
+    }
+    default:
+        throw std::runtime_error{"invalid value type in binary packet"};
+    }
+}
+
+/* Lazy decoding: values are skipped, keys are resolved (registering new
+   keys in the dictionary, as the sender expects) and recorded in order */
+inline void skip_bytes(std::string::const_iterator& from, std::string::const_iterator end, uint64_t length)
+{
+    if ((uint64_t) (end - from) < length) {
+        throw std::runtime_error{"truncated binary packet"};
+    }
+    from += length;
+}
+
+inline void scan_node(std::string::const_iterator& from, std::string::const_iterator end, std::vector<uint32_t>& keys, MetadataDictionary* dictionary)
+{
+    read_value(from, end);
+    uint64_t children{read_varint(from, end)};
+    for (uint64_t i{0}; i < children; ++i) {
+        keys.push_back(read_key(from, end, dictionary));
+        scan_node(from, end, keys, dictionary);
+    }
+}
+
+inline void scan_typed_value(std::string::const_iterator& from, std::string::const_iterator end, std::vector<uint32_t>& keys, MetadataDictionary* dictionary)
+{
+    if (from == end) {
+        throw std::runtime_error{"truncated value in binary packet"};
+    }
+    switch ((unsigned char) *from++) {
+    case VALUE_EMPTY:
+    case VALUE_TRUE:
+    case VALUE_FALSE:
+        break;
+    case VALUE_INT:
+        read_varint(from, end);
+        break;
+    case VALUE_DOUBLE:
+        skip_bytes(from, end, 8);
+        break;
+    case VALUE_STRING:
+        skip_bytes(from, end, read_varint(from, end));
+        break;
+    case VALUE_NESTED:
+        scan_node(from, end, keys, dictionary);
+        break;
+    default:
+        throw std::runtime_error{"invalid value type in binary packet"};
+    }
+}
+
+/* Upper bound of the encoded size of the metadata, used to size buffers once */
+inline size_t estimate_size(const Properties& properties)
+{
+    size_t size{10};
+    for (const auto& e : properties) {
+        size += 20;
+        if (e.m_value.type() == PropertyValue::Type::STRING) {
+            size += e.m_value.string_value().size();
+        } else if (e.m_value.type() == PropertyValue::Type::NESTED) {
+            size += estimate_size(e.m_value.nested_value());
+        }
+    }
+    return size;
+}
+
+inline bool is_binary(const std::string& data_string)
+{
+    return data_string.size() >= HEADER_MAGIC_SIZE
+           && (unsigned char) data_string[0] == 0xB1
+           && data_string[1] == 'P'
+           && data_string[2] == 'M';
+}
+
+/* Reads the header: returns the dictionary of the sender (nullptr if no
+   dictionary is used), from is left at the beginning of the metadata */
+inline MetadataDictionary* read_header(std::string::const_iterator& from, std::string::const_iterator end, MetadataDictionaries* dictionaries, unsigned char& version, uint64_t& session, uint64_t& length)
+{
+    if (end - from < (long) HEADER_MAGIC_SIZE) {
+        throw std::runtime_error{"truncated binary packet"};
+    }
+    from += 3;
+    version = (unsigned char) *from++;
+    if (version != BINARY_ENCODING_VERSION && version != 1) {
+        throw std::runtime_error{"unsupported binary packet version " + std::to_string(version)};
+    }
+    session = read_varint(from, end);
+    uint64_t base{read_varint(from, end)};
+    length = read_fixed64(from, end);
+    if (session == 0) {
+        return nullptr;
+    }
+    if (dictionaries == nullptr) {
+        throw DictionaryMismatch{"binary packet requires a key dictionary"};
+    }
+    MetadataDictionary* dictionary{&dictionaries->session(session)};
+    if (dictionary->size() != base) {
+        dictionaries->drop(session);
+        throw DictionaryMismatch{"key dictionary out of sync"};
+    }
+    return dictionary;
+}
+
+inline void decode_deferred(Properties& properties, const std::string& encoded, const std::vector<uint32_t>& keys)
+{
+    ResolvedKeys resolved{keys, 0};
+    std::string::const_iterator from{encoded.begin()};
+    uint64_t count{read_varint(from, encoded.end())};
+    for (uint64_t i{0}; i < count; ++i) {
+        uint32_t key{read_key(from, encoded.end(), resolved)};
+        read_typed_value(from, encoded.end(), properties.slot(key), resolved);
+    }
+}
+
+} // namespace codec
+
+/* Binary encoding split in its two parts: the header (which carries the
+   length of the metadata) and the metadata entries */
+inline void encode_properties(const Properties& properties, std::string& header, std::string& metadata, MetadataDictionary* dictionary = nullptr)
+{
+    // The dictionary size seen by the receiver is the one before this packet
+    uint64_t session{dictionary != nullptr ? dictionary->session() : 0};
+    uint64_t base{dictionary != nullptr ? dictionary->size() : 0};
+    size_t metadata_offset{metadata.size()};
+    metadata.reserve(metadata.size() + codec::estimate_size(properties));
+    codec::write_varint(metadata, properties.size());
+    for (const auto& e : properties) {
+        codec::write_key(metadata, e.m_key, dictionary);
+        codec::write_typed_value(metadata, e.m_value, dictionary);
+    }
+    header.reserve(header.size() + codec::HEADER_MAGIC_SIZE + 20 + codec::METADATA_LENGTH_SIZE);
+    header.push_back((char) 0xB1);
+    header.push_back('P');
+    header.push_back('M');
+    header.push_back((char) BINARY_ENCODING_VERSION);
+    codec::write_varint(header, session);
+    codec::write_varint(header, base);
+    codec::write_fixed64(header, metadata.size() - metadata_offset);
+}
+
+/* Append the binary encoding of the metadata to output */
+inline void encode_properties(const Properties& properties, std::string& output, MetadataDictionary* dictionary = nullptr)
+{
+    output.reserve(output.size() + codec::HEADER_MAGIC_SIZE + 20 + codec::METADATA_LENGTH_SIZE + codec::estimate_size(properties));
+    output.push_back((char) 0xB1);
+    output.push_back('P');
+    output.push_back('M');
+    output.push_back((char) BINARY_ENCODING_VERSION);
+    codec::write_varint(output, dictionary != nullptr ? dictionary->session() : 0);
+    codec::write_varint(output, dictionary != nullptr ? dictionary->size() : 0);
+    size_t length_offset{output.size()};
+    codec::write_fixed64(output, 0);
+    size_t metadata_offset{output.size()};
+    codec::write_varint(output, properties.size());
+    for (const auto& e : properties) {
+        codec::write_key(output, e.m_key, dictionary);
+        codec::write_typed_value(output, e.m_value, dictionary);
+    }
+    uint64_t length{output.size() - metadata_offset};
+    for (int i{0}; i < 8; ++i) {
+        output[length_offset + i] = (char) ((length >> (8 * i)) & 0xFF);
+    }
+}
+
+/* Decode the metadata: from is left at the beginning of the payload */
+inline void decode_properties(std::string::const_iterator& from, std::string::const_iterator end, Properties& properties, MetadataDictionaries* dictionaries = nullptr)
+{
+    unsigned char version;
+    uint64_t session;
+    uint64_t length;
+    MetadataDictionary* dictionary{codec::read_header(from, end, dictionaries, version, session, length)};
+    if ((uint64_t) (end - from) < length) {
+        throw std::runtime_error{"truncated metadata in binary packet"};
+    }
+    auto metadata_end = from + length;
+    try {
+        properties.clear();
+        if (version == 1) {
+            boost::property_tree::ptree pt;
+            codec::read_node(from, metadata_end, pt, dictionary);
+            properties.from_ptree(pt);
+        } else {
+            uint64_t count{codec::read_varint(from, metadata_end)};
+            for (uint64_t i{0}; i < count; ++i) {
+                uint32_t key{codec::read_key(from, metadata_end, dictionary)};
+                codec::read_typed_value(from, metadata_end, properties.slot(key), dictionary);
+            }
+        }
+    } catch (...) {
+        // A partially decoded packet leaves the dictionary in an unknown state
+        if (dictionary != nullptr) {
+            dictionaries->drop(session);
+        }
+        throw;
+    }
+    from = metadata_end;
+}
+
+/* Lazy variant of decode_properties for a header and a metadata section
+   received separately: only the keys are read (so that the dictionary
+   stays in sync), values are decoded when properties is first accessed */
+inline void defer_properties(const std::string& header, std::string&& metadata, Properties& properties, MetadataDictionaries* dictionaries = nullptr)
+{
+    unsigned char version;
+    uint64_t session;
+    uint64_t length;
+    std::string::const_iterator from{header.begin()};
+    MetadataDictionary* dictionary{codec::read_header(from, header.end(), dictionaries, version, session, length)};
+    if (from != header.end() || length != metadata.size()) {
+        throw std::runtime_error{"invalid metadata length in binary packet"};
+    }
+    if (version == 1) {
+        std::string joined{header};
+        joined.append(metadata);
+        from = joined.begin();
+        decode_properties(from, joined.end(), properties, dictionaries);
+        return;
+    }
+    std::vector<uint32_t>& keys = properties.deferred_keys();
+    keys.clear();
+    try {
+        from = metadata.begin();
+        uint64_t count{codec::read_varint(from, metadata.end())};
+        for (uint64_t i{0}; i < count; ++i) {
+            keys.push_back(codec::read_key(from, metadata.end(), dictionary));
+            codec::scan_typed_value(from, metadata.end(), keys, dictionary);
+        }
+    } catch (...) {
+        if (dictionary != nullptr) {
+            dictionaries->drop(session);
+        }
+        throw;
+    }
+    properties.defer(std::move(metadata), &codec::decode_deferred);
+}
+
+// *********************************************************************
+// ROUTING HEADER
+// *********************************************************************
+
+/* A small frame sent before a packet, carrying the fields needed to
+   route it (the channel), so that they are read without decoding the
+   packet: 0xB1 'P' 'R' <version> <channel> */
+inline void encode_routing(const std::string& channel, std::string& output)
+{
+    output.reserve(output.size() + codec::HEADER_MAGIC_SIZE + channel.size());
+    output.push_back((char) 0xB1);
+    output.push_back('P');
+    output.push_back('R');
+    output.push_back((char) 1);
+    output.append(channel);
+}
+
+inline bool is_routing(const std::string& frame)
+{
+    return frame.size() >= codec::HEADER_MAGIC_SIZE
+           && (unsigned char) frame[0] == 0xB1
+           && frame[1] == 'P'
+           && frame[2] == 'R';
+}
+
+inline std::string decode_routing(const std::string& frame)
+{
+    return frame.substr(codec::HEADER_MAGIC_SIZE);
+}
+
+}
+
+#endif
@@ -0,0 +1,337 @@
+/*
+ * Copyright (C)2015,2016,2017 Amos Brocco (amos.brocco@supsi.ch)
+ *                             Scuola Universitaria Professionale della
+ *                             Svizzera Italiana (SUPSI)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Scuola Universitaria Professionale della Svizzera
+ *       Italiana (SUPSI) nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef POMATRACING_H
+#define POMATRACING_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <functional>
+#include <csignal>
+#include <cstdint>
+#include <unistd.h>
+#include "PomaProperties.h"
+
+namespace poma {
+
+// *********************************************************************
+// SAMPLED TRACING
+// *********************************************************************
+//
+// One packet out of n gets a trace identifier, kept in the "poma.trace"
+// metadata property so that it crosses process boundaries. The modules
+// a traced packet goes through record spans (and queue/network hops as
+// flow events) into a ring owned by the recording thread; the rings are
+// written in the Chrome trace event format (chrome://tracing, Perfetto).
+// Timestamps are wall clock times, so that the traces written by several
+// hosts can be merged into one timeline, e.g. with
+//   jq -s '{traceEvents: map(.traceEvents) | add}' host1.json host2.json
+
+// Events kept per thread, older events are overwritten
+#ifndef POMA_TRACE_RING_SIZE
+#define POMA_TRACE_RING_SIZE 16384
+#endif
+
+struct TraceNames {
+    static const char* description()
+    {
+        return "trace name";
+    }
+};
+
+typedef NameRegistry<TraceNames> TraceNameRegistry;
+
+struct TraceEvent {
+    uint64_t m_trace;
+    uint64_t m_start_ns;
+    uint64_t m_duration_ns;
+    const char* m_category;
+    uint32_t m_name;
+    // 'X' span, 'i' instant, 's' flow start, 'f' flow end
+    char m_phase;
+};
+
+/* Written by its thread only. Each slot is a seqlock: the writer makes
+   its sequence odd while the event is written and then sets it to
+   2 * (index + 1), where index counts the events of the ring. Readers copy
+   the last POMA_TRACE_RING_SIZE events and discard a slot whose sequence
+   changed while it was copied, i.e. an event overwritten after wrap-around */
+class TraceRing {
+public:
+    TraceRing(unsigned int tid) : m_tid{tid}, m_slots(POMA_TRACE_RING_SIZE) {}
+
+    void push(const TraceEvent& e)
+    {
+        uint64_t head{m_head.load(std::memory_order_relaxed)};
+        Slot& slot{m_slots[head % POMA_TRACE_RING_SIZE]};
+        slot.m_sequence.store(2 * head + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.m_trace.store(e.m_trace, std::memory_order_relaxed);
+        slot.m_start_ns.store(e.m_start_ns, std::memory_order_relaxed);
+        slot.m_duration_ns.store(e.m_duration_ns, std::memory_order_relaxed);
+        slot.m_category.store(e.m_category, std::memory_order_relaxed);
+        slot.m_name.store(e.m_name, std::memory_order_relaxed);
+        slot.m_phase.store(e.m_phase, std::memory_order_relaxed);
+        slot.m_sequence.store(2 * head + 2, std::memory_order_release);
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    std::vector<TraceEvent> events() const
+    {
+        uint64_t head{m_head.load(std::memory_order_acquire)};
+        uint64_t from{head > POMA_TRACE_RING_SIZE ? head - POMA_TRACE_RING_SIZE : 0};
+        std::vector<TraceEvent> r;
+        r.reserve(head - from);
+        for (uint64_t i{from}; i < head; i++) {
+            const Slot& slot{m_slots[i % POMA_TRACE_RING_SIZE]};
+            uint64_t sequence{slot.m_sequence.load(std::memory_order_acquire)};
+            if (sequence != 2 * i + 2) {
+                continue;
+            }
+            TraceEvent e;
+            e.m_trace = slot.m_trace.load(std::memory_order_relaxed);
+            e.m_start_ns = slot.m_start_ns.load(std::memory_order_relaxed);
+            e.m_duration_ns = slot.m_duration_ns.load(std::memory_order_relaxed);
+            e.m_category = slot.m_category.load(std::memory_order_relaxed);
+            e.m_name = slot.m_name.load(std::memory_order_relaxed);
+            e.m_phase = slot.m_phase.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.m_sequence.load(std::memory_order_relaxed) == sequence) {
+                r.push_back(e);
+            }
+        }
+        return r;
+    }
+
+    const unsigned int m_tid;
+
+private:
+    // the fields of TraceEvent, read while they may be written
+    struct Slot {
+        std::atomic<uint64_t> m_sequence{0};
+        std::atomic<uint64_t> m_trace{0};
+        std::atomic<uint64_t> m_start_ns{0};
+        std::atomic<uint64_t> m_duration_ns{0};
+        std::atomic<const char*> m_category{nullptr};
+        std::atomic<uint32_t> m_name{0};
+        std::atomic<char> m_phase{0};
+    };
+
+    std::vector<Slot> m_slots;
+    std::atomic<uint64_t> m_head{0};
+};
+
+class Tracer {
+public:
+    // values of Packet::m_trace that are not trace identifiers
+    static const uint64_t UNDECIDED = 0;
+    static const uint64_t UNTRACED = 1;
+
+    static Tracer& instance()
+    {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    static bool enabled()
+    {
+        return flag().load(std::memory_order_relaxed);
+    }
+
+    static uint64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    /* Starts tracing one packet out of sample (0: only packets traced
+       upstream, e.g. by another host). The trace is written to output
+       by write(), and each time the process receives SIGUSR1 if on_signal */
+    void start(unsigned int sample, const std::string& output, bool on_signal)
+    {
+        m_sample = sample;
+        m_output = output;
+        flag().store(true);
+        if (on_signal) {
+            // a single thread polls the signal, however often start is called
+            std::call_once(m_signal_once, [this] {
+                std::signal(SIGUSR1, [](int) {
+                    signalled() = 1;
+                });
+                std::thread{[this] {
+                    for (;;) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                        if (signalled()) {
+                            signalled() = 0;
+                            write();
+                        }
+                    }
+                }} .detach();
+            });
+        }
+    }
+
+    /* Trace identifier for a new packet (UNTRACED for most packets) */
+    uint64_t sample()
+    {
+        struct Sampler {
+            std::mt19937_64 m_generator;
+            unsigned int m_tick;
+        };
+        static thread_local Sampler sampler{std::mt19937_64{std::random_device{}() ^ std::hash<std::thread::id>{}(std::this_thread::get_id())}, 0};
+        if (m_sample == 0 || ++sampler.m_tick % m_sample != 0) {
+            return UNTRACED;
+        }
+        // identifiers fit a positive 64 bit metadata value
+        return (sampler.m_generator() >> 2) | 2;
+    }
+
+    void span(uint64_t trace, const std::string& name, const char* category, uint64_t start_ns, uint64_t end_ns)
+    {
+        ring().push(TraceEvent{trace, start_ns, end_ns - start_ns, category, TraceNameRegistry::instance().intern(name), 'X'});
+    }
+
+    void event(char phase, uint64_t trace, const std::string& name, const char* category)
+    {
+        ring().push(TraceEvent{trace, now_ns(), 0, category, TraceNameRegistry::instance().intern(name), phase});
+    }
+
+    void write()
+    {
+        std::ofstream out{m_output};
+        write(out);
+        std::cerr << "trace written to " << m_output << std::endl;
+    }
+
+    void write(std::ostream& out)
+    {
+        std::vector<TraceRing*> rings;
+        {
+            std::unique_lock<std::mutex> lock(m_rings_lock);
+            for (auto& r : m_rings) {
+                rings.push_back(r.get());
+            }
+        }
+        char host[256] = {0};
+        gethostname(host, sizeof(host) - 1);
+        // processes of different hosts must not share an identifier
+        unsigned int pid{static_cast<unsigned int>((std::hash<std::string>{}(host) ^ getpid()) & 0x7fffffff)};
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+        out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid
+            << ",\"args\":{\"name\":\"" << escape(host) << ":" << getpid() << "\"}}";
+        for (auto r : rings) {
+            for (const auto& e : r->events()) {
+                out << ",\n{\"name\":\"" << escape(TraceNameRegistry::instance().name(e.m_name))
+                    << "\",\"cat\":\"" << e.m_category
+                    << "\",\"ph\":\"" << e.m_phase
+                    << "\",\"ts\":" << microseconds(e.m_start_ns)
+                    << ",\"pid\":" << pid << ",\"tid\":" << r->m_tid;
+                if (e.m_phase == 'X') {
+                    out << ",\"dur\":" << microseconds(e.m_duration_ns);
+                } else if (e.m_phase == 'i') {
+                    out << ",\"s\":\"t\"";
+                } else {
+                    // a flow ends at the next span of its thread
+                    out << ",\"id\":\"0x" << std::hex << e.m_trace << std::dec << "\"";
+                }
+                out << ",\"args\":{\"trace\":\"0x" << std::hex << e.m_trace << std::dec << "\"}}";
+            }
+        }
+        out << "\n]}" << std::endl;
+    }
+
+private:
+    Tracer() = default;
+    Tracer(const Tracer&) = delete;
+
+    static std::atomic<bool>& flag()
+    {
+        static std::atomic<bool> enabled{false};
+        return enabled;
+    }
+
+    static volatile std::sig_atomic_t& signalled()
+    {
+        static volatile std::sig_atomic_t value{0};
+        return value;
+    }
+
+    /* Rings are owned by the tracer: they outlive their thread */
+    TraceRing& ring()
+    {
+        static thread_local TraceRing* local{nullptr};
+        if (local == nullptr) {
+            std::unique_lock<std::mutex> lock(m_rings_lock);
+            m_rings.emplace_back(new TraceRing{(unsigned int) m_rings.size() + 1});
+            local = m_rings.back().get();
+        }
+        return *local;
+    }
+
+    static std::string microseconds(uint64_t ns)
+    {
+        std::ostringstream ss;
+        ss << ns / 1000 << "." << std::setw(3) << std::setfill('0') << ns % 1000;
+        return ss.str();
+    }
+
+    static std::string escape(const std::string& s)
+    {
+        std::string r;
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                r.push_back('\\');
+            }
+            if (static_cast<unsigned char>(c) >= 0x20) {
+                r.push_back(c);
+            }
+        }
+        return r;
+    }
+
+    unsigned int m_sample{0};
+    std::string m_output{"poma-trace.json"};
+    std::mutex m_rings_lock;
+    std::vector<std::unique_ptr<TraceRing> > m_rings;
+    std::once_flag m_signal_once;
+};
+
+}
+
+#endif
@@ -40,6 +40,9 @@
 #include <boost/filesystem.hpp>
 #include <dlfcn.h>
 #include <vector>
+#include <set>
+#include <deque>
+#include <algorithm>
 #include "PomaLoader.h"
 
 namespace poma {
@@ -112,6 +115,22 @@ void Loader::parse_json_config(std::istream& stream)
     boost::property_tree::ptree jpt {parse_json(stream)};
     boost::property_tree::ptree jmodules = jpt.get_child("modules.");
     std::string source_mid{jpt.get("source", "")};
+    bool compiled{jpt.get("compiled", false)};
+    if (jpt.count("trace") != 0) {
+        // e.g. "trace": { "sample": 1000, "output": "trace.json", "signal": true }
+        unsigned int sample{jpt.get("trace.sample", 0u)};
+        std::string output{jpt.get("trace.output", "poma-trace.json")};
+        Tracer::instance().start(sample, output, jpt.get("trace.signal", true));
+        std::cout << "Tracing one packet in " << sample << ", trace file " << output << std::endl;
+    }
+    if (jpt.count("placement") != 0) {
+        // e.g. "placement": { "policy": "compact", "cpus": "0-7" }
+        try {
+            Placement::instance().configure(jpt.get("placement.policy", std::string{"none"}), jpt.get("placement.cpus", std::string{}));
+        } catch (const std::runtime_error& e) {
+            die(e.what());
+        }
+    }
 
     for(auto &m : jmodules) {
         std::string mid {m.first.data()};
@@ -159,6 +178,7 @@ void Loader::parse_json_config(std::istream& stream)
     }
     std::cout << m_modules.size() << " modules registered" << std::endl;
     boost::property_tree::ptree jlinks = jpt.get_child("links.");
+    std::unordered_map<std::string, unsigned int> incoming;
     for(auto &l : jlinks) {
         std::string from;
         std::string to;
@@ -190,6 +210,11 @@ void Loader::parse_json_config(std::istream& stream)
             die("invalid link definition: channel cannot be empty");
         }
         m_modules[from]->connect_sink(m_modules[to], channel, do_debug);
+        incoming[to]++;
+    }
+
+    if (compiled) {
+        compile_pipeline(incoming);
     }
 
     if (source_mid != "") {
@@ -202,6 +227,50 @@ void Loader::parse_json_config(std::istream& stream)
     }
 }
 
+void Loader::compile_pipeline(const std::unordered_map<std::string, unsigned int>& incoming)
+{
+    // Modules with a single sink call it directly
+    std::unordered_map<PomaModuleType*, std::string> ids;
+    for (const auto& m : m_modules) {
+        ids[m.second.get()] = m.first;
+        m.second->fuse();
+    }
+    // A module continues the chain of its predecessor if the fused link
+    // is its only incoming link
+    std::set<std::string> continued;
+    for (const auto& m : m_modules) {
+        auto next = ids.find(m.second->fused_sink());
+        if (next != ids.end()) {
+            auto in = incoming.find(next->second);
+            if (in != incoming.end() && in->second == 1) {
+                continued.insert(next->second);
+            }
+        }
+    }
+    std::vector<std::string> heads;
+    for (const auto& m : m_modules) {
+        if (m.second->fused_sink() != nullptr && continued.count(m.first) == 0) {
+            heads.push_back(m.first);
+        }
+    }
+    std::sort(heads.begin(), heads.end());
+    unsigned int fused_links{0};
+    for (const auto& h : heads) {
+        std::string chain{h};
+        auto next = ids.find(m_modules[h]->fused_sink());
+        while (next != ids.end()) {
+            chain += " -> " + next->second;
+            fused_links++;
+            if (continued.count(next->second) == 0) {
+                break;
+            }
+            next = ids.find(m_modules[next->second]->fused_sink());
+        }
+        std::cout << "Fused chain " << chain << std::endl;
+    }
+    std::cout << fused_links << " links fused" << std::endl;
+}
+
 void Loader::parse_json_config(boost::program_options::variables_map& vm, int argc, char* argv[])
 {
     parse_json_config(vm["json"].as<std::string>());
@@ -260,30 +329,139 @@ void Loader::start_processing()
     }
 }
 
+/* Modules after the others first: the modules of a template are ready
+   before the parallel executor clones them, and the clones of modules
+   that start threads (Buffer) are initialized by their copy constructor */
 void Loader::initialize()
 {
+    std::vector<std::string> order{drain_order()};
+    for (auto id = order.rbegin(); id != order.rend(); ++id) {
+        m_modules[*id]->initialize();
+    }
+}
+
+Loader::~Loader()
+{
+    shutdown();
+}
+
+/* Modules in topological order, from the source: the links back to a
+   parallel executor (channels starting with _) are not followed, modules
+   left on a cycle come last */
+std::vector<std::string> Loader::drain_order()
+{
+    std::unordered_map<PomaModuleType*, std::string> ids;
+    for (const auto& m : m_modules) {
+        ids[m.second.get()] = m.first;
+    }
+    std::unordered_map<std::string, std::vector<std::string>> next;
+    std::unordered_map<std::string, unsigned int> incoming;
     for (const auto& m : m_modules) {
-        m.second->initialize();
+        for (const auto& c : m.second->get_channels()) {
+            if (c.empty() || c.at(0) == '_') continue;
+            for (auto s : m.second->sinks_of(c)) {
+                auto it = ids.find(s);
+                if (it != ids.end()) {
+                    next[m.first].push_back(it->second);
+                    incoming[it->second]++;
+                }
+            }
+        }
+    }
+    std::vector<std::string> names;
+    for (const auto& m : m_modules) {
+        names.push_back(m.first);
+    }
+    std::sort(names.begin(), names.end());
+    std::deque<std::string> ready;
+    auto source = ids.find(m_source);
+    if (source != ids.end() && incoming[source->second] == 0) {
+        ready.push_back(source->second);
+    }
+    for (const auto& n : names) {
+        if (incoming[n] == 0 && (source == ids.end() || n != source->second)) {
+            ready.push_back(n);
+        }
     }
+    std::vector<std::string> order;
+    std::set<std::string> done;
+    while (!ready.empty()) {
+        std::string n{ready.front()};
+        ready.pop_front();
+        order.push_back(n);
+        done.insert(n);
+        for (const auto& s : next[n]) {
+            if (--incoming[s] == 0) {
+                ready.push_back(s);
+            }
+        }
+    }
+    for (const auto& n : names) {
+        if (done.count(n) == 0) {
+            order.push_back(n);
+        }
+    }
+    return order;
 }
 
 void Loader::flush()
 {
     std::cerr << "flushing pipeline" << std::endl;
-    for (unsigned int i=0; i < m_modules.size(); i++) {
-        for (const auto& m : m_modules) {
-            //std::cerr << "\t" << m.first << "...";
-            m.second->flush();
-            std::cerr << ".";
-            //std::cerr << "ok" << std::endl;
-        }
+    // Once the modules before it are idle, nothing reaches a module again:
+    // each one is flushed once (parallel executors flush their template,
+    // and its clones, before their own results)
+    for (const auto& id : drain_order()) {
+        m_modules[id]->flush();
+        std::cerr << ".";
     }
     std::cerr << "done" << std::endl;
+    for (const auto& m : m_modules) {
+        m.second->combine();
+    }
+    print_link_stats(std::cerr);
+    if (Tracer::enabled()) {
+        Tracer::instance().write();
+    }
 	for (const auto& m : m_modules) {
 		m.second->finalize();
 	}
 }
 
+/* Stops the threads of the modules, the modules before them first */
+void Loader::shutdown()
+{
+    for (const auto& id : drain_order()) {
+        m_modules[id]->shutdown();
+    }
+}
+
+void Loader::print_link_stats(std::ostream& out)
+{
+    boost::property_tree::ptree links{PomaModuleType::link_stats_all()};
+    if (links.empty()) {
+        return;
+    }
+    out << "link statistics (latency of sampled deliveries)" << std::endl;
+    for (const auto& l : links) {
+        const boost::property_tree::ptree& link = l.second;
+        out << "\t" << link.get("from", "") << " -> " << link.get("to", "")
+            << " [" << link.get("channel", "") << "]: "
+            << link.get("packets", "0") << " packets";
+        if (link.get<uint64_t>("batches", 0) > 0) {
+            out << " in " << link.get("batches", "0") << " batches";
+        }
+        if (link.get<uint64_t>("bytes", 0) > 0) {
+            out << ", " << link.get("bytes", "0") << " bytes";
+        }
+        if (link.get<uint64_t>("samples", 0) > 0) {
+            out << ", latency mean " << link.get("mean_ns", "0") << " ns"
+                << ", p50 < " << link.get("p50_ns", "0") << " ns"
+                << ", p99 < " << link.get("p99_ns", "0") << " ns";
+        }
+        out << std::endl;
+    }
+}
+
 void Loader::configure(int argc, char* argv[])
 {
     /* Parse command line */